@@ -31,6 +31,9 @@ bool ble_central_is_connected(void);
 void ble_central_disconnect(void);
 void ble_central_attach_handler(encoded_data_handler_t raw_evt_handler);
 void ble_central_write(const uint8_t *data, uint16_t size);
+int ble_central_write_to(const uint8_t *addr, const uint8_t *data, uint16_t size);
+void ble_central_attach_ready_handler(conn_ready_handler_t ready_cb);
+void ble_central_attach_disconnected_handler(conn_ready_handler_t disconnected_cb);
 void ble_central_scan_start(void);
 int ble_central_init(ble_central_init_t *init);
 void ble_central_ready(void);
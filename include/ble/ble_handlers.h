@@ -19,7 +19,11 @@ typedef void (*susbcribe_handler_t)(char *name, char *data);
 /**@brief Raw subscription handler definition. */
 typedef void (*raw_susbcribe_handler_t)(pyrinas_event_t *evt);
 
-/**@brief Raw subscription handler definition. */
-typedef void (*encoded_data_handler_t)(const char *data, uint16_t len);
+/**@brief Encoded data handler definition. addr is the 6 byte address of the
+ * peripheral it came from or NULL if it didn't come from one. */
+typedef void (*encoded_data_handler_t)(const uint8_t *addr, const char *data, uint16_t len);
+
+/**@brief Connection ready handler. addr is the 6 byte peer address. */
+typedef void (*conn_ready_handler_t)(const uint8_t *addr);
 
 #endif
\ No newline at end of file
@@ -80,9 +80,26 @@ void ble_publish(char *name, char *data);
 // TODO: document this
 void ble_publish_raw(pyrinas_event_t event);
 
+/**@brief Function for publishing to a single connected device.
+ *
+ * @param addr 6 byte address of the device.
+ *
+ * @retval -ENOTCONN  If the device isn't connected.
+ * @retval -EAGAIN    If its queue is full.
+ */
+int ble_publish_raw_to(const uint8_t *addr, pyrinas_event_t event);
+
 // TODO: document this
 void ble_subscribe(char *name, susbcribe_handler_t handler);
 
+/**@brief Function for getting notified when a device is ready for data.
+ */
+void ble_subscribe_ready(conn_ready_handler_t handler);
+
+/**@brief Function for getting notified when a ready device disconnects.
+ */
+void ble_subscribe_disconnected(conn_ready_handler_t handler);
+
 // TODO: document this
 void ble_subscribe_raw(raw_susbcribe_handler_t handler);
 
@@ -11,6 +11,12 @@
 
 #define RSRP_THRESHOLD 97
 
+/* Called when network registration is gained or lost */
+typedef void (*cellular_reg_evt_t)(bool registered);
+
+/* Called with every valid RSRP update */
+typedef void (*cellular_rsrp_evt_t)(int32_t rsrp);
+
 /* Connect to LTE */
 void cellular_configure(void);
 
@@ -23,6 +29,15 @@ int cellular_info_get(struct modem_param_info *p_modem_info);
 /* Get cellular signal strength */
 char cellular_get_signal_strength();
 
+/* Registered to home or roaming network */
+bool cellular_is_registered();
+
+/* Get notified of registration changes */
+void cellular_register_reg_evt(cellular_reg_evt_t cb);
+
+/* Get every RSRP update */
+void cellular_register_rsrp_evt(cellular_rsrp_evt_t cb);
+
 /* Power off/disconnect */
 int cellular_off();
 
@@ -21,6 +21,12 @@ enum pyrinas_cloud_telemetry_type
   tel_type_rsrp,
   tel_type_rssi_central,    /* Bluetooth RSSI at central */
   tel_type_rssi_peripheral, /* Bluetooth RSSI at client */
+  tel_type_keyframe,        /* Full record. Only sent in delta mode. */
+  tel_type_stats,           /* Link quality and latency stats for the window */
+  tel_type_ota,             /* Throughput of the last firmware download */
+
+  /* Keys from here on are free for application fields */
+  tel_type_app_start = 32,
 };
 
 /* Used to encode and decode ota related keys */
@@ -46,7 +52,14 @@ enum pyrinas_cloud_ota_state
   ota_state_done,
   ota_state_error,
   ota_state_reboot,
-  ota_state_rebooting
+  ota_state_rebooting,
+  ota_state_progress, /* Download moved on. See pyrinas_cloud_ota_progress_get() */
+};
+
+enum pyrinas_cloud_qos
+{
+  cloud_qos_at_most_once,
+  cloud_qos_at_least_once,
 };
 
 enum pryinas_cloud_state
@@ -55,18 +68,66 @@ enum pryinas_cloud_state
   cloud_state_connected,
 };
 
+/* Built in telemetry fields. The data struct, encoder, decoder and
+ * worst case encoded size are all generated from this table.
+ *
+ * X(name, key, kind, type, count, deadband) where kind is uint, int or text.
+ * count is the buffer size for text fields and 1 otherwise. In delta mode
+ * a number is only sent once it moves more than deadband. */
+#define PYRINAS_CLOUD_TELEMETRY_FIELDS(X)                                                           \
+  X(version, tel_type_version, text, char, 24, 0)                                                   \
+  X(rsrp, tel_type_rsrp, uint, char, 1, CONFIG_PYRINAS_CLOUD_TELEMETRY_RSRP_DEADBAND)               \
+  X(central_rssi, tel_type_rssi_central, int, int8_t, 1, CONFIG_PYRINAS_CLOUD_TELEMETRY_RSSI_DEADBAND) \
+  X(peripheral_rssi, tel_type_rssi_peripheral, int, int8_t, 1, CONFIG_PYRINAS_CLOUD_TELEMETRY_RSSI_DEADBAND) \
+  X(keyframe, tel_type_keyframe, uint, uint8_t, 1, 0)
+
+#define PYRINAS_CLOUD_TELEMETRY_MEMBER_uint(name, type, count) type name
+#define PYRINAS_CLOUD_TELEMETRY_MEMBER_int(name, type, count) type name
+#define PYRINAS_CLOUD_TELEMETRY_MEMBER_text(name, type, count) type name[count]
+
+#define PYRINAS_CLOUD_TELEMETRY_MEMBER(name, key, kind, type, count, deadband) \
+  bool has_##name;                                                   \
+  PYRINAS_CLOUD_TELEMETRY_MEMBER_##kind(name, type, count);
+
 struct pyrinas_cloud_telemetry_data
 {
-  bool has_version;
-  char version[24];
-  bool has_rsrp;
-  char rsrp;
-  bool has_central_rssi;
-  int8_t central_rssi;
-  bool has_peripheral_rssi;
-  int8_t peripheral_rssi;
+  PYRINAS_CLOUD_TELEMETRY_FIELDS(PYRINAS_CLOUD_TELEMETRY_MEMBER)
+};
+
+/* Application telemetry fields */
+enum pyrinas_cloud_telemetry_field_type
+{
+  tel_field_uint,
+  tel_field_int,
+  tel_field_text,
 };
 
+union pyrinas_cloud_telemetry_value
+{
+  uint64_t u;
+  int64_t i;
+  const char *text;
+};
+
+struct pyrinas_cloud_telemetry_field
+{
+  int64_t key;
+  enum pyrinas_cloud_telemetry_field_type type;
+  size_t max_size; /* Longest text, or bytes of the integer type */
+  /* Fill in the current value. Return false to leave it out. */
+  bool (*get)(union pyrinas_cloud_telemetry_value *value);
+};
+
+/* Add a field to the central's telemetry without touching the codec.
+ * key must be tel_type_app_start or above. */
+#define PYRINAS_CLOUD_TELEMETRY_FIELD_DEFINE(_name, _key, _type, _max_size, _get) \
+  const Z_STRUCT_SECTION_ITERABLE(pyrinas_cloud_telemetry_field, _name) = {       \
+      .key = _key,                                                                \
+      .type = _type,                                                              \
+      .max_size = _max_size,                                                      \
+      .get = _get,                                                                \
+  }
+
 union pyrinas_cloud_ota_version
 {
   struct
@@ -86,6 +147,25 @@ struct pyrinas_cloud_ota_data
   char host[128];
   char file[128];
   bool force;
+  /* Patch from base to version. Only set if the manifest has one. */
+  bool has_delta;
+  union pyrinas_cloud_ota_version base;
+  char delta_file[128];
+  /* Full image. size is 0 and has_digest false if the manifest has none. */
+  uint32_t size;
+  bool has_digest;
+  uint8_t digest[32]; /* SHA-256 */
+};
+
+/* Download progress of the current image */
+struct pyrinas_cloud_ota_progress
+{
+  uint32_t bytes;            /* Received so far, including earlier attempts */
+  uint32_t total;            /* Image size. 0 until the server reports it. */
+  uint32_t resumed_from;     /* Where this attempt picked up */
+  uint32_t throughput;       /* Bytes per second for this attempt */
+  uint32_t flash_throughput; /* Bytes per second erased and written */
+  uint8_t percent;
 };
 
 /* Callbacks */
@@ -93,13 +173,61 @@ typedef void (*pyrinas_cloud_ota_state_evt_t)(enum pyrinas_cloud_ota_state evt);
 typedef void (*pyrinas_cloud_state_evt_t)(enum pryinas_cloud_state evt);
 typedef void (*pyrinas_cloud_application_cb_t)(const uint8_t *topic, size_t topic_len, const uint8_t *data, size_t data_len);
 
-typedef struct
+/* Streaming variant. Called once per segment as it comes off the socket.
+ * offset is where data sits in the full payload of total_len bytes. */
+typedef void (*pyrinas_cloud_application_stream_cb_t)(const uint8_t *topic, size_t topic_len,
+                                                      const uint8_t *data, size_t data_len,
+                                                      size_t offset, size_t total_len);
+
+/* Publish completion. result is 0 once delivered (PUBACK for QoS1, sent for QoS0).
+ * latency_ms is the PUBACK round trip. Runs in the cloud thread. */
+typedef void (*pyrinas_cloud_publish_cb_t)(int result, uint32_t latency_ms, void *user_data);
+
+struct pyrinas_cloud_publish_opts
+{
+  enum pyrinas_cloud_qos qos;
+  pyrinas_cloud_publish_cb_t cb;
+  void *user_data;
+};
+
+/* Connection setup cost. Times are in ms. */
+struct pyrinas_cloud_connect_stats
 {
-  pyrinas_cloud_application_cb_t cb;
-  char full_topic[sizeof(CONFIG_PYRINAS_CLOUD_MQTT_APPLICATION_SUB_TOPIC) + IMEI_LEN + CONFIG_PYRINAS_CLOUD_APPLICATION_EVENT_NAME_MAX_SIZE];
-  char topic[CONFIG_PYRINAS_CLOUD_APPLICATION_EVENT_NAME_MAX_SIZE];
-  size_t topic_len;
-} pryinas_cloud_application_cb_entry_t;
+  uint32_t count;
+  uint32_t handshake_ms;       /* TCP + TLS handshake of the last connect */
+  uint32_t handshake_max_ms;
+  uint32_t handshake_total_ms; /* Divide by count for the average */
+  uint32_t connack_ms;         /* Connect start to CONNACK of the last connect */
+  uint32_t tx_kb;              /* Modem data used by the last connect. Needs */
+  uint32_t rx_kb;              /* CONFIG_PYRINAS_CLOUD_CONNECT_DATA_STATS */
+  uint32_t ready_ms;           /* Connect start to OTA ready, first time since boot */
+  bool ready_cached;           /* Ready came from the manifest cache */
+};
+
+/* Telemetry timing in seconds. Sends back off from base_sec towards max_sec
+ * while nothing changes and drop to min_sec on anomalies. */
+struct pyrinas_cloud_telemetry_interval
+{
+  uint32_t min_sec;
+  uint32_t base_sec;
+  uint32_t max_sec;
+};
+
+/* Per peripheral counters since it was added to the table */
+struct pyrinas_cloud_peripheral_info
+{
+  uint8_t addr[6];
+  bool registered;
+  bool connected;
+  uint32_t events;
+  uint32_t bytes;
+  uint32_t errors;
+  int64_t last_seen;
+};
+
+/* Delivers a downlink to one peripheral. Return -ENOTCONN if it isn't
+ * connected or -EAGAIN if it can't take more right now to have it queued. */
+typedef int (*pyrinas_cloud_downlink_cb_t)(const uint8_t *peripheral_addr, pyrinas_event_t *evt);
 
 /* Init MQTT Client */
 void pyrinas_cloud_init(struct k_work_q *task_q, pyrinas_cloud_ota_state_evt_t cb);
@@ -117,22 +245,59 @@ bool pyrinas_cloud_is_connected();
 
 void pyrinas_cloud_register_state_evt(pyrinas_cloud_state_evt_t cb);
 
-/* Register client device */
+/* Get a copy of the connection setup metrics */
+void pyrinas_cloud_get_connect_stats(struct pyrinas_cloud_connect_stats *stats);
+
+/* Change telemetry timing. Also set remotely on the config topic. Persisted when settings are enabled. */
+int pyrinas_cloud_telemetry_interval_set(const struct pyrinas_cloud_telemetry_interval *interval);
+void pyrinas_cloud_telemetry_interval_get(struct pyrinas_cloud_telemetry_interval *interval);
+
+/* Something worth reporting happened. Sends telemetry within min_sec. */
+void pyrinas_cloud_telemetry_anomaly(void);
+
+/* Register client device. uid is the 12 character hex address.
+ * Registered devices keep their place in the peripheral table. */
 int pyrinas_cloud_register_uid(char *uid);
 
 /* Unregister client device */
 int pyrinas_cloud_unregister_uid(char *uid);
 
-/* Subscribe and listen for central specific application events */
+/* Route downlinks on the peripheral topic through cb */
+void pyrinas_cloud_register_downlink(pyrinas_cloud_downlink_cb_t cb);
+
+/* Peripheral (re)connected. Sends anything queued for it and telemetry
+ * early. */
+void pyrinas_cloud_peripheral_connected(const uint8_t *peripheral_addr);
+
+/* Peripheral dropped off. Sends telemetry early. */
+void pyrinas_cloud_peripheral_disconnected(const uint8_t *peripheral_addr);
+
+/* Counters for a peripheral in the table. Returns -ENOENT if it isn't there. */
+int pyrinas_cloud_peripheral_info_get(const uint8_t *addr, struct pyrinas_cloud_peripheral_info *info);
+
+/* Copy of the download progress. Returns -ENODATA if no download is
+ * running. Needs CONFIG_PYRINAS_CLOUD_FOTA. */
+int pyrinas_cloud_ota_progress_get(struct pyrinas_cloud_ota_progress *progress);
+
+/* Subscribe and listen for central specific application events.
+ * name may contain MQTT style + and # wildcards. The callback gets the
+ * topic that actually arrived. */
 int pyrinas_cloud_subscribe(char *name, pyrinas_cloud_application_cb_t callback);
 
-/* Unsubscribe from event */
+/* Same as pyrinas_cloud_subscribe but payloads of any size are delivered
+ * in segments instead of being limited by CONFIG_PYRINAS_CLOUD_MQTT_PAYLOAD_BUFFER_SIZE */
+int pyrinas_cloud_subscribe_stream(char *name, pyrinas_cloud_application_stream_cb_t callback);
+
+/* Unsubscribe all callbacks registered with this name */
 int pyrinas_cloud_unsubscribe(char *name);
 
 /* Publish typed Pyrinas event */
 int pyrinas_cloud_publish_evt(pyrinas_event_t *evt);
 
-/* Publish central event to the cloud */
+/* Publish central event to the cloud. Queued for the cloud thread, safe to call from any context. */
 int pyrinas_cloud_publish(char *type, uint8_t *data, size_t len);
 
+/* Same as pyrinas_cloud_publish with QoS and completion options. opts may be NULL. */
+int pyrinas_cloud_publish_ex(char *type, uint8_t *data, size_t len, const struct pyrinas_cloud_publish_opts *opts);
+
 #endif /* _PYRINAS_CLOUD_H */
\ No newline at end of file
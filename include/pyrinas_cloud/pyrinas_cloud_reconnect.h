@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _PYRINAS_CLOUD_RECONNECT_H
+#define _PYRINAS_CLOUD_RECONNECT_H
+
+#include <zephyr.h>
+
+struct pyrinas_cloud_reconnect_stats
+{
+  uint32_t attempts;
+  uint32_t successes;
+  uint32_t failures;
+  uint32_t consecutive_failures;
+  uint32_t deferred; /* Times we waited for LTE instead of trying */
+  uint32_t next_delay_ms;
+};
+
+/* Set up the reconnect policy. Attempts run on task_q. */
+void pyrinas_cloud_reconnect_init(struct k_work_q *task_q);
+
+/* Connection was lost. Schedules the next attempt with backoff and jitter,
+ * or waits for LTE registration if the network is down. */
+void pyrinas_cloud_reconnect_start(void);
+
+/* Get a copy of the reconnect counters */
+void pyrinas_cloud_reconnect_get_stats(struct pyrinas_cloud_reconnect_stats *stats);
+
+#endif /* _PYRINAS_CLOUD_RECONNECT_H */
\ No newline at end of file
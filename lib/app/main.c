@@ -22,6 +22,7 @@
 #if defined(CONFIG_PYRINAS_CLOUD_ENABLED)
 #include <bsd.h>
 #include <pyrinas_cloud/pyrinas_cloud.h>
+#include <pyrinas_cloud/pyrinas_cloud_reconnect.h>
 #endif
 
 #include <cellular/cellular.h>
@@ -44,9 +45,6 @@ K_THREAD_STACK_DEFINE(main_tasks_stack_area,
 					  CONFIG_APPLICATION_WORKQUEUE_STACK_SIZE);
 static struct k_work_q main_tasks_q;
 
-/* Work defs */
-static struct k_delayed_work reconnect_work;
-
 #endif
 
 #if defined(CONFIG_FILE_SYSTEM_LITTLEFS)
@@ -163,6 +161,17 @@ void pyrinas_cloud_ota_evt_handler(enum pyrinas_cloud_ota_state state)
 		/* Start main thread */
 		k_sem_give(&main_thread_proceed_sem);
 		break;
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA)
+	case ota_state_progress:
+	{
+		struct pyrinas_cloud_ota_progress progress;
+
+		if (pyrinas_cloud_ota_progress_get(&progress) == 0)
+			LOG_INF("FOTA %d%% (%d/%d bytes, %d B/s, flash %d B/s)", progress.percent, progress.bytes, progress.total,
+					progress.throughput, progress.flash_throughput);
+		break;
+	}
+#endif
 	default:
 		LOG_INF("FOTA in progress.");
 		break;
@@ -175,7 +184,7 @@ static void cloud_state_callback(enum pryinas_cloud_state state)
 	{
 	case cloud_state_disconnected:
 		LOG_WRN("Disconnected!");
-		k_delayed_work_submit_to_queue(&main_tasks_q, &reconnect_work, K_SECONDS(2));
+		pyrinas_cloud_reconnect_start();
 		break;
 
 	case cloud_state_connected:
@@ -184,19 +193,16 @@ static void cloud_state_callback(enum pryinas_cloud_state state)
 	}
 }
 
-void reconnect_work_fn(struct k_work *item)
+#if defined(CONFIG_PYRINAS_CLOUD_DOWNLINK) && defined(CONFIG_PYRINAS_CENTRAL_ENABLED)
+/* Downlinks only go to the peripheral they're addressed to */
+static int downlink_send(const uint8_t *peripheral_addr, pyrinas_event_t *evt)
 {
-	LOG_INF("Reconnect work");
-
-	int err = pyrinas_cloud_connect();
-	if (err && err != EINPROGRESS)
-	{
-		LOG_WRN("Unable to re-connect. Err: %d", err);
-		k_delayed_work_submit_to_queue(&main_tasks_q, &reconnect_work, K_SECONDS(10));
-	}
+	return ble_publish_raw_to(peripheral_addr, *evt);
 }
 #endif
 
+#endif
+
 void main(void)
 {
 
@@ -272,8 +278,8 @@ void main(void)
 	/* Configure modem params */
 	cellular_info_init();
 
-	/* Work init*/
-	k_delayed_work_init(&reconnect_work, reconnect_work_fn);
+	/* Backoff and LTE aware reconnects */
+	pyrinas_cloud_reconnect_init(&main_tasks_q);
 
 	/* Init Pyrinas Cloud */
 	pyrinas_cloud_init(&main_tasks_q, pyrinas_cloud_ota_evt_handler);
@@ -281,6 +287,17 @@ void main(void)
 	/* Callback time*/
 	pyrinas_cloud_register_state_evt(cloud_state_callback);
 
+#if defined(CONFIG_PYRINAS_CENTRAL_ENABLED)
+	/* Peripherals coming and going tighten telemetry */
+	ble_subscribe_ready(pyrinas_cloud_peripheral_connected);
+	ble_subscribe_disconnected(pyrinas_cloud_peripheral_disconnected);
+
+#if defined(CONFIG_PYRINAS_CLOUD_DOWNLINK)
+	/* Route peripheral downlinks over BLE. Queued ones go on connect. */
+	pyrinas_cloud_register_downlink(downlink_send);
+#endif
+#endif
+
 	/* Connect */
 	__ASSERT(pyrinas_cloud_connect() == 0, "Unable to connect to MQTT. Restarting..");
 
@@ -49,6 +49,8 @@ static struct ble_nus_c_connection m_conns[CONFIG_BT_MAX_CONN];
 
 /* Static local handlers */
 static encoded_data_handler_t m_evt_cb = NULL;
+static conn_ready_handler_t m_ready_cb = NULL;
+static conn_ready_handler_t m_disconnected_cb = NULL;
 
 /* Related work handler for rx ring buf*/
 static void bt_send_work_handler(struct k_work *work);
@@ -308,6 +310,47 @@ void ble_central_write(const uint8_t *data, uint16_t len)
 		k_delayed_work_submit(&bt_send_work, K_NO_WAIT);
 }
 
+int ble_central_write_to(const uint8_t *addr, const uint8_t *data, uint16_t len)
+{
+
+		if (len > BLE_QUEUE_ITEM_SIZE)
+		{
+				LOG_ERR("Payload size too large!");
+				return -EMSGSIZE;
+		}
+
+		for (int i = 0; i < CONFIG_BT_MAX_CONN; i++)
+		{
+				// Only the connection for this address
+				if (atomic_get(&m_conns[i].ready) != 1 ||
+						m_conns[i].conn == NULL ||
+						memcmp(bt_conn_get_dst(m_conns[i].conn)->a.val, addr, sizeof(bt_addr_t)) != 0)
+				{
+						continue;
+				}
+
+				ble_fifo_data_t evt;
+
+				// Copy over data to struct
+				memcpy(evt.data, data, len);
+				evt.len = len;
+
+				int err = k_msgq_put(&m_conns[i].q, &evt, K_NO_WAIT);
+				if (err)
+				{
+						LOG_WRN("%d: queue full", i);
+						return -EAGAIN;
+				}
+
+				// Start the worker thread
+				k_delayed_work_submit(&bt_send_work, K_NO_WAIT);
+
+				return 0;
+		}
+
+		return -ENOTCONN;
+}
+
 static void force_disconnect(struct bt_conn *conn)
 {
 		// Disconnect from device
@@ -380,6 +423,12 @@ static void discovery_completed(struct bt_gatt_dm *dm, void *context)
 				return;
 		}
 
+		// Anything waiting for this device can go now
+		if (m_ready_cb)
+		{
+				m_ready_cb(bt_conn_get_dst(dev_conn->conn)->a.val);
+		}
+
 		// Start scanning if we're < max connections
 		if (atomic_get(&m_num_connected) < CONFIG_BT_MAX_CONN)
 		{
@@ -490,9 +539,16 @@ static void disconnected(struct bt_conn *conn, uint8_t reason)
 				// Purge data
 				k_msgq_purge(&m_conns[i].q);
 
-				// Reset ready flag
-				atomic_set(&m_conns[i].ready, 0);
-				atomic_dec(&m_num_connected);
+				// Only devices that made it to ready were counted and announced
+				if (atomic_set(&m_conns[i].ready, 0))
+				{
+						atomic_dec(&m_num_connected);
+
+						if (m_disconnected_cb)
+						{
+								m_disconnected_cb(bt_conn_get_dst(conn)->a.val);
+						}
+				}
 
 				// Set this flag to start adv at the end
 				advertise = true;
@@ -624,11 +680,12 @@ static void ble_data_sent(void *ctx, uint8_t err, const uint8_t *const data, uin
 
 static uint8_t ble_data_received(void *ctx, const uint8_t *const data, uint16_t len)
 {
+		struct bt_gatt_nus_c *nus_c = ctx;
 
-		// Sends the data forward if the callback is valid
-		if (m_evt_cb)
+		// Sends the data forward with who sent it if the callback is valid
+		if (m_evt_cb && nus_c->conn)
 		{
-				m_evt_cb(data, len);
+				m_evt_cb(bt_conn_get_dst(nus_c->conn)->a.val, data, len);
 		}
 
 		return BT_GATT_ITER_CONTINUE;
@@ -663,6 +720,16 @@ void ble_central_attach_handler(encoded_data_handler_t evt_cb)
 		m_evt_cb = evt_cb;
 }
 
+void ble_central_attach_ready_handler(conn_ready_handler_t ready_cb)
+{
+		m_ready_cb = ready_cb;
+}
+
+void ble_central_attach_disconnected_handler(conn_ready_handler_t disconnected_cb)
+{
+		m_disconnected_cb = disconnected_cb;
+}
+
 int ble_central_init(ble_central_init_t *p_init)
 {
 
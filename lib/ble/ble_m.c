@@ -208,6 +208,44 @@ void ble_publish_raw(protobuf_event_t event)
     #endif
 }
 
+int ble_publish_raw_to(const uint8_t *addr, protobuf_event_t event)
+{
+
+    #if defined(CONFIG_PYRINAS_CENTRAL_ENABLED)
+    // Encode value
+    pb_byte_t output[protobuf_event_t_size];
+
+    // Output buffer
+    pb_ostream_t ostream = pb_ostream_from_buffer(output, sizeof(output));
+
+    if (!pb_encode(&ostream, protobuf_event_t_fields, &event))
+    {
+        LOG_ERR("Unable to encode: %s", log_strdup(PB_GET_ERROR(&ostream)));
+        return -EINVAL;
+    }
+
+    // Only to the device in question
+    return ble_central_write_to(addr, output, ostream.bytes_written);
+    #else
+    // Peripherals only have the one connection
+    return -ENOTSUP;
+    #endif
+}
+
+void ble_subscribe_ready(conn_ready_handler_t handler)
+{
+    #if defined(CONFIG_PYRINAS_CENTRAL_ENABLED)
+    ble_central_attach_ready_handler(handler);
+    #endif
+}
+
+void ble_subscribe_disconnected(conn_ready_handler_t handler)
+{
+    #if defined(CONFIG_PYRINAS_CENTRAL_ENABLED)
+    ble_central_attach_disconnected_handler(handler);
+    #endif
+}
+
 void ble_subscribe(char *name, susbcribe_handler_t handler)
 {
 
@@ -267,7 +305,7 @@ void scan_start(void)
 
 /**@brief Function for queuing events so they can read in main context.
  */
-static void ble_evt_handler(const char *data, uint16_t len)
+static void ble_evt_handler(const uint8_t *addr, const char *data, uint16_t len)
 {
 
     // If data is valid and len > 0
@@ -285,6 +323,12 @@ static void ble_evt_handler(const char *data, uint16_t len)
             return;
         }
 
+        // Downlinks for this device go back over the same connection
+        if (addr)
+        {
+            memcpy(evt.peripheral_addr, addr, sizeof(evt.peripheral_addr));
+        }
+
         // There is a *slight* mismatch in size. So for good measure use a buffer the same size..
         uint8_t buf[BLE_INCOMING_PROTOBUF_SIZE];
         memcpy(buf, &evt, sizeof(evt));
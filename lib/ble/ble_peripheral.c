@@ -280,9 +280,9 @@ static void bt_receive_cb(struct bt_conn *conn, const uint8_t *const data,
     uint16_t len)
 {
 
-    // Forward it back if the evt handler is valid
+    // Forward it back if the evt handler is valid. Only centrals talk to us.
     if (m_evt_cb)
-        m_evt_cb(data, len);
+        m_evt_cb(NULL, data, len);
 }
 
 static void bt_sent_cb(struct bt_conn *conn)
@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <stdio.h>
+#include <string.h>
+#include <soc.h>
+
+#include <pyrinas_cloud/pyrinas_cloud.h>
+
+#include "pyrinas_cloud_codec.h"
+#include "pyrinas_cloud_helper.h"
+#include "pyrinas_cloud_dispatch.h"
+
+#include <proto/command.pb.h>
+#include <pb_decode.h>
+#include <pb_encode.h>
+
+/* Run each benchmark for at least this long. The kernel timer on
+ * nRF91 is 32 kHz so short runs don't resolve. */
+#define BENCH_MIN_MS 200
+#define BENCH_BATCH 64
+
+#define BENCH_STACK_SIZE 2048
+#define BENCH_PRIORITY 5
+
+/* Registered handlers for the dispatch benchmark */
+#define BENCH_TOPIC_COUNT 16
+
+struct bench
+{
+    const char *name;
+    void (*setup)(void);
+    void (*run)(void);
+};
+
+struct bench_result
+{
+    uint32_t iterations;
+    uint32_t elapsed_cycles;
+};
+
+K_THREAD_STACK_DEFINE(bench_stack, BENCH_STACK_SIZE);
+static struct k_thread bench_thread;
+
+/* Inputs and outputs shared between setup and run */
+static uint8_t cbor_buf[TELEMETRY_ENCODED_MAX_SIZE];
+static size_t cbor_len;
+static uint8_t ota_buf[256];
+static size_t ota_len;
+static pb_byte_t pb_buf[protobuf_event_t_size];
+static size_t pb_len;
+
+static struct pyrinas_cloud_telemetry_data telemetry;
+static struct pyrinas_cloud_ota_data ota_data;
+static protobuf_event_t event;
+
+static union pyrinas_cloud_ota_version version_a = {
+    .major = 1,
+    .minor = 2,
+    .patch = 3,
+    .commit = 4,
+    .hash = "abcdefgh",
+};
+
+static union pyrinas_cloud_ota_version version_b = {
+    .major = 1,
+    .minor = 2,
+    .patch = 4,
+    .commit = 0,
+    .hash = "abcdefgh",
+};
+
+static char dispatch_topic[CONFIG_PYRINAS_CLOUD_APPLICATION_EVENT_NAME_MAX_SIZE];
+static size_t dispatch_topic_len;
+
+static void noop_run(void)
+{
+}
+
+static void telemetry_setup(void)
+{
+    memset(&telemetry, 0, sizeof(telemetry));
+
+    telemetry.has_version = true;
+    strncpy(telemetry.version, "1.2.3-4-abcdefgh", sizeof(telemetry.version) - 1);
+    telemetry.has_rsrp = true;
+    telemetry.rsrp = 45;
+    telemetry.has_central_rssi = true;
+    telemetry.central_rssi = -60;
+    telemetry.has_peripheral_rssi = true;
+    telemetry.peripheral_rssi = -72;
+}
+
+static void encode_telemetry_run(void)
+{
+    encode_telemetry_data(&telemetry, true, cbor_buf, sizeof(cbor_buf), &cbor_len);
+}
+
+static void decode_telemetry_setup(void)
+{
+    telemetry_setup();
+    encode_telemetry_run();
+}
+
+static void decode_telemetry_run(void)
+{
+    decode_telemetry_data(&telemetry, cbor_buf, cbor_len);
+}
+
+static void encode_ota_request_run(void)
+{
+    encode_ota_request(ota_cmd_type_check, cbor_buf, sizeof(cbor_buf), &cbor_len);
+}
+
+/* Same layout the backend sends on the OTA topic */
+static void decode_ota_setup(void)
+{
+    UsefulBuf buf = {
+        .ptr = ota_buf,
+        .len = sizeof(ota_buf)};
+    QCBOREncodeContext ec;
+    QCBOREncode_Init(&ec, buf);
+
+    QCBOREncode_OpenMap(&ec);
+
+    QCBOREncode_OpenMapInMapN(&ec, version_pos);
+    QCBOREncode_AddUInt64ToMapN(&ec, major_pos, version_b.major);
+    QCBOREncode_AddUInt64ToMapN(&ec, minor_pos, version_b.minor);
+    QCBOREncode_AddUInt64ToMapN(&ec, patch_pos, version_b.patch);
+    QCBOREncode_AddUInt64ToMapN(&ec, commit_pos, version_b.commit);
+    QCBOREncode_OpenArrayInMapN(&ec, hash_pos);
+    for (int i = 0; i < sizeof(version_b.hash); i++)
+        QCBOREncode_AddUInt64(&ec, version_b.hash[i]);
+    QCBOREncode_CloseArray(&ec);
+    QCBOREncode_CloseMap(&ec);
+
+    QCBOREncode_AddSZStringToMapN(&ec, host_pos, "https://ota.example.com");
+    QCBOREncode_AddSZStringToMapN(&ec, file_pos, "/fw/app_update.bin");
+    QCBOREncode_AddBoolToMapN(&ec, force_pos, false);
+
+    QCBOREncode_CloseMap(&ec);
+
+    QCBOREncode_FinishGetSize(&ec, &ota_len);
+}
+
+static void decode_ota_run(void)
+{
+    decode_ota_data(&ota_data, ota_buf, ota_len);
+}
+
+static void ver_comp_run(void)
+{
+    ver_comp(&version_a, &version_b);
+}
+
+static void pb_setup(void)
+{
+    memset(&event, 0, sizeof(event));
+
+    event.name.size = strlen("ping");
+    memcpy(event.name.bytes, "ping", event.name.size);
+
+    event.data.size = MIN(32, sizeof(event.data.bytes));
+    memset(event.data.bytes, 'x', event.data.size);
+}
+
+static void pb_encode_run(void)
+{
+    pb_ostream_t ostream = pb_ostream_from_buffer(pb_buf, sizeof(pb_buf));
+
+    pb_encode(&ostream, protobuf_event_t_fields, &event);
+
+    pb_len = ostream.bytes_written;
+}
+
+static void pb_decode_setup(void)
+{
+    pb_setup();
+    pb_encode_run();
+}
+
+static void pb_decode_run(void)
+{
+    pb_istream_t istream = pb_istream_from_buffer(pb_buf, pb_len);
+
+    pb_decode(&istream, protobuf_event_t_fields, &event);
+}
+
+static void dispatch_cb(const uint8_t *topic, size_t topic_len, const uint8_t *data, size_t data_len)
+{
+}
+
+static void dispatch_setup(void)
+{
+    static bool registered;
+    char topic[CONFIG_PYRINAS_CLOUD_APPLICATION_EVENT_NAME_MAX_SIZE];
+
+    /* Registrations outlive the benchmark thread */
+    if (!registered)
+    {
+        for (int i = 0; i < BENCH_TOPIC_COUNT; i++)
+        {
+            size_t len = snprintf(topic, sizeof(topic), "event/%d", i);
+            pyrinas_cloud_dispatch_add(topic, len, dispatch_cb);
+        }
+
+        /* One wildcard so the wildcard list gets walked too */
+        pyrinas_cloud_dispatch_add("config/+", strlen("config/+"), dispatch_cb);
+
+        registered = true;
+    }
+
+    /* Last one in */
+    dispatch_topic_len = snprintf(dispatch_topic, sizeof(dispatch_topic), "event/%d", BENCH_TOPIC_COUNT - 1);
+}
+
+static void dispatch_run(void)
+{
+    pyrinas_cloud_dispatch(dispatch_topic, dispatch_topic_len, "1", 1);
+}
+
+static const struct bench benches[] = {
+    {"baseline", NULL, noop_run},
+    {"encode_telemetry_data", telemetry_setup, encode_telemetry_run},
+    {"decode_telemetry_data", decode_telemetry_setup, decode_telemetry_run},
+    {"encode_ota_request", NULL, encode_ota_request_run},
+    {"decode_ota_data", decode_ota_setup, decode_ota_run},
+    {"ver_comp", NULL, ver_comp_run},
+    {"pb_encode_event", pb_setup, pb_encode_run},
+    {"pb_decode_event", pb_decode_setup, pb_decode_run},
+    {"pyrinas_cloud_dispatch", dispatch_setup, dispatch_run},
+};
+
+static void bench_entry(void *p1, void *p2, void *p3)
+{
+    const struct bench *b = p1;
+    struct bench_result *result = p2;
+    uint32_t min_cycles = k_ms_to_cyc_ceil32(BENCH_MIN_MS);
+
+    if (b->setup)
+        b->setup();
+
+    /* First call takes the cache misses */
+    b->run();
+
+    uint32_t start = k_cycle_get_32();
+
+    do
+    {
+        for (int i = 0; i < BENCH_BATCH; i++)
+            b->run();
+
+        result->iterations += BENCH_BATCH;
+        result->elapsed_cycles = k_cycle_get_32() - start;
+
+    } while (result->elapsed_cycles < min_cycles);
+}
+
+static void bench_report(const struct bench *b, const struct bench_result *result, size_t stack_used)
+{
+    uint64_t ns = k_cyc_to_ns_floor64(result->elapsed_cycles);
+    uint32_t ns_per_op = ns / result->iterations;
+
+    /* Timer cycles are too coarse to be useful. Scale to CPU cycles. */
+    uint32_t cycles_per_op = (uint64_t)ns_per_op * SystemCoreClock / NSEC_PER_SEC;
+
+    printk("{\"bench\":\"%s\",\"iterations\":%u,\"ns_per_op\":%u,\"cycles_per_op\":%u,\"stack_bytes\":%u}\n",
+           b->name, result->iterations, ns_per_op, cycles_per_op, stack_used);
+}
+
+void main(void)
+{
+    printk("# pyrinas benchmark. One JSON object per line.\n");
+
+    for (int i = 0; i < ARRAY_SIZE(benches); i++)
+    {
+        struct bench_result result = {0};
+        size_t unused = 0;
+
+        /* Fresh thread each time so the stack watermark is per benchmark */
+        k_thread_create(&bench_thread, bench_stack, K_THREAD_STACK_SIZEOF(bench_stack),
+                        bench_entry, (void *)&benches[i], &result, NULL,
+                        BENCH_PRIORITY, 0, K_NO_WAIT);
+
+        k_thread_join(&bench_thread, K_FOREVER);
+
+        k_thread_stack_space_get(&bench_thread, &unused);
+
+        bench_report(&benches[i], &result, K_THREAD_STACK_SIZEOF(bench_stack) - unused);
+    }
+
+    printk("# done\n");
+}
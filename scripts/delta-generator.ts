@@ -0,0 +1,172 @@
+// Builds a patch from the image the fleet runs now to the new one and adds
+// it to the new manifest. Devices on the base version download the patch,
+// everyone else the full image.
+//
+// Usage: deno run --allow-read --allow-write delta-generator.ts <base ota dir> <new ota dir>
+//
+// Patch format, little endian:
+//   header  "PYD1" | target size u32 | base size u32 | base crc32 u32
+//   insert  0x01 | len u32 | len bytes of data
+//   copy    0x02 | len u32 | base offset u32
+
+const IMAGE_FILE = "app_update.bin";
+const DELTA_FILE = "app_update.delta";
+const MANIFEST_FILE = "manifest.json";
+
+// Shortest run worth a copy. A copy costs 9 bytes.
+const BLOCK_SIZE = 32;
+
+const OP_INSERT = 1;
+const OP_COPY = 2;
+
+function crc32(data: Uint8Array): number {
+    let crc = 0xffffffff;
+
+    for (const byte of data) {
+        crc ^= byte;
+        for (let i = 0; i < 8; i++) {
+            crc = (crc >>> 1) ^ (0xedb88320 & -(crc & 1));
+        }
+    }
+
+    return (crc ^ 0xffffffff) >>> 0;
+}
+
+function blockHash(data: Uint8Array, start: number): number {
+    let hash = 0x811c9dc5;
+
+    for (let i = start; i < start + BLOCK_SIZE; i++) {
+        hash = Math.imul(hash ^ data[i], 0x01000193);
+    }
+
+    return hash >>> 0;
+}
+
+class PatchWriter {
+    private chunks: Array<Uint8Array> = [];
+
+    header(targetSize: number, base: Uint8Array) {
+        const header = new Uint8Array(16);
+        const view = new DataView(header.buffer);
+
+        header.set(new TextEncoder().encode("PYD1"));
+        view.setUint32(4, targetSize, true);
+        view.setUint32(8, base.length, true);
+        view.setUint32(12, crc32(base), true);
+
+        this.chunks.push(header);
+    }
+
+    insert(data: Uint8Array) {
+        if (data.length == 0) return;
+
+        const op = new Uint8Array(5);
+        op[0] = OP_INSERT;
+        new DataView(op.buffer).setUint32(1, data.length, true);
+
+        this.chunks.push(op, data);
+    }
+
+    copy(offset: number, len: number) {
+        const op = new Uint8Array(9);
+        const view = new DataView(op.buffer);
+
+        op[0] = OP_COPY;
+        view.setUint32(1, len, true);
+        view.setUint32(5, offset, true);
+
+        this.chunks.push(op);
+    }
+
+    finish(): Uint8Array {
+        const size = this.chunks.reduce((sum, chunk) => sum + chunk.length, 0);
+        const out = new Uint8Array(size);
+        let pos = 0;
+
+        for (const chunk of this.chunks) {
+            out.set(chunk, pos);
+            pos += chunk.length;
+        }
+
+        return out;
+    }
+}
+
+function diff(base: Uint8Array, target: Uint8Array): Uint8Array {
+
+    // Index every aligned block of the base. First one wins.
+    const index = new Map<number, number>();
+    for (let i = 0; i + BLOCK_SIZE <= base.length; i += BLOCK_SIZE) {
+        const hash = blockHash(base, i);
+        if (!index.has(hash)) index.set(hash, i);
+    }
+
+    const patch = new PatchWriter();
+    patch.header(target.length, base);
+
+    let pending = 0;
+    let pos = 0;
+
+    while (pos + BLOCK_SIZE <= target.length) {
+        const start = index.get(blockHash(target, pos));
+
+        // Hash matches aren't proof
+        let len = 0;
+        if (start !== undefined) {
+            while (start + len < base.length && pos + len < target.length && base[start + len] == target[pos + len]) {
+                len++;
+            }
+        }
+
+        if (len < BLOCK_SIZE) {
+            pos++;
+            continue;
+        }
+
+        patch.insert(target.subarray(pending, pos));
+        patch.copy(start!, len);
+
+        pos += len;
+        pending = pos;
+    }
+
+    patch.insert(target.subarray(pending));
+
+    return patch.finish();
+}
+
+async function main() {
+
+    if (Deno.args.length != 2) {
+        console.error("usage: delta-generator.ts <base ota dir> <new ota dir>");
+        return -1;
+    }
+
+    const [baseDir, newDir] = Deno.args;
+
+    const base = await Deno.readFile(`${baseDir}/${IMAGE_FILE}`);
+    const target = await Deno.readFile(`${newDir}/${IMAGE_FILE}`);
+    const baseManifest = JSON.parse(await Deno.readTextFile(`${baseDir}/${MANIFEST_FILE}`));
+    const manifest = JSON.parse(await Deno.readTextFile(`${newDir}/${MANIFEST_FILE}`));
+
+    const delta = diff(base, target);
+
+    console.log(`delta ${delta.length} bytes, full image ${target.length} bytes`);
+
+    // Not worth it
+    if (delta.length >= target.length) {
+        console.error("Delta is no smaller than the image. Manifest left as is.");
+        return -1;
+    }
+
+    await Deno.writeFile(`${newDir}/${DELTA_FILE}`, delta);
+
+    // Only devices running exactly this build take the patch
+    manifest.base = baseManifest.version;
+    manifest.delta_file = DELTA_FILE;
+
+    await Deno.writeTextFile(`${newDir}/${MANIFEST_FILE}`, JSON.stringify(manifest));
+    console.log(`Delta written to ${newDir}/${DELTA_FILE}`);
+}
+
+main();
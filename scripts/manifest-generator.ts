@@ -9,9 +9,18 @@ interface OTAVersion {
 interface OTAManifest {
     version: OTAVersion,
     file: string,
-    force: boolean
+    force: boolean,
+    // Of the full image. Only known once it's built.
+    size?: number,
+    // Devices take this array or a CBOR byte string
+    sha256?: Array<number>,
+    // Set by delta-generator.ts. Patch from the base version to this one.
+    base?: OTAVersion,
+    delta_file?: string
 }
 
+// Usage: deno run --allow-run --allow-write [--allow-read] manifest-generator.ts [image]
+// With an image the size and SHA-256 are added so devices can verify it.
 async function main() {
 
     // Run the Git command
@@ -63,6 +72,15 @@ async function main() {
 
         }
 
+        // Image to describe
+        if (Deno.args.length > 0) {
+            const image = await Deno.readFile(Deno.args[0]);
+            const digest = await crypto.subtle.digest("SHA-256", image);
+
+            manifest.size = image.length;
+            manifest.sha256 = Array.from(new Uint8Array(digest));
+        }
+
         console.log("manifest generated!");
         console.log(manifest);
 
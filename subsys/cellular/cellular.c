@@ -16,6 +16,21 @@ LOG_MODULE_REGISTER(cellular);
 struct modem_param_info modem_info = {0};
 static char rsrp = 0xff;
 
+/* Network registration */
+static atomic_t registered_s = ATOMIC_INIT(0);
+static cellular_reg_evt_t reg_callback = NULL;
+static cellular_rsrp_evt_t rsrp_callback = NULL;
+
+static void registered_set(bool registered)
+{
+  /* Only pass on changes */
+  if (atomic_set(&registered_s, registered) == registered)
+    return;
+
+  if (reg_callback)
+    reg_callback(registered);
+}
+
 void cellular_evt(const struct lte_lc_evt *const evt)
 {
 
@@ -27,27 +42,35 @@ void cellular_evt(const struct lte_lc_evt *const evt)
 
     case LTE_LC_NW_REG_NOT_REGISTERED:
       LOG_DBG("not reg");
+      registered_set(false);
       break;
     case LTE_LC_NW_REG_REGISTERED_HOME:
       LOG_DBG("reg home");
+      registered_set(true);
       break;
     case LTE_LC_NW_REG_SEARCHING:
       LOG_DBG("searching");
+      registered_set(false);
       break;
     case LTE_LC_NW_REG_REGISTRATION_DENIED:
       LOG_DBG("reg denied");
+      registered_set(false);
       break;
     case LTE_LC_NW_REG_UNKNOWN:
       LOG_DBG("reg unknown");
+      registered_set(false);
       break;
     case LTE_LC_NW_REG_REGISTERED_ROAMING:
       LOG_DBG("reg roam");
+      registered_set(true);
       break;
     case LTE_LC_NW_REG_REGISTERED_EMERGENCY:
       LOG_DBG("reg em");
+      registered_set(false);
       break;
     case LTE_LC_NW_REG_UICC_FAIL:
       LOG_DBG("uicc fail");
+      registered_set(false);
       break;
     default:
       break;
@@ -63,9 +86,11 @@ void cellular_configure(void)
 #if defined(CONFIG_LTE_LINK_CONTROL)
   if (IS_ENABLED(CONFIG_LTE_AUTO_INIT_AND_CONNECT))
   {
-    /* Do nothing, modem is already turned on
-		 * and connected.
+    /* Modem is already turned on and connected.
+		 * Only track registration from here on.
 		 */
+    atomic_set(&registered_s, true);
+    lte_lc_register_handler(cellular_evt);
   }
   else
   {
@@ -84,6 +109,7 @@ void cellular_configure(void)
     __ASSERT(err == 0, "LTE link could not be established.");
     LOG_INF("LTE Link Connected!");
 
+    atomic_set(&registered_s, true);
     lte_lc_register_handler(cellular_evt);
 #endif /* defined(CONFIG_LWM2M_CARRIER) */
   }
@@ -111,6 +137,21 @@ int cellular_off()
   return err;
 }
 
+bool cellular_is_registered()
+{
+  return atomic_get(&registered_s);
+}
+
+void cellular_register_reg_evt(cellular_reg_evt_t cb)
+{
+  reg_callback = cb;
+}
+
+void cellular_register_rsrp_evt(cellular_rsrp_evt_t cb)
+{
+  rsrp_callback = cb;
+}
+
 /**@brief Returns rsrp so it can be use elsewhere (like Pyrinas Cloud)
  */
 char cellular_get_signal_strength()
@@ -134,6 +175,9 @@ static void modem_rsrp_handler(char rsrp_value)
 
   /* Copy over the value */
   rsrp = rsrp_value;
+
+  if (rsrp_callback)
+    rsrp_callback(rsrp_value);
 }
 
 int cellular_info_init()
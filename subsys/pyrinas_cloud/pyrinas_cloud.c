@@ -11,7 +11,6 @@
 #include <string.h>
 #include <modem/at_cmd.h>
 #include <random/rand32.h>
-#include <net/mqtt.h>
 #include <net/socket.h>
 #include <modem/lte_lc.h>
 #include <pyrinas_cloud/pyrinas_cloud.h>
@@ -24,27 +23,74 @@
 
 #include "pyrinas_cloud_codec.h"
 #include "pyrinas_cloud_helper.h"
+#include "pyrinas_cloud_dispatch.h"
+#include "pyrinas_cloud_resolver.h"
+#include "pyrinas_cloud_scheduler.h"
+#include "pyrinas_cloud_peripheral.h"
+#include "pyrinas_cloud_transport.h"
+
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA)
+#include "pyrinas_cloud_fota.h"
+#endif
+
+#if defined(CONFIG_PYRINAS_CLOUD_OTA_MANIFEST_CACHE)
+#include "pyrinas_cloud_manifest.h"
+#endif
+
+#if defined(CONFIG_PYRINAS_CLOUD_OUTBOX)
+#include "pyrinas_cloud_outbox.h"
+#endif
+
+#if defined(CONFIG_PYRINAS_CLOUD_BATCH)
+#include "pyrinas_cloud_batch.h"
+#endif
+
+#if defined(CONFIG_PYRINAS_CLOUD_COMPRESS)
+#include "pyrinas_cloud_compress.h"
+#endif
+
+#if defined(CONFIG_PYRINAS_CLOUD_TOPIC_ALIAS)
+#include "pyrinas_cloud_alias.h"
+#endif
+
+#if defined(CONFIG_PYRINAS_CLOUD_DOWNLINK)
+#include "pyrinas_cloud_downlink.h"
+#endif
 
 #include <logging/log.h>
 LOG_MODULE_REGISTER(pyrinas_cloud);
 
-#if !defined(CONFIG_MQTT_LIB_TLS)
-#error CONFIG_MQTT_LIB_TLS must be defined!
-#endif /* defined(CONFIG_MQTT_LIB_TLS) */
+BUILD_ASSERT(TELEMETRY_ENCODED_MAX_SIZE <= CONFIG_PYRINAS_CLOUD_PUBLISH_PAYLOAD_MAX_SIZE,
+             "Telemetry must fit in a publish descriptor");
 
-static void telemetry_check_event(struct k_timer *timer);
-K_TIMER_DEFINE(telemetry_timer, telemetry_check_event, NULL);
+/* Inbound payloads */
+static uint8_t payload_buf[CONFIG_PYRINAS_CLOUD_MQTT_PAYLOAD_BUFFER_SIZE];
 
-/* Telemetry interval */
-#define TELEMETRY_INTERVAL K_MINUTES(10)
+/* OTA isn't a stream subscriber. A manifest that doesn't fit is dropped. */
+BUILD_ASSERT(CONFIG_PYRINAS_CLOUD_MQTT_PAYLOAD_BUFFER_SIZE >= OTA_DATA_ENCODED_MAX_SIZE,
+             "The largest OTA manifest must fit the payload buffer");
 
-/* Security tag for fetching certs */
-static sec_tag_t sec_tag_list[] = {CONFIG_PYRINAS_CLOUD_SEC_TAG};
+/* Encoded telemetry. Too big for the stacks it's built on. */
+static uint8_t telemetry_buf[TELEMETRY_ENCODED_MAX_SIZE];
+static K_MUTEX_DEFINE(telemetry_buf_mutex);
 
-/* Buffers for MQTT client. */
-static uint8_t rx_buffer[CONFIG_PYRINAS_CLOUD_MQTT_MESSAGE_BUFFER_SIZE];
-static uint8_t tx_buffer[CONFIG_PYRINAS_CLOUD_MQTT_MESSAGE_BUFFER_SIZE];
-static uint8_t payload_buf[CONFIG_PYRINAS_CLOUD_MQTT_PAYLOAD_BUFFER_SIZE];
+#if defined(CONFIG_PYRINAS_CLOUD_COMPRESS)
+BUILD_ASSERT(CONFIG_PYRINAS_CLOUD_MQTT_PAYLOAD_BUFFER_SIZE >= COMPRESS_HEADER_MAX_SIZE,
+             "Compressed header must fit in the first segment");
+
+/* Where decompressed application payloads go. Only used by the cloud thread. */
+struct inflate_target
+{
+    const uint8_t *topic;
+    size_t topic_len;
+    size_t offset;
+    int handled;
+};
+
+static uint8_t inflate_buf[CONFIG_PYRINAS_CLOUD_COMPRESS_INFLATE_BUF_SIZE];
+static struct pyrinas_cloud_decompress inflate_ctx;
+static struct inflate_target inflate_target;
+#endif
 
 /* IMEI storage */
 #define CGSN_RESP_LEN 19
@@ -53,37 +99,137 @@ char imei[IMEI_LEN];
 /* Topics */
 char ota_pub_topic[sizeof(CONFIG_PYRINAS_CLOUD_MQTT_OTA_PUB_TOPIC) + IMEI_LEN];
 char ota_sub_topic[sizeof(CONFIG_PYRINAS_CLOUD_MQTT_OTA_SUB_TOPIC) + IMEI_LEN];
+static char config_sub_topic[sizeof(CONFIG_PYRINAS_CLOUD_MQTT_CONFIG_SUB_TOPIC) + IMEI_LEN];
+static size_t config_sub_topic_len;
 char telemetry_pub_topic[sizeof(CONFIG_PYRINAS_CLOUD_MQTT_TELEMETRY_PUB_TOPIC) + IMEI_LEN];
 char application_sub_topic[sizeof(CONFIG_PYRINAS_CLOUD_MQTT_APPLICATION_SUB_TOPIC) + IMEI_LEN + CONFIG_PYRINAS_CLOUD_APPLICATION_EVENT_NAME_MAX_SIZE];
 
-/* The mqtt client struct */
-static struct mqtt_client client;
+/* Everything under the application sub topic, minus the event name */
+static char application_sub_prefix[sizeof(CONFIG_PYRINAS_CLOUD_MQTT_APPLICATION_SUB_TOPIC) + IMEI_LEN];
+static size_t application_sub_prefix_len;
+static size_t ota_sub_topic_len;
+
+#if defined(CONFIG_PYRINAS_CLOUD_DOWNLINK)
+/* <imei>/dev/sub/# and everything before the uid */
+static char downlink_sub_topic[sizeof(CONFIG_PYRINAS_CLOUD_MQTT_DOWNLINK_SUB_TOPIC) + IMEI_LEN];
+static size_t downlink_sub_topic_len;
+static char downlink_sub_prefix[sizeof(CONFIG_PYRINAS_CLOUD_MQTT_DOWNLINK_SUB_TOPIC) + IMEI_LEN];
+static size_t downlink_sub_prefix_len;
+#endif
+
+#if defined(CONFIG_PYRINAS_CLOUD_TOPIC_ALIAS)
+static char alias_register_topic[sizeof(CONFIG_PYRINAS_CLOUD_MQTT_ALIAS_REGISTER_TOPIC) + IMEI_LEN];
+static size_t alias_register_topic_len;
+#endif
 
 /* MQTT Broker details. */
-static struct sockaddr_storage broker;
+static struct sockaddr_storage broker_addrs[CONFIG_PYRINAS_CLOUD_RESOLVER_MAX_ADDR];
 
 /* Thread control */
 static K_SEM_DEFINE(pyrinas_cloud_thread_sem, 0, 1);
 
+/* Longest the cloud thread sleeps. Keeps the WDT fed. */
+#define CLOUD_THREAD_WAIT_MAX_MS (55 * MSEC_PER_SEC)
+
+/* Socket events from the rx thread. The result carries the connection
+ * it belongs to so a late event for an old socket is ignored. */
+#define RX_GEN(gen) ((int)((gen)&0x7fff))
+#define RX_RESULT(gen, revents) ((RX_GEN(gen) << 16) | ((revents)&0xffff))
+#define RX_RESULT_GEN(result) (((result) >> 16) & 0x7fff)
+#define RX_RESULT_REVENTS(result) ((result)&0xffff)
+
+static struct k_poll_signal rx_signal = K_POLL_SIGNAL_INITIALIZER(rx_signal);
+static K_SEM_DEFINE(rx_poll_sem, 0, 1);
+static atomic_t rx_gen_s = ATOMIC_INIT(0);
+
+/* Requests for the cloud thread. Only it touches the transport. */
+enum cloud_cmd
+{
+    cloud_cmd_subscribe,
+    cloud_cmd_disconnect,
+};
+
+static atomic_t cloud_cmd_s = ATOMIC_INIT(0);
+static struct k_poll_signal cloud_cmd_signal = K_POLL_SIGNAL_INITIALIZER(cloud_cmd_signal);
+
 /* Atomic flags */
 static atomic_val_t cloud_state_s = ATOMIC_INIT(cloud_state_disconnected);
 static atomic_val_t ota_state_s = ATOMIC_INIT(ota_state_ready);
 static atomic_val_t initial_ota_check = ATOMIC_INIT(0);
+static atomic_val_t session_present_s = ATOMIC_INIT(0);
+static atomic_val_t connack_s = ATOMIC_INIT(0);
+static atomic_val_t subscribed_s = ATOMIC_INIT(0);
 static atomic_val_t wdt_started_s = ATOMIC_INIT(0);
 
 /* File descriptor */
 static struct pollfd fds;
 
+/* Publish descriptor. Owned by the cloud thread once queued. */
+struct publish_desc
+{
+    void *fifo_reserved;
+    bool store_offline;
+    bool from_outbox; /* Completion goes back to the outbox instead */
+    enum pyrinas_cloud_qos qos;
+    pyrinas_cloud_publish_cb_t cb;
+    void *user_data;
+    uint16_t message_id;
+    uint8_t retries;
+    uint32_t sent_time;
+    uint16_t topic_len;
+    uint16_t data_len;
+    uint8_t topic[CONFIG_PYRINAS_CLOUD_PUBLISH_TOPIC_MAX_SIZE + 1];
+    uint8_t data[CONFIG_PYRINAS_CLOUD_PUBLISH_PAYLOAD_MAX_SIZE];
+};
+
+#define PUBLISH_DESC_ALIGNMENT 4
+#define PUBLISH_DESC_SIZE ROUND_UP(sizeof(struct publish_desc), PUBLISH_DESC_ALIGNMENT)
+
+/* Publish queue */
+K_MEM_SLAB_DEFINE(publish_slab, PUBLISH_DESC_SIZE, CONFIG_PYRINAS_CLOUD_PUBLISH_QUEUE_COUNT, PUBLISH_DESC_ALIGNMENT);
+static K_FIFO_DEFINE(publish_fifo);
+
+/* QoS1 publishes waiting for PUBACK. Only touched by the cloud thread. */
+static struct publish_desc *inflight[CONFIG_PYRINAS_CLOUD_INFLIGHT_MAX];
+
+/* Packet identifiers. Assigned by the cloud thread. */
+static uint16_t message_id_s;
+
+/* Defaults */
+static const struct pyrinas_cloud_publish_opts default_publish_opts = {
+    .qos = cloud_qos_at_least_once,
+};
+
+static const struct pyrinas_cloud_publish_opts telemetry_publish_opts = {
+    .qos = cloud_qos_at_most_once,
+};
+
+#if defined(CONFIG_PYRINAS_CLOUD_TELEMETRY_DELTA)
+/* What the cloud has acknowledged and what's on the way */
+static struct pyrinas_cloud_telemetry_data telemetry_acked;
+static struct pyrinas_cloud_telemetry_data telemetry_pending;
+static uint32_t telemetry_seq;
+static uint32_t telemetry_since_keyframe;
+static bool telemetry_synced;
+
+/* Sent from the work queue, acknowledged in the cloud thread */
+static K_MUTEX_DEFINE(telemetry_mutex);
+#endif
+
 /* Queue */
 static struct k_work_q *main_tasks_q;
 
 /* Structures for work */
-static struct k_work publish_telemetry_work;
-static struct k_work ota_request_work;
 static struct k_work ota_done_work;
 static struct k_work on_connect_work;
 static struct k_delayed_work ota_check_subscribed_work;
+#if defined(CONFIG_PYRINAS_CLOUD_OTA_RETAINED)
+static struct k_delayed_work ota_check_fallback_work;
+#endif
 static struct k_delayed_work fota_work;
+#if defined(CONFIG_PYRINAS_CLOUD_OUTBOX)
+static struct k_delayed_work outbox_drain_work;
+#endif
 /* Used in system */
 static struct k_work ota_reboot_work;
 
@@ -93,15 +239,25 @@ static k_tid_t pyrinas_cloud_thread_id;
 /* Making the ota dat static */
 static struct pyrinas_cloud_ota_data ota_data;
 
-/* Callback for application back to main context*/
-pryinas_cloud_application_cb_entry_t *callbacks[CONFIG_PYRINAS_CLOUD_APPLICATION_CALLBACK_MAX_COUNT];
-
 /* Cloud state callbacks */
 static pyrinas_cloud_ota_state_evt_t ota_state_callback = NULL;
 static pyrinas_cloud_state_evt_t cloud_state_callback = NULL;
 
+#if defined(CONFIG_PYRINAS_CLOUD_BATCH)
+static void batch_flush_cb(const struct pyrinas_cloud_batch_flush *flush);
+#endif
+
+/* Connection setup metrics */
+static struct pyrinas_cloud_connect_stats connect_stats;
+static int64_t connect_start_time;
+
+#if defined(CONFIG_PYRINAS_CLOUD_CONNECT_DATA_STATS)
+static uint32_t connect_start_tx_kb;
+static uint32_t connect_start_rx_kb;
+#endif
+
 /* Statically track message id*/
-static uint16_t ota_sub_message_id = 0;
+static uint16_t sub_message_id = 0;
 static int wdt_channel_id;
 
 /* WDT Device */
@@ -119,60 +275,25 @@ void bsd_recoverable_error_handler(uint32_t err)
 
 int pyrinas_cloud_subscribe(char *topic, pyrinas_cloud_application_cb_t callback)
 {
-    /* Get the string length */
     size_t topic_len = strlen(topic);
 
-    /* Return if name is greater than name size */
-    if (topic_len > CONFIG_PYRINAS_CLOUD_APPLICATION_EVENT_NAME_MAX_SIZE)
-    {
-        return -EINVAL;
-    }
-
-    for (int i = 0; i < CONFIG_PYRINAS_CLOUD_APPLICATION_CALLBACK_MAX_COUNT; i++)
-    {
-        if (callbacks[i] == NULL)
-        {
-            /* Allocate memory */
-            callbacks[i] = k_malloc(sizeof(pryinas_cloud_application_cb_entry_t));
-
-            /* Set the full name */
-            snprintf(callbacks[i]->full_topic, sizeof(application_sub_topic), CONFIG_PYRINAS_CLOUD_MQTT_APPLICATION_SUB_TOPIC, IMEI_LEN, imei, topic_len, topic);
-
-            LOG_DBG("application subscribe to: %s", callbacks[i]->full_topic);
+    LOG_DBG("application subscribe to: %s%s", log_strdup(application_sub_prefix), log_strdup(topic));
 
-            /* Set the values */
-            callbacks[i]->cb = callback;
-            callbacks[i]->topic_len = topic_len;
+    return pyrinas_cloud_dispatch_add(topic, topic_len, callback);
+}
 
-            /* Copy the name*/
-            memcpy(callbacks[i]->topic, topic, topic_len);
+int pyrinas_cloud_subscribe_stream(char *topic, pyrinas_cloud_application_stream_cb_t callback)
+{
+    size_t topic_len = strlen(topic);
 
-            return 0;
-        }
-    }
+    LOG_DBG("application stream subscribe to: %s%s", log_strdup(application_sub_prefix), log_strdup(topic));
 
-    /* Can't add new entry. They're all occupied! */
-    return -ENOMEM;
+    return pyrinas_cloud_dispatch_add_stream(topic, topic_len, callback);
 }
 
 int pyrinas_cloud_unsubscribe(char *topic)
 {
-
-    for (int i = 0; i < CONFIG_PYRINAS_CLOUD_APPLICATION_CALLBACK_MAX_COUNT; i++)
-    {
-        if (callbacks[i] == NULL)
-            continue;
-
-        if (strcmp(callbacks[i]->topic, topic) == 0)
-        {
-            /* Free memory */
-            k_free(callbacks[i]);
-            return 0;
-        }
-    }
-
-    /* Entry not found */
-    return -ENOENT;
+    return pyrinas_cloud_dispatch_remove(topic, strlen(topic));
 }
 
 /**@brief Function to get IMEI
@@ -199,73 +320,346 @@ static int get_imei(char *imei_buf, size_t len)
     return 0;
 }
 
-/**@brief Function to publish data on the configured topic
+#if defined(CONFIG_PYRINAS_CLOUD_CONNECT_DATA_STATS)
+/**@brief Modem data counters in kB since AT%XCONNSTAT=1
  */
-static int data_publish(uint8_t *topic, size_t topic_len, uint8_t *data, size_t data_len, uint16_t message_id)
+static int get_connstat(uint32_t *tx_kb, uint32_t *rx_kb)
 {
+    enum at_cmd_state at_state;
+    uint32_t sms_tx, sms_rx;
+    char buf[64];
 
-    if (atomic_get(&cloud_state_s) != cloud_state_connected)
+    int err = at_cmd_write("AT%XCONNSTAT?", buf, sizeof(buf), &at_state);
+    if (err)
+        return err;
+
+    /* %XCONNSTAT: <SMS Tx>,<SMS Rx>,<Data Tx>,<Data Rx>,<Packet max>,<Packet avg> */
+    if (sscanf(buf, "%%XCONNSTAT: %u,%u,%u,%u", &sms_tx, &sms_rx, tx_kb, rx_kb) != 4)
+        return -EBADMSG;
+
+    return 0;
+}
+#endif
+
+/**@brief Next packet identifier. Never 0 and never one that's still in flight.
+ * Cloud thread only since it also retires inflight[] entries.
+ */
+static uint16_t message_id_next(void)
+{
+    uint16_t id;
+    bool in_use;
+
+    __ASSERT(k_current_get() == pyrinas_cloud_thread_id, "Packet ids come from the cloud thread");
+
+    do
+    {
+        id = ++message_id_s;
+        in_use = (id == 0);
+
+        for (int i = 0; i < ARRAY_SIZE(inflight) && !in_use; i++)
+        {
+            if (inflight[i] && inflight[i]->message_id == id)
+                in_use = true;
+        }
+    } while (in_use);
+
+    return id;
+}
+
+/**@brief Function to queue data for publishing on the configured topic.
+ * Safe to call from any context. The cloud thread does the actual publish.
+ */
+static int publish_enqueue(uint8_t *topic, size_t topic_len, uint8_t *data, size_t data_len, bool store_offline,
+                           bool from_outbox, const struct pyrinas_cloud_publish_opts *opts)
+{
+    struct publish_desc *desc;
+    int err;
+
+    if (opts == NULL)
+        opts = &default_publish_opts;
+
+    /* Only application data survives being offline */
+    if (atomic_get(&cloud_state_s) != cloud_state_connected &&
+        !(store_offline && IS_ENABLED(CONFIG_PYRINAS_CLOUD_OUTBOX)))
     {
         LOG_WRN("Not connected. Unable to publish!");
         return -ENETDOWN;
     }
 
-    struct mqtt_publish_param param;
+    /* Larger payloads may still fit once compressed */
+    if (topic_len > CONFIG_PYRINAS_CLOUD_PUBLISH_TOPIC_MAX_SIZE ||
+        (data_len > CONFIG_PYRINAS_CLOUD_PUBLISH_PAYLOAD_MAX_SIZE && !IS_ENABLED(CONFIG_PYRINAS_CLOUD_COMPRESS)))
+    {
+        LOG_ERR("Publish too large. Topic: %d Payload: %d", topic_len, data_len);
+        return -EMSGSIZE;
+    }
 
-    param.message.topic.qos = MQTT_QOS_1_AT_LEAST_ONCE;
-    param.message.topic.topic.utf8 = topic;
-    param.message.topic.topic.size = topic_len;
-    param.message.payload.data = data;
-    param.message.payload.len = data_len;
-    param.message_id = message_id;
-    param.dup_flag = 0;
-    param.retain_flag = 0;
+    err = k_mem_slab_alloc(&publish_slab, (void **)&desc, K_NO_WAIT);
+    if (err)
+    {
+        LOG_WRN("Publish queue full.");
+        return -ENOMEM;
+    }
+
+    /* Copy everything so the caller's buffers can go away */
+    desc->store_offline = store_offline;
+    desc->from_outbox = from_outbox;
+    desc->qos = opts->qos;
+    desc->cb = opts->cb;
+    desc->user_data = opts->user_data;
+    desc->topic_len = topic_len;
+    desc->data_len = 0;
+    memcpy(desc->topic, topic, topic_len);
+    desc->topic[topic_len] = '\0';
+
+#if defined(CONFIG_PYRINAS_CLOUD_COMPRESS)
+    /* Application data only. Outbox entries are already done. */
+    if (store_offline && data_len >= CONFIG_PYRINAS_CLOUD_COMPRESS_THRESHOLD &&
+        !pyrinas_cloud_compress_is_compressed(data, data_len))
+    {
+        size_t len = 0;
 
-    LOG_INF("Publishing %d bytes to topic: %s len: %u", data_len, topic, topic_len);
+        if (pyrinas_cloud_compress(data, data_len, desc->data, sizeof(desc->data), &len) == 0)
+        {
+            LOG_DBG("Compressed %d to %d bytes", data_len, len);
+            desc->data_len = len;
+        }
+    }
+#endif
 
-    int err = mqtt_publish(&client, &param);
+    if (desc->data_len == 0)
+    {
+        if (data_len > sizeof(desc->data))
+        {
+            LOG_ERR("Publish too large. Payload: %d", data_len);
+            k_mem_slab_free(&publish_slab, (void **)&desc);
+            return -EMSGSIZE;
+        }
 
-    return err;
+        desc->data_len = data_len;
+        memcpy(desc->data, data, data_len);
+    }
+
+    /* Wakes the cloud thread */
+    k_fifo_put(&publish_fifo, desc);
+
+    return 0;
+}
+
+static int data_publish(uint8_t *topic, size_t topic_len, uint8_t *data, size_t data_len, bool store_offline, const struct pyrinas_cloud_publish_opts *opts)
+{
+    return publish_enqueue(topic, topic_len, data, data_len, store_offline, false, opts);
+}
+
+/**@brief Done with a descriptor. Notifies the owner and keeps application
+ * data if it couldn't be sent.
+ */
+static void publish_desc_release(struct publish_desc *desc, int err, uint32_t latency_ms)
+{
+#if defined(CONFIG_PYRINAS_CLOUD_STATS)
+    /* PUBACK round trip */
+    if (err == 0 && desc->qos == cloud_qos_at_least_once)
+        pyrinas_cloud_stats_latency_add(latency_ms);
+#endif
+
+    if (desc->cb)
+        desc->cb(err, latency_ms, desc->user_data);
+
+    if (err && !desc->from_outbox)
+    {
+#if defined(CONFIG_PYRINAS_CLOUD_OUTBOX)
+        if (desc->store_offline)
+        {
+            err = pyrinas_cloud_outbox_put(desc->topic, desc->topic_len, desc->data, desc->data_len);
+            if (err)
+                LOG_WRN("Unable to store publish. Err: %i", err);
+        }
+        else
+#endif
+        {
+            LOG_WRN("Dropping publish to %s. Err: %i", log_strdup(desc->topic), err);
+        }
+    }
+
+    k_mem_slab_free(&publish_slab, (void **)&desc);
+}
+
+static int publish_desc_send(struct publish_desc *desc, bool dup)
+{
+    const uint8_t *topic = desc->topic;
+    size_t topic_len = desc->topic_len;
+
+#if defined(CONFIG_PYRINAS_CLOUD_TOPIC_ALIAS)
+    /* Application topics only. desc keeps the full topic for the outbox. */
+    if (desc->store_offline)
+        pyrinas_cloud_alias_apply(&topic, &topic_len);
+#endif
+
+    const struct pyrinas_cloud_transport_publish param = {
+        .topic = topic,
+        .topic_len = topic_len,
+        .data = desc->data,
+        .data_len = desc->data_len,
+        .qos = desc->qos,
+        .message_id = desc->message_id,
+        .dup = dup,
+    };
+
+    LOG_INF("Publishing %d bytes to topic: %.*s len: %u id: %u%s", desc->data_len, topic_len, log_strdup(topic),
+            topic_len, desc->message_id, dup ? " (dup)" : "");
+
+    desc->sent_time = k_uptime_get_32();
+
+    return pyrinas_cloud_transport_publish(&param);
+}
+
+#if defined(CONFIG_PYRINAS_CLOUD_TOPIC_ALIAS)
+static int alias_register(const uint8_t *data, size_t len, const struct pyrinas_cloud_publish_opts *opts)
+{
+    return data_publish(alias_register_topic, alias_register_topic_len, (uint8_t *)data, len, false, opts);
+}
+#endif
+
+static int inflight_slot_get(void)
+{
+    for (int i = 0; i < ARRAY_SIZE(inflight); i++)
+    {
+        if (inflight[i] == NULL)
+            return i;
+    }
+
+    return -1;
+}
+
+/**@brief PUBACK received. Completes the matching publish.
+ */
+static void publish_inflight_ack(uint16_t message_id, int result)
+{
+    for (int i = 0; i < ARRAY_SIZE(inflight); i++)
+    {
+        struct publish_desc *desc = inflight[i];
+
+        if (desc == NULL || desc->message_id != message_id)
+            continue;
+
+        inflight[i] = NULL;
+
+        uint32_t latency = k_uptime_get_32() - desc->sent_time;
+        LOG_DBG("PUBACK id: %u after %u ms", message_id, latency);
+
+        publish_desc_release(desc, result, latency);
+        return;
+    }
+
+    LOG_WRN("PUBACK for unknown id: %u", message_id);
 }
 
-/**@brief Function to unsubscribe to the configured topic
+/**@brief Re-sends anything not acknowledged before the link dropped.
  */
-static int unsubscribe(char *topic, size_t len)
+static void publish_inflight_retransmit(void)
 {
-    struct mqtt_topic subscribe_topic = {
-        .topic = {.utf8 = topic,
-                  .size = len},
-        .qos = MQTT_QOS_1_AT_LEAST_ONCE};
+    for (int i = 0; i < ARRAY_SIZE(inflight); i++)
+    {
+        struct publish_desc *desc = inflight[i];
+
+        if (desc == NULL)
+            continue;
+
+        /* Give up eventually */
+        if (desc->retries >= CONFIG_PYRINAS_CLOUD_INFLIGHT_RETRY_MAX)
+        {
+            inflight[i] = NULL;
+            publish_desc_release(desc, -ETIMEDOUT, 0);
+            continue;
+        }
+
+        desc->retries++;
+
+        /* Stays in flight for the next connection if this fails */
+        int err = publish_desc_send(desc, true);
+        if (err)
+            LOG_WRN("Unable to retransmit id: %u. Err: %i", desc->message_id, err);
+    }
+}
+
+/**@brief Sends everything that's been queued. Only called from the cloud thread.
+ */
+static void publish_queue_process(void)
+{
+    struct publish_desc *desc;
+
+    while ((desc = k_fifo_peek_head(&publish_fifo)) != NULL)
+    {
+        bool connected = atomic_get(&cloud_state_s) == cloud_state_connected;
+        int slot = -1;
+        int err = -ENETDOWN;
+
+        /* Held until CONNACK. Sent before it, a QoS 1 publish would go
+         * out again with the in flight retransmit. */
+        if (connected && !atomic_get(&connack_s))
+            break;
 
-    const struct mqtt_subscription_list subscription_list = {
-        .list = &subscribe_topic, .list_count = 1, .message_id = sys_rand32_get()};
+        /* Leave it queued until a PUBACK frees up the window */
+        if (connected && desc->qos == cloud_qos_at_least_once)
+        {
+            slot = inflight_slot_get();
+            if (slot < 0)
+                break;
+        }
 
-    printk("Unsubscribing to: %s len %u\n", topic, len);
+        /* Claim it */
+        k_fifo_get(&publish_fifo, K_NO_WAIT);
 
-    return mqtt_unsubscribe(&client, &subscription_list);
+        if (connected)
+        {
+            desc->message_id = message_id_next();
+            desc->retries = 0;
+
+            err = publish_desc_send(desc, false);
+            if (err)
+            {
+                LOG_ERR("Unable to publish. Err: %i", err);
+            }
+            else if (slot >= 0)
+            {
+                /* Completed on PUBACK */
+                inflight[slot] = desc;
+                continue;
+            }
+        }
+
+        publish_desc_release(desc, err, 0);
+    }
 }
 
-/**@brief Function to subscribe to the configured topic
+/**@brief Function to subscribe to all of the configured topics
+ * in a single SUBSCRIBE
  */
-static int subscribe(char *topic, size_t len, uint16_t message_id)
+static int subscribe_all(uint16_t message_id)
 {
-    struct mqtt_topic subscribe_topic = {
-        .topic = {.utf8 = topic,
-                  .size = len},
-        .qos = MQTT_QOS_1_AT_LEAST_ONCE};
+    const struct pyrinas_cloud_transport_topic subscribe_topics[] = {
+        {.topic = ota_sub_topic,
+         .topic_len = ota_sub_topic_len},
+        {.topic = application_sub_topic,
+         .topic_len = strlen(application_sub_topic)},
+        {.topic = config_sub_topic,
+         .topic_len = config_sub_topic_len},
+#if defined(CONFIG_PYRINAS_CLOUD_DOWNLINK)
+        {.topic = downlink_sub_topic,
+         .topic_len = downlink_sub_topic_len},
+#endif
+    };
 
-    const struct mqtt_subscription_list subscription_list = {
-        .list = &subscribe_topic, .list_count = 1, .message_id = message_id};
+    BUILD_ASSERT(ARRAY_SIZE(subscribe_topics) <= PYRINAS_CLOUD_TRANSPORT_TOPICS_MAX, "Too many topics");
 
-    LOG_INF("Subscribing to: %s len %u", topic, len);
+    LOG_INF("Subscribing to: %s, %s, %s", log_strdup(ota_sub_topic), log_strdup(application_sub_topic), log_strdup(config_sub_topic));
 
-    return mqtt_subscribe(&client, &subscription_list);
+    return pyrinas_cloud_transport_subscribe(subscribe_topics, ARRAY_SIZE(subscribe_topics), message_id);
 }
 
 /**@brief Function to read the published payload.
  */
-static int publish_get_payload(struct mqtt_client *c,
-                               uint8_t *write_buf,
+static int publish_get_payload(uint8_t *write_buf,
                                size_t length)
 {
     uint8_t *buf = write_buf;
@@ -277,7 +671,7 @@ static int publish_get_payload(struct mqtt_client *c,
     }
     while (buf < end)
     {
-        int ret = mqtt_read_publish_payload_blocking(c, buf, end - buf);
+        int ret = pyrinas_cloud_transport_read(buf, end - buf);
 
         if (ret < 0)
         {
@@ -292,6 +686,134 @@ static int publish_get_payload(struct mqtt_client *c,
     return 0;
 }
 
+#if defined(CONFIG_PYRINAS_CLOUD_COMPRESS)
+static void inflate_segment(const uint8_t *data, size_t len, void *user_data)
+{
+    struct inflate_target *target = user_data;
+
+    target->handled += pyrinas_cloud_dispatch_segment(target->topic, target->topic_len, data, len, target->offset, inflate_ctx.total);
+    target->offset += len;
+}
+
+/**@brief Start decompressing an application payload. data must hold
+ * the whole header. Output goes to stream subscribers.
+ */
+static int inflate_start(const uint8_t *topic, size_t topic_len, const uint8_t *data, size_t data_len)
+{
+    size_t header_len = 0;
+
+    inflate_target = (struct inflate_target){
+        .topic = topic,
+        .topic_len = topic_len,
+    };
+
+    int err = pyrinas_cloud_decompress_init(&inflate_ctx, data, data_len, &header_len, inflate_segment, &inflate_target);
+    if (err)
+        return err;
+
+    return pyrinas_cloud_decompress_feed(&inflate_ctx, data + header_len, data_len - header_len);
+}
+
+/**@brief Decompress a complete application payload before dispatch.
+ * Payloads too large for inflate_buf only reach stream subscribers.
+ */
+static int inflate_dispatch(const uint8_t *topic, size_t topic_len, const uint8_t *data, size_t data_len)
+{
+    int len = pyrinas_cloud_decompress(&inflate_ctx, data, data_len, inflate_buf, sizeof(inflate_buf));
+
+    if (len >= 0)
+        return pyrinas_cloud_dispatch(topic, topic_len, inflate_buf, len);
+
+    if (len == -ENOSPC && inflate_start(topic, topic_len, data, data_len) == 0)
+        return inflate_target.handled;
+
+    LOG_WRN("Unable to decompress. Err: %d", len);
+
+    return 0;
+}
+#endif
+
+/**@brief Hand a payload that doesn't fit in payload_buf to stream
+ * subscribers one segment at a time. Always reads the full payload so
+ * the session stays intact even if nobody is listening.
+ */
+static int publish_stream_payload(const uint8_t *topic, size_t topic_len,
+                                  size_t total_len)
+{
+    const uint8_t *suffix = NULL;
+    size_t suffix_len = 0;
+    size_t offset = 0;
+    int handled = 0;
+    bool inflating = false;
+
+    /* Only application topics can be streamed */
+    if (topic_len > application_sub_prefix_len &&
+        memcmp(application_sub_prefix, topic, application_sub_prefix_len) == 0)
+    {
+        suffix = topic + application_sub_prefix_len;
+        suffix_len = topic_len - application_sub_prefix_len;
+    }
+
+    while (offset < total_len)
+    {
+        size_t len = MIN(sizeof(payload_buf), total_len - offset);
+
+        /* Full segments so a compressed header is never split */
+        int ret = publish_get_payload(payload_buf, len);
+        if (ret < 0)
+        {
+            return ret;
+        }
+
+#if defined(CONFIG_PYRINAS_CLOUD_COMPRESS)
+        if (suffix && offset == 0 && pyrinas_cloud_compress_is_compressed(payload_buf, len))
+        {
+            inflating = true;
+            ret = inflate_start(suffix, suffix_len, payload_buf, len);
+        }
+        else if (inflating)
+        {
+            ret = pyrinas_cloud_decompress_feed(&inflate_ctx, payload_buf, len);
+        }
+
+        if (ret)
+        {
+            LOG_WRN("Unable to decompress. Err: %d", ret);
+            suffix = NULL;
+            inflating = false;
+        }
+#endif
+
+        if (suffix && !inflating)
+            handled += pyrinas_cloud_dispatch_segment(suffix, suffix_len, payload_buf, len, offset, total_len);
+
+        offset += len;
+    }
+
+#if defined(CONFIG_PYRINAS_CLOUD_COMPRESS)
+    if (inflating)
+        handled = inflate_target.handled;
+#endif
+
+    if (!handled)
+    {
+        char topic_str[CONFIG_PYRINAS_CLOUD_PUBLISH_TOPIC_MAX_SIZE + 1];
+
+        LOG_WRN("No stream handler for %s. Dropped %d bytes.",
+                log_strdup(str_terminate(topic_str, sizeof(topic_str), topic, topic_len)), total_len);
+    }
+
+    return 0;
+}
+
+/**@brief Function to publish application data. Ends up in the
+ * outbox if the link is down.
+ */
+static int app_data_publish(uint8_t *topic, size_t topic_len, uint8_t *data, size_t data_len)
+{
+    return data_publish(topic, topic_len, data, data_len, true, NULL);
+}
+
 static void publish_ota_check()
 {
 
@@ -302,7 +824,7 @@ static void publish_ota_check()
     encode_ota_request(ota_cmd_type_check, buf, sizeof(buf), &size);
 
     /* Publish the data */
-    int err = data_publish(ota_pub_topic, strlen(ota_pub_topic), buf, size, sys_rand32_get());
+    int err = data_publish(ota_pub_topic, strlen(ota_pub_topic), buf, size, false, NULL);
     if (err)
     {
         LOG_ERR("Unable to publish OTA check. Error: %d", err);
@@ -319,7 +841,7 @@ static void publish_ota_done()
     encode_ota_request(ota_cmd_type_done, buf, sizeof(buf), &size);
 
     /* Publish the data */
-    int err = data_publish(ota_pub_topic, strlen(ota_pub_topic), buf, size, sys_rand32_get());
+    int err = data_publish(ota_pub_topic, strlen(ota_pub_topic), buf, size, false, NULL);
     if (err)
     {
         LOG_ERR("Unable to publish OTA done. Error: %d", err);
@@ -327,11 +849,33 @@ static void publish_ota_done()
 }
 
 /* Publish central/hub telemetry */
-static void publish_telemetry(bool has_version)
+#if defined(CONFIG_PYRINAS_CLOUD_TELEMETRY_DELTA)
+static void telemetry_sent(int result, uint32_t latency_ms, void *user_data)
 {
+    k_mutex_lock(&telemetry_mutex, K_FOREVER);
 
-    struct pyrinas_cloud_telemetry_data data;
-    char buf[64];
+    /* Only the latest send counts */
+    if (result == 0 && (uint32_t)(uintptr_t)user_data == telemetry_seq)
+    {
+        if (telemetry_pending.has_keyframe)
+        {
+            telemetry_acked = telemetry_pending;
+            telemetry_synced = true;
+        }
+        else
+        {
+            telemetry_merge(&telemetry_acked, &telemetry_pending);
+        }
+    }
+
+    k_mutex_unlock(&telemetry_mutex);
+}
+#endif
+
+static void publish_telemetry(bool has_version)
+{
+    const struct pyrinas_cloud_publish_opts *opts = &telemetry_publish_opts;
+    struct pyrinas_cloud_telemetry_data data = {0};
     size_t payload_len = 0;
     int err = 0;
 
@@ -354,36 +898,118 @@ static void publish_telemetry(bool has_version)
     if (has_version)
         get_version_string(data.version, sizeof(data.version));
 
+#if defined(CONFIG_PYRINAS_CLOUD_TELEMETRY_DELTA)
+    struct pyrinas_cloud_publish_opts delta_opts = {
+        .qos = cloud_qos_at_least_once,
+        .cb = telemetry_sent,
+    };
+
+    k_mutex_lock(&telemetry_mutex, K_FOREVER);
+
+    /* Full record on connect, until one gets through and every so often */
+    if (has_version || !telemetry_synced ||
+        telemetry_since_keyframe >= CONFIG_PYRINAS_CLOUD_TELEMETRY_KEYFRAME_INTERVAL)
+    {
+        data.has_keyframe = true;
+        data.keyframe = 1;
+        telemetry_since_keyframe = 0;
+    }
+    else
+    {
+        telemetry_since_keyframe++;
+        telemetry_delta(&telemetry_acked, &data);
+    }
+
+    k_mutex_unlock(&telemetry_mutex);
+#endif
+
+    k_mutex_lock(&telemetry_buf_mutex, K_FOREVER);
+
     /* Encode data */
-    err = encode_telemetry_data(&data, buf, sizeof(buf), &payload_len);
+    err = encode_telemetry_data(&data, true, telemetry_buf, sizeof(telemetry_buf), &payload_len);
     if (err)
     {
         LOG_ERR("Unable to encode telemetry data.");
-        return;
+        goto done;
+    }
+
+    /* Empty map. Nothing moved. */
+    if (payload_len <= 1)
+    {
+        LOG_DBG("Telemetry unchanged");
+        goto done;
     }
 
+#if defined(CONFIG_PYRINAS_CLOUD_TELEMETRY_DELTA)
+    /* Committed once acknowledged */
+    k_mutex_lock(&telemetry_mutex, K_FOREVER);
+    telemetry_pending = data;
+    delta_opts.user_data = (void *)(uintptr_t)(++telemetry_seq);
+    k_mutex_unlock(&telemetry_mutex);
+
+    opts = &delta_opts;
+#endif
+
     /* Publish telemetry */
-    err = data_publish(telemetry_pub_topic, strlen(telemetry_pub_topic), buf, payload_len, sys_rand32_get());
+    err = data_publish(telemetry_pub_topic, strlen(telemetry_pub_topic), telemetry_buf, payload_len, false, opts);
     if (err)
     {
         LOG_ERR("Unable to publish telemetry. Error: %d", err);
     }
+
+done:
+#if defined(CONFIG_PYRINAS_CLOUD_STATS)
+    /* Only a queued record takes the window with it */
+    pyrinas_cloud_stats_commit(err == 0 && payload_len > 1);
+#endif
+
+    k_mutex_unlock(&telemetry_buf_mutex);
 }
 
-static void publish_telemetry_work_fn(struct k_work *unused)
+static void telemetry_scheduled(void)
 {
     /* Publish telemetry */
     publish_telemetry(false);
 }
 
-static void telemetry_check_event(struct k_timer *timer)
+/* Every RSRP update feeds stats and the scheduler */
+static void rsrp_evt(int32_t rsrp)
 {
+#if defined(CONFIG_PYRINAS_CLOUD_STATS)
+    pyrinas_cloud_stats_rsrp_add(rsrp);
+#endif
 
-    /* Publish from work queue or else hard fault */
-    k_work_submit_to_queue(main_tasks_q, &publish_telemetry_work);
+    pyrinas_cloud_scheduler_rsrp_update(rsrp);
+}
 
-    /* Restart timer */
-    k_timer_start(&telemetry_timer, TELEMETRY_INTERVAL, K_NO_WAIT);
+static void cloud_cmd_post(enum cloud_cmd cmd)
+{
+    atomic_set_bit(&cloud_cmd_s, cmd);
+    k_poll_signal_raise(&cloud_cmd_signal, 0);
+}
+
+/* Only called from the cloud thread */
+static void cloud_cmd_process(void)
+{
+    int err;
+
+    if (atomic_test_and_clear_bit(&cloud_cmd_s, cloud_cmd_subscribe) &&
+        atomic_get(&cloud_state_s) == cloud_state_connected)
+    {
+        /* Save this for later */
+        sub_message_id = message_id_next();
+
+        err = subscribe_all(sub_message_id);
+        if (err)
+            LOG_ERR("Unable to subscribe. Err: %i", err);
+    }
+
+    if (atomic_test_and_clear_bit(&cloud_cmd_s, cloud_cmd_disconnect))
+    {
+        err = pyrinas_cloud_transport_disconnect();
+        if (err)
+            LOG_WRN("Could not disconnect. Error: %d", err);
+    }
 }
 
 static void on_connect_fn(struct k_work *unused)
@@ -393,16 +1019,72 @@ static void on_connect_fn(struct k_work *unused)
     /* Publish telemetry */
     publish_telemetry(true);
 
-    /* Trigger OTA check */
-    if (atomic_get(&ota_state_s) == ota_state_ready)
+    /* Nothing to do while an update is in progress */
+    if (atomic_get(&ota_state_s) != ota_state_ready)
+        return;
+
+    /* Broker kept our subscriptions. Only trust it once we've
+     * subscribed since boot in case the topics have changed. */
+    if (atomic_get(&session_present_s) && atomic_get(&subscribed_s))
+    {
+        LOG_INF("Session resumed. Skipping subscribe.");
+    }
+    else
     {
+        /* Goes out before the OTA check below */
+        cloud_cmd_post(cloud_cmd_subscribe);
+    }
 
-        /* Save this for later */
-        ota_sub_message_id = (uint16_t)sys_rand32_get();
+    if (atomic_get(&initial_ota_check) == 0)
+    {
+#if defined(CONFIG_PYRINAS_CLOUD_OTA_RETAINED)
+        /* The retained manifest comes with the SUBACK. Only ask if it doesn't. */
+        k_delayed_work_submit_to_queue(main_tasks_q, &ota_check_fallback_work,
+                                       K_MSEC(CONFIG_PYRINAS_CLOUD_OTA_RETAINED_TIMEOUT_MS));
+#else
+        /* Trigger OTA check. The broker handles packets in order so there's
+         * no need to wait for the SUBACK. */
+        publish_ota_check();
+
+        /* Make sure we get a response */
+        k_delayed_work_submit_to_queue(main_tasks_q, &ota_check_subscribed_work, K_SECONDS(10));
+#endif
+    }
+}
+
+#if defined(CONFIG_PYRINAS_CLOUD_OTA_RETAINED)
+static void ota_check_fallback_work_fn(struct k_work *unused)
+{
+    ARG_UNUSED(unused);
+
+    if (atomic_get(&initial_ota_check))
+        return;
+
+    LOG_WRN("No retained manifest. Asking for one.");
+
+    publish_ota_check();
+
+    /* Make sure we get a response */
+    k_delayed_work_submit_to_queue(main_tasks_q, &ota_check_subscribed_work, K_SECONDS(10));
+}
+#endif
+
+/* No update pending. Lets the application start. */
+static void ota_ready(bool cached)
+{
+    /* First time since boot. Connect start to here is what the
+     * application waited on. */
+    if (connect_stats.ready_ms == 0)
+    {
+        connect_stats.ready_ms = k_uptime_get() - connect_start_time;
+        connect_stats.ready_cached = cached;
 
-        /* Subscribe to OTA topic */
-        subscribe(ota_sub_topic, strlen(ota_sub_topic), ota_sub_message_id);
+        LOG_INF("OTA ready after %d ms%s", connect_stats.ready_ms, cached ? " (cached manifest)" : "");
     }
+
+    /* Callback to main to notify complete */
+    if (ota_state_callback)
+        ota_state_callback(ota_state_ready);
 }
 
 static void ota_check_subscribed_work_fn(struct k_work *unused)
@@ -416,7 +1098,29 @@ static void fota_start_fn(struct k_work *unused)
 {
     ARG_UNUSED(unused);
 
-#ifdef CONFIG_FOTA_DOWNLOAD
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA)
+    /* Retries and resumes on its own from here */
+    int err = pyrinas_cloud_fota_start(&ota_data);
+    if (err)
+    {
+        LOG_ERR("Unable to start FOTA. Err: %d", err);
+        atomic_set(&ota_state_s, ota_state_error);
+
+        /* Send to calback */
+        if (ota_state_callback)
+            ota_state_callback(ota_state_s);
+
+        k_work_submit(&ota_reboot_work);
+        return;
+    }
+
+    /* Set that we're busy now */
+    atomic_set(&ota_state_s, ota_state_downloading);
+
+    /* Send to calback */
+    if (ota_state_callback)
+        ota_state_callback(ota_state_s);
+#elif defined(CONFIG_FOTA_DOWNLOAD)
 
     /* Start the FOTA process */
     int err;
@@ -459,13 +1163,26 @@ static void publish_evt_handler(const char *topic, size_t topic_len, const char
     int result = 0;
 
     /* If its the OTA sub topic process */
-    if (strncmp(ota_sub_topic, topic, strlen(ota_sub_topic)) == 0)
+    if (topic_len == ota_sub_topic_len && memcmp(ota_sub_topic, topic, topic_len) == 0)
     {
         LOG_INF("Found %s. Data size: %d", ota_sub_topic, data_len);
 
         /* Set check flag */
         atomic_set(&initial_ota_check, 1);
 
+#if defined(CONFIG_PYRINAS_CLOUD_OTA_MANIFEST_CACHE)
+        /* Already checked this one on this build and told the backend */
+        if (pyrinas_cloud_manifest_cached(data, data_len))
+        {
+            LOG_INF("Manifest unchanged.");
+
+            if (atomic_get(&ota_state_s) == ota_state_ready)
+                ota_ready(true);
+
+            return;
+        }
+#endif
+
         /* Parse OTA event */
         int err = decode_ota_data(&ota_data, data, data_len);
 
@@ -484,6 +1201,21 @@ static void publish_evt_handler(const char *topic, size_t topic_len, const char
             LOG_WRN("Unable to decode OTA data");
         }
 
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_VERIFY) && !defined(CONFIG_PYRINAS_CLOUD_FOTA_ALLOW_UNVERIFIED)
+        /* The image couldn't be checked. Stay on this build without
+         * acknowledging or caching the manifest so a fixed one is
+         * picked up. */
+        if (result == 1 && !ota_data.has_digest)
+        {
+            LOG_ERR("No digest in manifest. Update rejected.");
+
+            if (atomic_get(&ota_state_s) == ota_state_ready)
+                ota_ready(false);
+
+            return;
+        }
+#endif
+
         /* If incoming is greater or hash is not equal */
         if (result == 1)
         {
@@ -515,51 +1247,92 @@ static void publish_evt_handler(const char *topic, size_t topic_len, const char
                 /* Let the backend know we're done */
                 k_work_submit_to_queue(main_tasks_q, &ota_done_work);
 
-                /* Subscribe to Application topic */
-                subscribe(application_sub_topic, strlen(application_sub_topic), sys_rand32_get());
+#if defined(CONFIG_PYRINAS_CLOUD_OTA_MANIFEST_CACHE)
+                /* Only a manifest that decoded counts */
+                if (err == 0)
+                    pyrinas_cloud_manifest_cache_store(data, data_len);
+#endif
 
-                /* Callback to main to notify complete */
-                if (ota_state_callback)
-                    ota_state_callback(ota_state_s);
+                ota_ready(false);
             }
         }
 
         return;
     }
 
-    for (int i = 0; i < CONFIG_PYRINAS_CLOUD_APPLICATION_CALLBACK_MAX_COUNT; i++)
+    /* Remote config */
+    if (topic_len == config_sub_topic_len && memcmp(config_sub_topic, topic, topic_len) == 0)
     {
-        /* Continue if null */
-        if (callbacks[i] == NULL)
-            continue;
+        struct pyrinas_cloud_telemetry_interval interval;
 
-        /* Determine if this is the topic*/
-        if (strncmp(callbacks[i]->full_topic, topic, topic_len) == 0)
+        pyrinas_cloud_telemetry_interval_get(&interval);
+
+        if (decode_config_data(&interval, data, data_len) != 0)
         {
-            LOG_DBG("Found %s\n", callbacks[i]->topic);
+            LOG_WRN("Unable to decode config");
+            return;
+        }
 
-            /* Callbacks to app context */
-            callbacks[i]->cb(callbacks[i]->topic, callbacks[i]->topic_len, data, data_len);
+        if (pyrinas_cloud_telemetry_interval_set(&interval) != 0)
+            LOG_WRN("Invalid telemetry interval %d/%d/%d", interval.min_sec, interval.base_sec, interval.max_sec);
 
-            /* Found it,lets break */
-            break;
-        }
+        return;
+    }
+
+#if defined(CONFIG_PYRINAS_CLOUD_DOWNLINK)
+    /* For one peripheral behind the hub */
+    if (topic_len > downlink_sub_prefix_len &&
+        memcmp(downlink_sub_prefix, topic, downlink_sub_prefix_len) == 0)
+    {
+        pyrinas_cloud_downlink_route(topic + downlink_sub_prefix_len, topic_len - downlink_sub_prefix_len, data, data_len);
+        return;
+    }
+#endif
+
+    /* Only application topics from here on */
+    if (topic_len <= application_sub_prefix_len ||
+        memcmp(application_sub_prefix, topic, application_sub_prefix_len) != 0)
+    {
+        char topic_str[CONFIG_PYRINAS_CLOUD_PUBLISH_TOPIC_MAX_SIZE + 1];
+
+        LOG_WRN("Unhandled topic %s", log_strdup(str_terminate(topic_str, sizeof(topic_str), topic, topic_len)));
+        return;
+    }
+
+    const uint8_t *suffix = topic + application_sub_prefix_len;
+    size_t suffix_len = topic_len - application_sub_prefix_len;
+    int handled;
+
+#if defined(CONFIG_PYRINAS_CLOUD_COMPRESS)
+    /* Subscribers always see the original payload */
+    if (pyrinas_cloud_compress_is_compressed(data, data_len))
+        handled = inflate_dispatch(suffix, suffix_len, data, data_len);
+    else
+#endif
+        handled = pyrinas_cloud_dispatch(suffix, suffix_len, data, data_len);
+
+    /* Callbacks to app context */
+    if (handled == 0)
+    {
+        char topic_str[CONFIG_PYRINAS_CLOUD_PUBLISH_TOPIC_MAX_SIZE + 1];
+
+        LOG_DBG("No handler for %s", log_strdup(str_terminate(topic_str, sizeof(topic_str), topic, topic_len)));
     }
 }
 
-/**@brief MQTT client event handler
+/**@brief Transport event handler
  */
-void mqtt_evt_handler(struct mqtt_client *const c, const struct mqtt_evt *evt)
+static void transport_evt_handler(const struct pyrinas_cloud_transport_evt *evt)
 {
     int err;
 
     switch (evt->type)
     {
-    case MQTT_EVT_CONNACK:
+    case transport_evt_connected:
     {
         if (evt->result != 0)
         {
-            LOG_ERR("MQTT connect failed %d", evt->result);
+            LOG_ERR("Cloud connect failed %d", evt->result);
 
             /* Not connected */
             atomic_set(&cloud_state_s, cloud_state_disconnected);
@@ -570,25 +1343,65 @@ void mqtt_evt_handler(struct mqtt_client *const c, const struct mqtt_evt *evt)
             break;
         }
 
-        LOG_INF("MQTT client connected!");
+        /* Time to ready */
+        connect_stats.connack_ms = k_uptime_get() - connect_start_time;
+
+#if defined(CONFIG_PYRINAS_CLOUD_CONNECT_DATA_STATS)
+        uint32_t tx_kb, rx_kb;
+
+        if (get_connstat(&tx_kb, &rx_kb) == 0)
+        {
+            connect_stats.tx_kb = tx_kb - connect_start_tx_kb;
+            connect_stats.rx_kb = rx_kb - connect_start_rx_kb;
+        }
+#endif
+
+        LOG_INF("CONNACK after %d ms. Handshake %d ms, ~%d/%d kB tx/rx.",
+                connect_stats.connack_ms, connect_stats.handshake_ms,
+                connect_stats.tx_kb, connect_stats.rx_kb);
+
+#if defined(CONFIG_PYRINAS_CLOUD_TOPIC_ALIAS)
+        /* Backend drops aliases with the old connection */
+        pyrinas_cloud_alias_reset();
+#endif
+
+        /* Persistent session still holds our subscriptions */
+        atomic_set(&session_present_s, evt->session_present);
+
+        LOG_INF("Cloud connected! Session present: %d", evt->session_present);
+
+        /* Anything left from the last connection goes first */
+        publish_inflight_retransmit();
+        atomic_set(&connack_s, 1);
 
         /* On connect work */
         k_work_submit_to_queue(main_tasks_q, &on_connect_work);
 
-        /*Start telemetry timer every TELEMETRY_INTERVAL */
-        k_timer_start(&telemetry_timer, TELEMETRY_INTERVAL, K_NO_WAIT);
+        /* Periodic telemetry */
+        pyrinas_cloud_scheduler_start();
+
+#if defined(CONFIG_PYRINAS_CLOUD_OUTBOX)
+        /* Send anything stored while offline */
+        if (!pyrinas_cloud_outbox_is_empty())
+            k_delayed_work_submit_to_queue(main_tasks_q, &outbox_drain_work, K_MSEC(CONFIG_PYRINAS_CLOUD_OUTBOX_DRAIN_INTERVAL_MS));
+#endif
 
         break;
     }
 
-    case MQTT_EVT_DISCONNECT:
-        LOG_WRN("[%s:%d] MQTT client disconnected %d", __func__,
+    case transport_evt_disconnected:
+        LOG_WRN("[%s:%d] Cloud disconnected %d", __func__,
                 __LINE__, evt->result);
 
-        /* Stop the timer, we're disconnected*/
-        k_timer_stop(&telemetry_timer);
+        /* Stop telemetry, we're disconnected */
+        pyrinas_cloud_scheduler_stop();
+
+#if defined(CONFIG_PYRINAS_CLOUD_TOPIC_ALIAS)
+        pyrinas_cloud_alias_reset();
+#endif
 
         /* Set state */
+        atomic_set(&connack_s, 0);
         atomic_set(&cloud_state_s, cloud_state_disconnected);
 
         /* Send to calback */
@@ -597,39 +1410,49 @@ void mqtt_evt_handler(struct mqtt_client *const c, const struct mqtt_evt *evt)
 
         break;
 
-    case MQTT_EVT_PUBLISH:
+    case transport_evt_message:
     {
-        const struct mqtt_publish_param *p = &evt->param.publish;
+        const struct pyrinas_cloud_transport_message *p = &evt->message;
+        char topic_str[CONFIG_PYRINAS_CLOUD_PUBLISH_TOPIC_MAX_SIZE + 1];
+
+        LOG_DBG("[%s:%d] Message result=%d topic=%s len=%d", __func__,
+                __LINE__, evt->result, log_strdup(str_terminate(topic_str, sizeof(topic_str), p->topic, p->topic_len)),
+                p->payload_len);
 
-        LOG_DBG("[%s:%d] MQTT PUBLISH result=%d topic=%s len=%d", __func__,
-                __LINE__, evt->result, p->message.topic.topic.utf8, p->message.payload.len);
-        err = publish_get_payload(c, payload_buf, p->message.payload.len);
-        if (err >= 0)
+        /* Large payloads go straight through to stream subscribers */
+        if (p->payload_len > sizeof(payload_buf))
         {
-            /* Handle the event */
-            publish_evt_handler(p->message.topic.topic.utf8, p->message.topic.topic.size, payload_buf, p->message.payload.len);
+            err = publish_stream_payload(p->topic, p->topic_len, p->payload_len);
         }
         else
         {
-            printk("mqtt_read_publish_payload: Failed! %d\n", err);
-            printk("Disconnecting MQTT client...\n");
+            err = publish_get_payload(payload_buf, p->payload_len);
+            if (err >= 0)
+            {
+                /* Handle the event */
+                publish_evt_handler(p->topic, p->topic_len, payload_buf, p->payload_len);
+            }
+        }
+
+        if (err < 0)
+        {
+            printk("Unable to read payload! %d\n", err);
+            printk("Disconnecting...\n");
 
-            err = mqtt_disconnect(c);
+            err = pyrinas_cloud_transport_disconnect();
             if (err)
             {
                 printk("Could not disconnect: %d\n", err);
             }
+
+            break;
         }
 
         /* Need to ACK recieved data... */
-        if (p->message.topic.qos == MQTT_QOS_1_AT_LEAST_ONCE)
+        if (p->qos == cloud_qos_at_least_once)
         {
-
-            const struct mqtt_puback_param ack = {
-                .message_id = p->message_id};
-
             /* Send acknowledgment. */
-            err = mqtt_publish_qos1_ack(c, &ack);
+            err = pyrinas_cloud_transport_ack(p->message_id);
             if (err)
             {
                 printk("unable to ack\n");
@@ -639,101 +1462,32 @@ void mqtt_evt_handler(struct mqtt_client *const c, const struct mqtt_evt *evt)
         break;
     }
 
-    case MQTT_EVT_PUBACK:
-        if (evt->result != 0)
-            printk("MQTT PUBACK error %d\n", evt->result);
-
-        break;
-
-    case MQTT_EVT_SUBACK:
+    case transport_evt_ack:
         if (evt->result != 0)
-        {
-            printk("MQTT SUBACK error %d\n", evt->result);
-            break;
-        }
-
-        LOG_INF("[%s:%d] SUBACK packet id: %u", __func__, __LINE__,
-                evt->param.suback.message_id);
-
-        /* If we're subscribed, publish the request */
-        if (ota_sub_message_id == evt->param.suback.message_id && atomic_get(&initial_ota_check) == 0)
-        {
-            /* Submit work */
-            k_work_submit_to_queue(main_tasks_q, &ota_request_work);
-
-            /* Delay work to make sure we are *at least* subscribed to OTA*/
-            k_delayed_work_submit_to_queue(main_tasks_q, &ota_check_subscribed_work, K_SECONDS(5));
-        }
+            printk("PUBACK error %d\n", evt->result);
 
-        break;
+        /* Complete the in flight publish */
+        publish_inflight_ack(evt->message_id, evt->result);
 
-    default:
-        LOG_INF("[%s:%d] default: %d", __func__, __LINE__, evt->type);
         break;
-    }
-}
-
-/**@brief Resolves the configured hostname and
- * initializes the MQTT broker structure
- */
-static int broker_init(void)
-{
-    int err;
-    struct addrinfo *result;
-    struct addrinfo *addr;
-    struct addrinfo hints = {.ai_family = AF_INET,
-                             .ai_socktype = SOCK_STREAM};
 
-    err = getaddrinfo(CONFIG_PYRINAS_CLOUD_MQTT_BROKER_HOSTNAME, NULL, &hints, &result);
-    if (err)
-        return err;
-
-    addr = result;
-    err = -ENOENT;
+    case transport_evt_suback:
+        LOG_INF("[%s:%d] SUBACK packet id: %u", __func__, __LINE__,
+                evt->message_id);
 
-    /* Look for address of the broker. */
-    while (addr != NULL)
-    {
-        /* IPv4 Address. */
-        if (addr->ai_addrlen == sizeof(struct sockaddr_in))
+        if (sub_message_id == evt->message_id)
         {
-            struct sockaddr_in *broker4 =
-                ((struct sockaddr_in *)&broker);
-            char ipv4_addr[NET_IPV4_ADDR_LEN];
+            bool granted = evt->result == 0;
 
-            broker4->sin_addr.s_addr =
-                ((struct sockaddr_in *)addr->ai_addr)
-                    ->sin_addr.s_addr;
-            broker4->sin_family = AF_INET;
-            broker4->sin_port = htons(CONFIG_PYRINAS_CLOUD_MQTT_BROKER_PORT);
+            if (!granted)
+                LOG_ERR("Subscription refused. Err: %d", evt->result);
 
-            inet_ntop(AF_INET, &broker4->sin_addr.s_addr, ipv4_addr,
-                      sizeof(ipv4_addr));
-            LOG_DBG("IPv4 Address found %s", ipv4_addr);
-
-            break;
-        }
-        else
-        {
-            printk("ai_addrlen = %u should be %u or %u\n",
-                   (unsigned int)addr->ai_addrlen,
-                   (unsigned int)sizeof(struct sockaddr_in),
-                   (unsigned int)sizeof(struct sockaddr_in6));
+            /* Safe to rely on the session from here on */
+            atomic_set(&subscribed_s, granted);
         }
 
-        addr = addr->ai_next;
         break;
     }
-
-    /* Free the address. */
-    freeaddrinfo(result);
-
-    return 0;
-}
-
-static void ota_request_work_fn(struct k_work *unused)
-{
-    publish_ota_check();
 }
 
 static void reboot_work_fn(struct k_work *unused)
@@ -758,60 +1512,96 @@ static void ota_done_work_fn(struct k_work *unused)
     publish_ota_done();
 }
 
+#if defined(CONFIG_PYRINAS_CLOUD_OUTBOX)
+static void outbox_publish_done(int result, uint32_t latency_ms, void *user_data)
+{
+    ARG_UNUSED(latency_ms);
+
+    /* Batch delivered. The next drain saves that and sends more. */
+    if (pyrinas_cloud_outbox_sent((uint32_t)(uintptr_t)user_data, result))
+        k_delayed_work_submit_to_queue(main_tasks_q, &outbox_drain_work, K_NO_WAIT);
+}
+
+static int outbox_publish(const uint8_t *topic, size_t topic_len, const uint8_t *data, size_t data_len, uint32_t token)
+{
+    /* Stays in the outbox until the PUBACK */
+    const struct pyrinas_cloud_publish_opts opts = {
+        .qos = cloud_qos_at_least_once,
+        .cb = outbox_publish_done,
+        .user_data = (void *)(uintptr_t)token,
+    };
+
+    return publish_enqueue((uint8_t *)topic, topic_len, (uint8_t *)data, data_len, true, true, &opts);
+}
+
+static void outbox_drain_work_fn(struct k_work *unused)
+{
+    /* Send a batch of stored publishes */
+    int ret = pyrinas_cloud_outbox_drain(outbox_publish,
+                                         CONFIG_PYRINAS_CLOUD_OUTBOX_DRAIN_BATCH_COUNT,
+                                         CONFIG_PYRINAS_CLOUD_OUTBOX_DRAIN_BATCH_BYTES);
+    if (ret < 0)
+    {
+        LOG_WRN("Unable to drain outbox. Err: %i", ret);
+        return;
+    }
+
+    /* Come back for the rest */
+    if (!pyrinas_cloud_outbox_is_empty() && atomic_get(&cloud_state_s) == cloud_state_connected)
+        k_delayed_work_submit_to_queue(main_tasks_q, &outbox_drain_work, K_MSEC(CONFIG_PYRINAS_CLOUD_OUTBOX_DRAIN_INTERVAL_MS));
+}
+#endif
+
 static void work_init()
 {
     k_delayed_work_init(&fota_work, fota_start_fn);
     k_delayed_work_init(&ota_check_subscribed_work, ota_check_subscribed_work_fn);
+#if defined(CONFIG_PYRINAS_CLOUD_OTA_RETAINED)
+    k_delayed_work_init(&ota_check_fallback_work, ota_check_fallback_work_fn);
+#endif
     k_work_init(&on_connect_work, on_connect_fn);
     k_work_init(&ota_reboot_work, reboot_work_fn);
-    k_work_init(&ota_request_work, ota_request_work_fn);
     k_work_init(&ota_done_work, ota_done_work_fn);
-    k_work_init(&publish_telemetry_work, publish_telemetry_work_fn);
+#if defined(CONFIG_PYRINAS_CLOUD_OUTBOX)
+    k_delayed_work_init(&outbox_drain_work, outbox_drain_work_fn);
+#endif
 }
 
-/**@brief Initialize the MQTT client structure
- */
-static int client_init(struct mqtt_client *client, char *p_client_id, size_t client_id_sz)
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA)
+static void fota_evt(enum pyrinas_cloud_fota_evt evt)
 {
+    switch (evt)
+    {
+    case fota_evt_progress:
+        /* State stays downloading */
+        if (ota_state_callback)
+            ota_state_callback(ota_state_progress);
 
-    int err;
+        break;
 
-    mqtt_client_init(client);
+    case fota_evt_error:
+        /* Progress is saved. The download picks up here after the reboot. */
+        atomic_set(&ota_state_s, ota_state_error);
 
-    err = broker_init();
-    if (err != 0)
-        return err;
+        if (ota_state_callback)
+            ota_state_callback(ota_state_s);
 
-    /* MQTT client configuration */
-    client->broker = &broker;
-    client->evt_cb = mqtt_evt_handler;
-    client->client_id.utf8 = p_client_id;
-    client->client_id.size = client_id_sz;
-    client->password = NULL;
-    client->user_name = NULL;
-    client->protocol_version = MQTT_VERSION_3_1_1;
-
-    /* MQTT buffers configuration */
-    client->rx_buf = rx_buffer;
-    client->rx_buf_size = sizeof(rx_buffer);
-    client->tx_buf = tx_buffer;
-    client->tx_buf_size = sizeof(tx_buffer);
-
-    /* MQTT transport configuration */
-    struct mqtt_sec_config *tls_config = &client->transport.tls.config;
-
-    client->transport.type = MQTT_TRANSPORT_SECURE;
-    tls_config->peer_verify = CONFIG_PYRINAS_CLOUD_PEER_VERIFY;
-    tls_config->cipher_count = 0;
-    tls_config->cipher_list = NULL;
-    tls_config->sec_tag_count = ARRAY_SIZE(sec_tag_list);
-    tls_config->sec_tag_list = sec_tag_list;
-    tls_config->hostname = CONFIG_PYRINAS_CLOUD_MQTT_BROKER_HOSTNAME;
+        k_work_submit(&ota_reboot_work);
+        break;
 
-    return 0;
-}
+    case fota_evt_done:
+        LOG_INF("OTA Done.");
+
+        atomic_set(&ota_state_s, ota_state_done);
+
+        if (ota_state_callback)
+            ota_state_callback(ota_state_s);
 
-#ifdef CONFIG_FOTA_DOWNLOAD
+        k_work_submit(&ota_reboot_work);
+        break;
+    }
+}
+#elif defined(CONFIG_FOTA_DOWNLOAD)
 static void fota_evt(const struct fota_download_evt *evt)
 {
 
@@ -863,24 +1653,49 @@ int pyrinas_cloud_connect()
     /* Get the IMEI */
     get_imei(imei, sizeof(imei));
 
-    /* MQTT client create */
-    err = client_init(&client, imei, sizeof(imei));
-    if (err != 0)
+    /* Broker addresses. Cached if enabled. */
+    int count = pyrinas_cloud_resolver_lookup(broker_addrs, ARRAY_SIZE(broker_addrs));
+    if (count < 0)
     {
-        LOG_ERR("client_init %d", err);
-        return err;
+        LOG_ERR("Unable to resolve broker %d", count);
+        return count;
+    }
+
+#if defined(CONFIG_PYRINAS_CLOUD_CONNECT_DATA_STATS)
+    get_connstat(&connect_start_tx_kb, &connect_start_rx_kb);
+#endif
+
+    connect_start_time = k_uptime_get();
+    atomic_set(&connack_s, 0);
+
+    /* Try each until one connects */
+    err = -ENOENT;
+    for (int i = 0; i < count; i++)
+    {
+        err = pyrinas_cloud_transport_connect(imei, sizeof(imei), &broker_addrs[i], transport_evt_handler);
+        if (err == 0)
+            break;
+
+        LOG_WRN("Connect to address %d of %d failed. Err: %d", i + 1, count, err);
     }
 
-    /* Connect to MQTT */
-    err = mqtt_connect(&client);
     if (err != 0)
     {
-        LOG_ERR("mqtt_connect %d", err);
+        /* Addresses may have moved */
+        pyrinas_cloud_resolver_invalidate();
+
+        LOG_ERR("Unable to connect %d", err);
         return err;
     }
 
+    /* Returns once the (D)TLS handshake is done */
+    connect_stats.handshake_ms = k_uptime_get() - connect_start_time;
+    connect_stats.handshake_total_ms += connect_stats.handshake_ms;
+    connect_stats.handshake_max_ms = MAX(connect_stats.handshake_max_ms, connect_stats.handshake_ms);
+    connect_stats.count++;
+
     /* Set FDS info */
-    fds.fd = client.transport.tls.sock;
+    fds.fd = pyrinas_cloud_transport_socket();
     fds.events = POLLIN;
 
     /* Set state */
@@ -896,6 +1711,11 @@ int pyrinas_cloud_connect()
     return 0;
 }
 
+void pyrinas_cloud_get_connect_stats(struct pyrinas_cloud_connect_stats *stats)
+{
+    *stats = connect_stats;
+}
+
 bool pyrinas_cloud_is_connected()
 {
     return atomic_get(&cloud_state_s) == cloud_state_connected;
@@ -903,20 +1723,19 @@ bool pyrinas_cloud_is_connected()
 
 int pyrinas_cloud_disconnect()
 {
-    int err;
+    if (atomic_get(&cloud_state_s) != cloud_state_connected)
+        return -ENOTCONN;
 
-    err = mqtt_disconnect(&client);
-    if (err)
-    {
-        return err;
-        printk("Could not disconnect MQTT client. Error: %d\n", err);
-    }
+    /* The cloud thread owns the transport */
+    cloud_cmd_post(cloud_cmd_disconnect);
 
     return 0;
 }
 
 void pyrinas_cloud_init(struct k_work_q *task_q, pyrinas_cloud_ota_state_evt_t cb)
 {
+    int err;
+
     /* Error if queue is not attached */
     __ASSERT(task_q != NULL, "Task queue must not be NULL.");
 
@@ -951,30 +1770,129 @@ void pyrinas_cloud_init(struct k_work_q *task_q, pyrinas_cloud_ota_state_evt_t c
     LOG_INF("IMEI: %s", imei);
 
 /* Init FOTA client */
-#ifdef CONFIG_FOTA_DOWNLOAD
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA)
+    pyrinas_cloud_fota_init(main_tasks_q, fota_evt);
+#elif defined(CONFIG_FOTA_DOWNLOAD)
     fota_download_init(fota_evt);
 #endif
 
     /* Set up topics */
     snprintf(ota_pub_topic, sizeof(ota_pub_topic), CONFIG_PYRINAS_CLOUD_MQTT_OTA_PUB_TOPIC, IMEI_LEN, imei);
-    snprintf(ota_sub_topic, sizeof(ota_sub_topic), CONFIG_PYRINAS_CLOUD_MQTT_OTA_SUB_TOPIC, IMEI_LEN, imei);
+    ota_sub_topic_len = snprintf(ota_sub_topic, sizeof(ota_sub_topic), CONFIG_PYRINAS_CLOUD_MQTT_OTA_SUB_TOPIC, IMEI_LEN, imei);
+    config_sub_topic_len = snprintf(config_sub_topic, sizeof(config_sub_topic), CONFIG_PYRINAS_CLOUD_MQTT_CONFIG_SUB_TOPIC, IMEI_LEN, imei);
     snprintf(telemetry_pub_topic, sizeof(telemetry_pub_topic), CONFIG_PYRINAS_CLOUD_MQTT_TELEMETRY_PUB_TOPIC, IMEI_LEN, imei);
-    snprintf(application_sub_topic, sizeof(application_sub_topic), CONFIG_PYRINAS_CLOUD_MQTT_APPLICATION_SUB_TOPIC, IMEI_LEN, imei, 1, "+");
+    snprintf(application_sub_topic, sizeof(application_sub_topic), CONFIG_PYRINAS_CLOUD_MQTT_APPLICATION_SUB_TOPIC, IMEI_LEN, imei, 1, "#");
+    application_sub_prefix_len = snprintf(application_sub_prefix, sizeof(application_sub_prefix), CONFIG_PYRINAS_CLOUD_MQTT_APPLICATION_SUB_TOPIC, IMEI_LEN, imei, 0, "");
+
+#if defined(CONFIG_PYRINAS_CLOUD_DOWNLINK)
+    downlink_sub_topic_len = snprintf(downlink_sub_topic, sizeof(downlink_sub_topic), CONFIG_PYRINAS_CLOUD_MQTT_DOWNLINK_SUB_TOPIC, IMEI_LEN, imei, 1, "#");
+    downlink_sub_prefix_len = snprintf(downlink_sub_prefix, sizeof(downlink_sub_prefix), CONFIG_PYRINAS_CLOUD_MQTT_DOWNLINK_SUB_TOPIC, IMEI_LEN, imei, 0, "");
+#endif
+
+#if defined(CONFIG_PYRINAS_CLOUD_TOPIC_ALIAS)
+    alias_register_topic_len = snprintf(alias_register_topic, sizeof(alias_register_topic), CONFIG_PYRINAS_CLOUD_MQTT_ALIAS_REGISTER_TOPIC, IMEI_LEN, imei);
+    pyrinas_cloud_alias_init(imei, IMEI_LEN, alias_register);
+#endif
 
     /* Initialize workers */
     work_init();
+
+    /* Broker address cache */
+    pyrinas_cloud_resolver_init(main_tasks_q);
+
+#if defined(CONFIG_PYRINAS_CLOUD_OTA_MANIFEST_CACHE)
+    /* Manifest from the last boot */
+    pyrinas_cloud_manifest_cache_init();
+#endif
+
+    /* Make sure application telemetry fits. Every record would be corrupt otherwise. */
+    err = telemetry_app_fields_check();
+    __ASSERT(err == 0, "Invalid application telemetry fields. Err: %d", err);
+
+    /* Telemetry timing. Loads the interval from the last boot. */
+    pyrinas_cloud_scheduler_init(main_tasks_q, telemetry_scheduled);
+
+    /* Collect every RSRP update, not just the one at send time */
+    cellular_register_rsrp_evt(rsrp_evt);
+
+#if defined(CONFIG_PYRINAS_CLOUD_CONNECT_DATA_STATS)
+    /* Start modem data counters */
+    if (at_cmd_write("AT%XCONNSTAT=1", NULL, 0, NULL) != 0)
+        LOG_WRN("Unable to start connection stats.");
+#endif
+
+#if defined(CONFIG_PYRINAS_CLOUD_OUTBOX)
+    /* Storage for publishes while offline */
+    err = pyrinas_cloud_outbox_init();
+    if (err)
+        LOG_WRN("Outbox unavailable. Err: %i", err);
+#endif
+
+#if defined(CONFIG_PYRINAS_CLOUD_BATCH)
+    /* Collects peripheral events */
+    pyrinas_cloud_batch_init(main_tasks_q, batch_flush_cb);
+#endif
 }
 
-static int pyrinas_cloud_publish_telemetry_evt(pyrinas_event_t *evt)
+/* Publish peripheral link telemetry */
+static int publish_peripheral_telemetry(uint8_t *topic, size_t topic_len, struct pyrinas_cloud_telemetry_data *data)
 {
-
-    char topic[256];
-    char uid[14];
-    char buf[64];
     size_t payload_len = 0;
     int err = 0;
 
-    struct pyrinas_cloud_telemetry_data data;
+    LOG_DBG("Rssi: %i %i", data->central_rssi, data->peripheral_rssi);
+
+    k_mutex_lock(&telemetry_buf_mutex, K_FOREVER);
+
+    /* Encode data */
+    err = encode_telemetry_data(data, false, telemetry_buf, sizeof(telemetry_buf), &payload_len);
+    if (err)
+    {
+        LOG_ERR("Unable to encode telemetry data.");
+    }
+    else
+    {
+        /* Publish the data. It's copied. */
+        err = app_data_publish(topic, topic_len, telemetry_buf, payload_len);
+    }
+
+    k_mutex_unlock(&telemetry_buf_mutex);
+
+    return err;
+}
+
+#if defined(CONFIG_PYRINAS_CLOUD_BATCH)
+static void batch_flush_cb(const struct pyrinas_cloud_batch_flush *flush)
+{
+    int err;
+
+    /* One publish for the whole batch */
+    err = app_data_publish((uint8_t *)flush->topic, flush->topic_len, (uint8_t *)flush->data, flush->data_len);
+    if (err)
+    {
+        LOG_WRN("Unable to publish batch. Err: %i", err);
+        pyrinas_cloud_peripheral_error(flush->peripheral_addr);
+    }
+
+    struct pyrinas_cloud_telemetry_data data = {
+        .has_central_rssi = flush->has_central_rssi,
+        .central_rssi = flush->central_rssi,
+        .has_peripheral_rssi = flush->has_peripheral_rssi,
+        .peripheral_rssi = flush->peripheral_rssi,
+    };
+
+    /* And one for the most recent link quality */
+    if (data.has_central_rssi || data.has_peripheral_rssi)
+    {
+        err = publish_peripheral_telemetry((uint8_t *)flush->telemetry_topic, flush->telemetry_topic_len, &data);
+        if (err)
+            LOG_WRN("Unable to publish batch telemetry. Err: %i", err);
+    }
+}
+#else
+static int pyrinas_cloud_publish_telemetry_evt(pyrinas_event_t *evt, const struct pyrinas_cloud_peripheral_topics *topics)
+{
+    struct pyrinas_cloud_telemetry_data data = {0};
 
     /* Check if central RSSI */
     if (evt->central_rssi < 0)
@@ -990,63 +1908,64 @@ static int pyrinas_cloud_publish_telemetry_evt(pyrinas_event_t *evt)
         data.peripheral_rssi = evt->peripheral_rssi;
     }
 
-    LOG_DBG("Rssi: %i %i", data.central_rssi, data.peripheral_rssi);
-
-    /* Encode data */
-    err = encode_telemetry_data(&data, buf, sizeof(buf), &payload_len);
-    if (err)
-    {
-        LOG_ERR("Unable to encode telemetry data.");
-        return err;
-    }
-
-    /* Get peripheral address */
-    snprintf(uid, sizeof(uid), "%02x%02x%02x%02x%02x%02x",
-             evt->peripheral_addr[0], evt->peripheral_addr[1], evt->peripheral_addr[2],
-             evt->peripheral_addr[3], evt->peripheral_addr[4], evt->peripheral_addr[5]);
-
-    /* Create topic */
-    snprintf(topic, sizeof(topic),
-             CONFIG_PYRINAS_CLOUD_MQTT_TELEMETRY_PUB_TOPIC,
-             strlen(uid), uid);
-
     /* Publish the data */
-    return data_publish(topic, strlen(topic), buf, payload_len, sys_rand32_get());
+    return publish_peripheral_telemetry((uint8_t *)topics->telemetry, topics->telemetry_len, &data);
 }
+#endif
 
 int pyrinas_cloud_publish_evt(pyrinas_event_t *evt)
 {
-    char topic[256];
-    char uid[14];
-    int err;
+    struct pyrinas_cloud_peripheral_topics topics;
 
-    /* Get peripheral address */
-    snprintf(uid, sizeof(uid), "%02x%02x%02x%02x%02x%02x",
-             evt->peripheral_addr[0], evt->peripheral_addr[1], evt->peripheral_addr[2],
-             evt->peripheral_addr[3], evt->peripheral_addr[4], evt->peripheral_addr[5]);
+    /* Topics were formatted when the peripheral was first seen */
+    pyrinas_cloud_peripheral_seen(evt->peripheral_addr, evt->data.size, &topics);
 
-    LOG_DBG("Sending to: %s.", evt->name.bytes);
+#if defined(CONFIG_PYRINAS_CLOUD_STATS)
+    /* Every sample counts, not just the ones that get sent */
+    pyrinas_cloud_stats_rssi_add(evt->peripheral_addr, evt->central_rssi, evt->peripheral_rssi);
+#endif
+
+#if defined(CONFIG_PYRINAS_CLOUD_DOWNLINK)
+    /* It's listening. Retry anything still queued for it. */
+    pyrinas_cloud_downlink_flush(evt->peripheral_addr);
+#endif
+
+#if defined(CONFIG_PYRINAS_CLOUD_BATCH)
+    /* Collected and sent as one publish per window */
+    return pyrinas_cloud_batch_add(evt, &topics);
+#else
+    char topic[sizeof(topics.app_prefix) + sizeof(evt->name.bytes)];
+    size_t topic_len;
+    int err;
 
     /* Create topic */
-    snprintf(topic, sizeof(topic),
-             CONFIG_PYRINAS_CLOUD_MQTT_APPLICATION_PUB_TOPIC,
-             strlen(uid), uid,
-             evt->name.size, evt->name.bytes);
+    topic_len = pyrinas_cloud_peripheral_topic(topics.app_prefix, topics.app_prefix_len,
+                                               evt->name.bytes, evt->name.size,
+                                               topic, sizeof(topic));
+
+    LOG_DBG("Sending to: %s.", log_strdup(topic));
 
     /* Publish the data */
-    err = data_publish(topic, strlen(topic), evt->data.bytes, evt->data.size, sys_rand32_get());
+    err = app_data_publish(topic, topic_len, evt->data.bytes, evt->data.size);
     if (err)
     {
         LOG_WRN("Unable to publish. Err: %i", err);
+        pyrinas_cloud_peripheral_error(evt->peripheral_addr);
     }
 
     /* Publish telemetry */
-    return pyrinas_cloud_publish_telemetry_evt(evt);
+    return pyrinas_cloud_publish_telemetry_evt(evt, &topics);
+#endif
 }
 
 int pyrinas_cloud_publish(char *type, uint8_t *data, size_t len)
 {
-    char topic[256];
+    return pyrinas_cloud_publish_ex(type, data, len, NULL);
+}
+
+int pyrinas_cloud_publish_ex(char *type, uint8_t *data, size_t len, const struct pyrinas_cloud_publish_opts *opts)
+{
+    char topic[CONFIG_PYRINAS_CLOUD_PUBLISH_TOPIC_MAX_SIZE + 1];
 
     /* Create topic */
     snprintf(topic, sizeof(topic),
@@ -1055,7 +1974,7 @@ int pyrinas_cloud_publish(char *type, uint8_t *data, size_t len)
              strlen(type), type);
 
     /* Publish the data */
-    return data_publish(topic, strlen(topic), data, len, sys_rand32_get());
+    return data_publish(topic, strlen(topic), data, len, true, opts);
 }
 
 void pyrinas_cloud_register_state_evt(pyrinas_cloud_state_evt_t cb)
@@ -1063,93 +1982,192 @@ void pyrinas_cloud_register_state_evt(pyrinas_cloud_state_evt_t cb)
     cloud_state_callback = cb;
 }
 
+/* Sleep until the keepalive is due. Bounded so the WDT gets fed. */
+static k_timeout_t wait_timeout_get(void)
+{
+    int timeout = CLOUD_THREAD_WAIT_MAX_MS;
+
+    if (atomic_get(&cloud_state_s) == cloud_state_connected)
+    {
+        int left = pyrinas_cloud_transport_time_left();
+
+        if (left >= 0 && left < timeout)
+            timeout = left;
+    }
+
+    return K_MSEC(timeout);
+}
+
+/* New connection. The rx thread watches its socket from here on. */
+static void rx_start(void)
+{
+    atomic_inc(&rx_gen_s);
+    k_poll_signal_reset(&rx_signal);
+    k_sem_give(&rx_poll_sem);
+}
+
+/* Socket events for the current connection. False once it's gone. */
+static bool rx_process(int revents)
+{
+    int err;
+
+    if ((revents & POLLIN) == POLLIN)
+    {
+        err = pyrinas_cloud_transport_input();
+        if (err != 0)
+        {
+            LOG_ERR("ERROR: input %d", err);
+            pyrinas_cloud_transport_abort();
+            return false;
+        }
+    }
+
+    if ((revents & POLLERR) == POLLERR)
+    {
+        LOG_ERR("POLLERR\n");
+        pyrinas_cloud_transport_abort();
+        return false;
+    }
+
+    if ((revents & POLLNVAL) == POLLNVAL)
+    {
+        LOG_ERR("POLLNVAL\n");
+        pyrinas_cloud_transport_abort();
+        return false;
+    }
+
+    return atomic_get(&cloud_state_s) == cloud_state_connected;
+}
+
 void pyrinas_cloud_process()
 {
     int err;
 
+    /* Woken by a connection, queued publishes, the socket or a request */
+    struct k_poll_event events[] = {
+        K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_SEM_AVAILABLE,
+                                 K_POLL_MODE_NOTIFY_ONLY,
+                                 &pyrinas_cloud_thread_sem),
+        K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_FIFO_DATA_AVAILABLE,
+                                 K_POLL_MODE_NOTIFY_ONLY,
+                                 &publish_fifo),
+        K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_SIGNAL,
+                                 K_POLL_MODE_NOTIFY_ONLY,
+                                 &rx_signal),
+        K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_SIGNAL,
+                                 K_POLL_MODE_NOTIFY_ONLY,
+                                 &cloud_cmd_signal),
+    };
+
     /* Get thread id*/
     pyrinas_cloud_thread_id = k_current_get();
 
     while (true)
     {
 
-        /* Don't go any further until MQTT is connected */
-        err = k_sem_take(&pyrinas_cloud_thread_sem, K_SECONDS(55));
-        if (err)
-        {
-            /* Touch the WDT */
-            if (atomic_get(&wdt_started_s))
-                wdt_feed(wdt_drv, wdt_channel_id);
+        /* Nothing to do until one of the above or the keepalive */
+        k_poll(events, ARRAY_SIZE(events), wait_timeout_get());
 
-            /* If timeout continue*/
-            continue;
-        }
+        /* Touch the WDT */
+        if (atomic_get(&wdt_started_s))
+            wdt_feed(wdt_drv, wdt_channel_id);
 
-        /* Only start if it hasn't been already */
-        if (atomic_get(&wdt_started_s) == 0)
+        /* Just connected */
+        if (k_sem_take(&pyrinas_cloud_thread_sem, K_NO_WAIT) == 0)
         {
-            /* Bring up WDT after enabling */
-            err = wdt_setup(wdt_drv, 0);
-            if (err)
-                LOG_ERR("WDT setup error. Error: %i", err);
+            /* Only start if it hasn't been already */
+            if (atomic_get(&wdt_started_s) == 0)
+            {
+                /* Bring up WDT after enabling */
+                err = wdt_setup(wdt_drv, 0);
+                if (err)
+                    LOG_ERR("WDT setup error. Error: %i", err);
+
+                atomic_set(&wdt_started_s, 1);
+            }
 
-            atomic_set(&wdt_started_s, 1);
+            rx_start();
         }
 
-        while (atomic_get(&cloud_state_s) == cloud_state_connected)
-        {
+        /* Socket event. Dropped if it's from an old connection. */
+        unsigned int signaled = 0;
+        int result = 0;
 
-            /* Touch the WDT */
-            wdt_feed(wdt_drv, wdt_channel_id);
+        k_poll_signal_check(&rx_signal, &signaled, &result);
+        if (signaled)
+        {
+            k_poll_signal_reset(&rx_signal);
 
-            /* Then process MQTT */
-            err = poll(&fds, 1, mqtt_keepalive_time_left(&client));
-            if (err < 0)
+            if (atomic_get(&cloud_state_s) == cloud_state_connected &&
+                RX_RESULT_GEN(result) == RX_GEN(atomic_get(&rx_gen_s)) &&
+                rx_process(RX_RESULT_REVENTS(result)))
             {
-                LOG_ERR("ERROR: poll %d\n", errno);
-                break;
+                /* Watch for the next one */
+                k_sem_give(&rx_poll_sem);
             }
+        }
 
-            err = mqtt_live(&client);
+        if (atomic_get(&cloud_state_s) == cloud_state_connected)
+        {
+            err = pyrinas_cloud_transport_live();
             if (err == 0)
             {
                 LOG_INF("[%s:%d] ping sent", __func__, __LINE__);
             }
             else if ((err != 0) && (err != -EAGAIN))
             {
-                LOG_ERR("ERROR: mqtt_live %d", err);
-                break;
+                LOG_ERR("ERROR: live %d", err);
+                pyrinas_cloud_transport_abort();
             }
+        }
 
-            if ((fds.revents & POLLIN) == POLLIN)
-            {
-                err = mqtt_input(&client);
-                if (err != 0)
-                {
-                    LOG_ERR("ERROR: mqtt_input %d", err);
-                    mqtt_abort(&client);
-                    break;
-                }
-            }
+        /* Subscribe before anything queued after asking for it */
+        k_poll_signal_reset(&cloud_cmd_signal);
+        cloud_cmd_process();
 
-            if ((fds.revents & POLLERR) == POLLERR)
-            {
-                LOG_ERR("POLLERR\n");
-                mqtt_abort(&client);
-                break;
-            }
+        /* Publishes made while offline go to the outbox or get dropped */
+        publish_queue_process();
 
-            if ((fds.revents & POLLNVAL) == POLLNVAL)
-            {
-                LOG_ERR("POLLNVAL\n");
-                mqtt_abort(&client);
-                break;
-            }
-        }
+        /* Anything left is waiting on a PUBACK. That wakes us instead. */
+        events[1].type = k_fifo_is_empty(&publish_fifo) ? K_POLL_TYPE_FIFO_DATA_AVAILABLE : K_POLL_TYPE_IGNORE;
+
+        for (int i = 0; i < ARRAY_SIZE(events); i++)
+            events[i].state = K_POLL_STATE_NOT_READY;
+    }
+}
+
+/* Only waits on the socket. The offloaded socket can't be part of a
+ * k_poll so the cloud thread gets a signal instead. */
+static void pyrinas_cloud_rx_process(void)
+{
+    while (true)
+    {
+        /* Until the cloud thread is done with the last event */
+        k_sem_take(&rx_poll_sem, K_FOREVER);
+
+        atomic_val_t gen = atomic_get(&rx_gen_s);
+        struct pollfd pfd = {
+            .fd = fds.fd,
+            .events = POLLIN,
+        };
+        int ret;
+
+        /* Times out only to notice a socket that's been replaced */
+        do
+        {
+            ret = poll(&pfd, 1, CLOUD_THREAD_WAIT_MAX_MS);
+        } while (ret == 0 && atomic_get(&rx_gen_s) == gen);
+
+        if (atomic_get(&rx_gen_s) != gen)
+            continue;
+
+        k_poll_signal_raise(&rx_signal, RX_RESULT(gen, ret < 0 ? POLLERR : pfd.revents));
     }
 }
 
-#define PYRINAS_CLOUD_THREAD_STACK_SIZE KB(2)
-static K_THREAD_STACK_DEFINE(pyrinas_cloud_thread_stack, PYRINAS_CLOUD_THREAD_STACK_SIZE);
-K_THREAD_DEFINE(pyrinas_cloud_thread, K_THREAD_STACK_SIZEOF(pyrinas_cloud_thread_stack),
+K_THREAD_DEFINE(pyrinas_cloud_thread, CONFIG_PYRINAS_CLOUD_THREAD_STACK_SIZE,
                 pyrinas_cloud_process, NULL, NULL, NULL, K_LOWEST_APPLICATION_THREAD_PRIO, 0, 0);
+
+#define PYRINAS_CLOUD_RX_THREAD_STACK_SIZE KB(1)
+K_THREAD_DEFINE(pyrinas_cloud_rx_thread, PYRINAS_CLOUD_RX_THREAD_STACK_SIZE,
+                pyrinas_cloud_rx_process, NULL, NULL, NULL, K_LOWEST_APPLICATION_THREAD_PRIO, 0, 0);
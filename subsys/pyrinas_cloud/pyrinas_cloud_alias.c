@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pyrinas_cloud_alias.h"
+#include "pyrinas_cloud_codec.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(pyrinas_cloud_alias);
+
+/* IMEI plus a short alias id */
+#define ALIAS_TOPIC_MAX_SIZE (sizeof(CONFIG_PYRINAS_CLOUD_MQTT_ALIAS_PUB_TOPIC) + IMEI_LEN + 3)
+
+/* Registration is a map with one id and topic */
+#define ALIAS_REGISTER_MAX_SIZE (1 + 2 + 3 + CONFIG_PYRINAS_CLOUD_PUBLISH_TOPIC_MAX_SIZE)
+
+enum alias_state
+{
+    alias_state_free,
+    alias_state_pending,
+    alias_state_active,
+};
+
+struct alias_entry
+{
+    enum alias_state state;
+    uint32_t last_used;
+    uint16_t topic_len;
+    uint8_t alias_len;
+    uint8_t topic[CONFIG_PYRINAS_CLOUD_PUBLISH_TOPIC_MAX_SIZE];
+    char alias[ALIAS_TOPIC_MAX_SIZE];
+};
+
+/* Only touched from the cloud thread. Publish callbacks run there too. */
+static struct alias_entry entries[CONFIG_PYRINAS_CLOUD_TOPIC_ALIAS_COUNT];
+static uint32_t use_count;
+static uint16_t generation;
+
+static const char *alias_imei;
+static size_t alias_imei_len;
+static pyrinas_cloud_alias_register_t register_cb;
+
+BUILD_ASSERT(CONFIG_PYRINAS_CLOUD_TOPIC_ALIAS_COUNT <= 256, "Alias ids are 8 bit");
+
+/* user_data carries the connection and the entry */
+static void *confirm_data(size_t index)
+{
+    return (void *)(uintptr_t)((generation << 8) | index);
+}
+
+static void alias_confirmed(int result, uint32_t latency_ms, void *user_data)
+{
+    uint32_t value = (uint32_t)(uintptr_t)user_data;
+    size_t index = value & 0xFF;
+
+    /* From a previous connection */
+    if ((value >> 8) != generation || index >= ARRAY_SIZE(entries))
+        return;
+
+    struct alias_entry *entry = &entries[index];
+
+    if (entry->state != alias_state_pending)
+        return;
+
+    if (result)
+    {
+        LOG_WRN("Alias %d not registered. Err: %d", index, result);
+        entry->state = alias_state_free;
+        return;
+    }
+
+    LOG_DBG("Alias %s active", log_strdup(entry->alias));
+    entry->state = alias_state_active;
+}
+
+/* Free slot, or the least recently used one */
+static size_t alias_slot_get(void)
+{
+    size_t oldest = 0;
+
+    for (size_t i = 0; i < ARRAY_SIZE(entries); i++)
+    {
+        if (entries[i].state == alias_state_free)
+            return i;
+
+        if (entries[i].last_used < entries[oldest].last_used)
+            oldest = i;
+    }
+
+    return oldest;
+}
+
+static void alias_register(const uint8_t *topic, size_t topic_len)
+{
+    uint8_t buf[ALIAS_REGISTER_MAX_SIZE];
+    size_t payload_len = 0;
+    size_t index = alias_slot_get();
+    struct alias_entry *entry = &entries[index];
+
+    struct pyrinas_cloud_publish_opts opts = {
+        .qos = cloud_qos_at_least_once,
+        .cb = alias_confirmed,
+        .user_data = confirm_data(index),
+    };
+
+    int len = snprintf(entry->alias, sizeof(entry->alias), CONFIG_PYRINAS_CLOUD_MQTT_ALIAS_PUB_TOPIC,
+                       alias_imei_len, alias_imei, index);
+
+    /* Not worth it */
+    if (len < 0 || len >= sizeof(entry->alias) || len >= topic_len)
+        return;
+
+    if (encode_alias_register(index, topic, topic_len, buf, sizeof(buf), &payload_len) != 0)
+        return;
+
+    /* Overwrites whatever was here. The backend does the same. */
+    entry->state = alias_state_pending;
+    entry->last_used = ++use_count;
+    entry->alias_len = len;
+    entry->topic_len = topic_len;
+    memcpy(entry->topic, topic, topic_len);
+
+    int err = register_cb(buf, payload_len, &opts);
+    if (err)
+    {
+        LOG_WRN("Unable to register alias. Err: %d", err);
+        entry->state = alias_state_free;
+    }
+}
+
+void pyrinas_cloud_alias_apply(const uint8_t **topic, size_t *topic_len)
+{
+    if (register_cb == NULL || *topic_len > CONFIG_PYRINAS_CLOUD_PUBLISH_TOPIC_MAX_SIZE)
+        return;
+
+    for (size_t i = 0; i < ARRAY_SIZE(entries); i++)
+    {
+        struct alias_entry *entry = &entries[i];
+
+        if (entry->state == alias_state_free || entry->topic_len != *topic_len ||
+            memcmp(entry->topic, *topic, *topic_len) != 0)
+            continue;
+
+        entry->last_used = ++use_count;
+
+        /* Full topic until the backend knows the alias */
+        if (entry->state == alias_state_active)
+        {
+            *topic = (const uint8_t *)entry->alias;
+            *topic_len = entry->alias_len;
+        }
+
+        return;
+    }
+
+    alias_register(*topic, *topic_len);
+}
+
+void pyrinas_cloud_alias_reset(void)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(entries); i++)
+        entries[i].state = alias_state_free;
+
+    /* Late confirmations are ignored */
+    generation++;
+}
+
+void pyrinas_cloud_alias_init(const char *imei, size_t imei_len, pyrinas_cloud_alias_register_t cb)
+{
+    __ASSERT(cb != NULL, "Callback must not be NULL.");
+
+    alias_imei = imei;
+    alias_imei_len = imei_len;
+    register_cb = cb;
+
+    pyrinas_cloud_alias_reset();
+}
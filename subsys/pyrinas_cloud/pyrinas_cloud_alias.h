@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _PYRINAS_CLOUD_ALIAS_H
+#define _PYRINAS_CLOUD_ALIAS_H
+
+#include <zephyr.h>
+#include <pyrinas_cloud/pyrinas_cloud.h>
+
+/* Publishes an alias registration. Completion must be reported through opts. */
+typedef int (*pyrinas_cloud_alias_register_t)(const uint8_t *data, size_t len, const struct pyrinas_cloud_publish_opts *opts);
+
+/* Set up the alias table. Alias topics are built from the IMEI. */
+void pyrinas_cloud_alias_init(const char *imei, size_t imei_len, pyrinas_cloud_alias_register_t cb);
+
+/* Aliases only last for a connection. Call on connect and disconnect. */
+void pyrinas_cloud_alias_reset(void);
+
+/* Swap topic for its alias once the backend has confirmed it. Registers
+ * topics it hasn't seen, so the full topic is used until then. */
+void pyrinas_cloud_alias_apply(const uint8_t **topic, size_t *topic_len);
+
+#endif /* _PYRINAS_CLOUD_ALIAS_H */
@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <stdio.h>
+#include <string.h>
+#include <qcbor/qcbor.h>
+
+#include "pyrinas_cloud_batch.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(pyrinas_cloud_batch);
+
+#define member_size(type, member) sizeof(((type *)0)->member)
+
+/* Each stored item is prefixed by its length */
+#define BATCH_ITEM_HEADER_SIZE sizeof(uint16_t)
+
+/* Worst case CBOR overhead: array header + one extra byte per item header */
+#define BATCH_ENCODED_SIZE (CONFIG_PYRINAS_CLOUD_BATCH_BUF_SIZE + (CONFIG_PYRINAS_CLOUD_BATCH_BUF_SIZE / BATCH_ITEM_HEADER_SIZE) + 3)
+
+BUILD_ASSERT(BATCH_ENCODED_SIZE <= CONFIG_PYRINAS_CLOUD_PUBLISH_PAYLOAD_MAX_SIZE,
+             "Encoded batch must fit in a publish descriptor");
+
+struct batch_slot
+{
+    bool in_use;
+    uint8_t addr[member_size(pyrinas_event_t, peripheral_addr)];
+    uint8_t name[member_size(pyrinas_event_name_data_t, bytes)];
+    size_t name_len;
+
+    /* Computed once when the slot is claimed */
+    char topic[sizeof(CONFIG_PYRINAS_CLOUD_MQTT_APPLICATION_BATCH_PUB_TOPIC) + PERIPHERAL_UID_LEN + member_size(pyrinas_event_name_data_t, bytes)];
+    size_t topic_len;
+    char telemetry_topic[sizeof(CONFIG_PYRINAS_CLOUD_MQTT_TELEMETRY_PUB_TOPIC) + PERIPHERAL_UID_LEN];
+    size_t telemetry_topic_len;
+
+    /* Pending items */
+    uint8_t buf[CONFIG_PYRINAS_CLOUD_BATCH_BUF_SIZE];
+    size_t len;
+    size_t count;
+
+    /* Most recent link quality */
+    bool has_central_rssi;
+    int8_t central_rssi;
+    bool has_peripheral_rssi;
+    int8_t peripheral_rssi;
+};
+
+static struct batch_slot slots[CONFIG_PYRINAS_CLOUD_BATCH_SLOT_COUNT];
+static uint8_t encoded_buf[BATCH_ENCODED_SIZE];
+
+/* Adds come from the BLE context, timed flushes from the work queue */
+static K_MUTEX_DEFINE(batch_mutex);
+
+static struct k_work_q *batch_q;
+static struct k_delayed_work batch_flush_work;
+static pyrinas_cloud_batch_flush_t flush_callback;
+
+static void slot_flush(struct batch_slot *slot)
+{
+    size_t encoded_len = 0;
+    QCBOREncodeContext ec;
+    UsefulBuf buf = {
+        .ptr = encoded_buf,
+        .len = sizeof(encoded_buf)};
+
+    if (!slot->in_use || slot->count == 0)
+    {
+        slot->in_use = false;
+        return;
+    }
+
+    /* One array of byte strings per flush */
+    QCBOREncode_Init(&ec, buf);
+    QCBOREncode_OpenArray(&ec);
+
+    for (size_t pos = 0; pos < slot->len;)
+    {
+        uint16_t item_len;
+        memcpy(&item_len, &slot->buf[pos], sizeof(item_len));
+        pos += sizeof(item_len);
+
+        UsefulBufC item = {
+            .ptr = &slot->buf[pos],
+            .len = item_len};
+        QCBOREncode_AddBytes(&ec, item);
+
+        pos += item_len;
+    }
+
+    QCBOREncode_CloseArray(&ec);
+
+    QCBORError err = QCBOREncode_FinishGetSize(&ec, &encoded_len);
+    if (err)
+    {
+        LOG_ERR("Unable to encode batch. Err: %i", err);
+    }
+    else if (flush_callback)
+    {
+        const struct pyrinas_cloud_batch_flush flush = {
+            .peripheral_addr = slot->addr,
+            .topic = slot->topic,
+            .topic_len = slot->topic_len,
+            .telemetry_topic = slot->telemetry_topic,
+            .telemetry_topic_len = slot->telemetry_topic_len,
+            .data = encoded_buf,
+            .data_len = encoded_len,
+            .count = slot->count,
+            .has_central_rssi = slot->has_central_rssi,
+            .central_rssi = slot->central_rssi,
+            .has_peripheral_rssi = slot->has_peripheral_rssi,
+            .peripheral_rssi = slot->peripheral_rssi,
+        };
+
+        LOG_DBG("Flushing %d items (%d bytes) to %s", slot->count, encoded_len, slot->topic);
+
+        flush_callback(&flush);
+    }
+
+    /* Release */
+    slot->in_use = false;
+}
+
+static struct batch_slot *slot_claim(pyrinas_event_t *evt, const struct pyrinas_cloud_peripheral_topics *topics)
+{
+    struct batch_slot *fullest = &slots[0];
+    struct batch_slot *free_slot = NULL;
+
+    for (int i = 0; i < ARRAY_SIZE(slots); i++)
+    {
+        struct batch_slot *slot = &slots[i];
+
+        if (!slot->in_use)
+        {
+            if (free_slot == NULL)
+                free_slot = slot;
+
+            continue;
+        }
+
+        /* Existing batch for this peripheral + event */
+        if (slot->name_len == evt->name.size &&
+            memcmp(slot->addr, evt->peripheral_addr, sizeof(slot->addr)) == 0 &&
+            memcmp(slot->name, evt->name.bytes, slot->name_len) == 0)
+        {
+            return slot;
+        }
+
+        if (slot->len > fullest->len)
+            fullest = slot;
+    }
+
+    /* Make room by sending the largest batch early */
+    if (free_slot == NULL)
+    {
+        slot_flush(fullest);
+        free_slot = fullest;
+    }
+
+    free_slot->len = 0;
+    free_slot->count = 0;
+    free_slot->has_central_rssi = false;
+    free_slot->has_peripheral_rssi = false;
+
+    memcpy(free_slot->addr, evt->peripheral_addr, sizeof(free_slot->addr));
+    free_slot->name_len = MIN(evt->name.size, sizeof(free_slot->name));
+    memcpy(free_slot->name, evt->name.bytes, free_slot->name_len);
+
+    /* Peripheral part is already formatted */
+    free_slot->topic_len = pyrinas_cloud_peripheral_topic(topics->batch_prefix, topics->batch_prefix_len,
+                                                          free_slot->name, free_slot->name_len,
+                                                          free_slot->topic, sizeof(free_slot->topic));
+
+    memcpy(free_slot->telemetry_topic, topics->telemetry, topics->telemetry_len + 1);
+    free_slot->telemetry_topic_len = topics->telemetry_len;
+
+    free_slot->in_use = true;
+
+    return free_slot;
+}
+
+static bool batch_is_empty(void)
+{
+    for (int i = 0; i < ARRAY_SIZE(slots); i++)
+    {
+        if (slots[i].in_use)
+            return false;
+    }
+
+    return true;
+}
+
+static void batch_flush_work_fn(struct k_work *unused)
+{
+    pyrinas_cloud_batch_flush_all();
+}
+
+int pyrinas_cloud_batch_add(pyrinas_event_t *evt, const struct pyrinas_cloud_peripheral_topics *topics)
+{
+    size_t item_len = BATCH_ITEM_HEADER_SIZE + evt->data.size;
+
+    /* Would never fit */
+    if (item_len > CONFIG_PYRINAS_CLOUD_BATCH_BUF_SIZE)
+        return -EMSGSIZE;
+
+    k_mutex_lock(&batch_mutex, K_FOREVER);
+
+    /* Start the window on the first item */
+    bool start_window = batch_is_empty();
+
+    struct batch_slot *slot = slot_claim(evt, topics);
+
+    /* Size threshold reached. Send what we have and start over. */
+    if (slot->len + item_len > sizeof(slot->buf))
+    {
+        slot_flush(slot);
+        slot = slot_claim(evt, topics);
+    }
+
+    uint16_t data_len = evt->data.size;
+    memcpy(&slot->buf[slot->len], &data_len, sizeof(data_len));
+    memcpy(&slot->buf[slot->len + sizeof(data_len)], evt->data.bytes, data_len);
+    slot->len += item_len;
+    slot->count++;
+
+    /* Keep the latest valid RSSI for telemetry */
+    if (evt->central_rssi < 0)
+    {
+        slot->has_central_rssi = true;
+        slot->central_rssi = evt->central_rssi;
+    }
+
+    if (evt->peripheral_rssi < 0)
+    {
+        slot->has_peripheral_rssi = true;
+        slot->peripheral_rssi = evt->peripheral_rssi;
+    }
+
+    k_mutex_unlock(&batch_mutex);
+
+    if (start_window)
+        k_delayed_work_submit_to_queue(batch_q, &batch_flush_work, K_MSEC(CONFIG_PYRINAS_CLOUD_BATCH_WINDOW_MS));
+
+    return 0;
+}
+
+void pyrinas_cloud_batch_flush_all(void)
+{
+    k_mutex_lock(&batch_mutex, K_FOREVER);
+
+    for (int i = 0; i < ARRAY_SIZE(slots); i++)
+    {
+        slot_flush(&slots[i]);
+    }
+
+    k_mutex_unlock(&batch_mutex);
+}
+
+void pyrinas_cloud_batch_init(struct k_work_q *task_q, pyrinas_cloud_batch_flush_t cb)
+{
+    __ASSERT(task_q != NULL, "Task queue must not be NULL.");
+
+    batch_q = task_q;
+    flush_callback = cb;
+
+    k_delayed_work_init(&batch_flush_work, batch_flush_work_fn);
+}
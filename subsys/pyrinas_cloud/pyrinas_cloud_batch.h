@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _PYRINAS_CLOUD_BATCH_H
+#define _PYRINAS_CLOUD_BATCH_H
+
+#include <zephyr.h>
+#include <pyrinas_codec.h>
+
+#include "pyrinas_cloud_peripheral.h"
+
+/* One flushed batch for a single peripheral and event name */
+struct pyrinas_cloud_batch_flush
+{
+    const uint8_t *peripheral_addr;
+    const char *topic;
+    size_t topic_len;
+    const char *telemetry_topic;
+    size_t telemetry_topic_len;
+    const uint8_t *data;
+    size_t data_len;
+    size_t count;
+    bool has_central_rssi;
+    int8_t central_rssi;
+    bool has_peripheral_rssi;
+    int8_t peripheral_rssi;
+};
+
+typedef void (*pyrinas_cloud_batch_flush_t)(const struct pyrinas_cloud_batch_flush *flush);
+
+/* Set up the batching stage. Timed flushes run on task_q. */
+void pyrinas_cloud_batch_init(struct k_work_q *task_q, pyrinas_cloud_batch_flush_t cb);
+
+/* Add an event to its peripheral/name batch. May flush if the batch is full.
+ * topics come from the peripheral table. */
+int pyrinas_cloud_batch_add(pyrinas_event_t *evt, const struct pyrinas_cloud_peripheral_topics *topics);
+
+/* Flush everything that's pending */
+void pyrinas_cloud_batch_flush_all(void);
+
+#endif /* _PYRINAS_CLOUD_BATCH_H */
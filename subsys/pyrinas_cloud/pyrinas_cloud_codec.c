@@ -6,6 +6,8 @@
 
 #include <zephyr.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
 #include <pyrinas_cloud/pyrinas_cloud.h>
 #include <cellular/cellular.h>
 #include <qcbor/qcbor_spiffy_decode.h>
@@ -34,6 +36,24 @@ QCBORError encode_ota_request(enum pyrinas_cloud_ota_cmd_type cmd_type, uint8_t
     return QCBOREncode_FinishGetSize(&ec, payload_len);
 }
 
+QCBORError encode_alias_register(uint8_t alias, const uint8_t *topic, size_t topic_len, uint8_t *p_buf, size_t data_len, size_t *payload_len)
+{
+    UsefulBuf buf = {
+        .ptr = p_buf,
+        .len = data_len};
+    UsefulBufC text = {
+        .ptr = topic,
+        .len = topic_len};
+    QCBOREncodeContext ec;
+    QCBOREncode_Init(&ec, buf);
+
+    QCBOREncode_OpenMap(&ec);
+    QCBOREncode_AddTextToMapN(&ec, alias, text);
+    QCBOREncode_CloseMap(&ec);
+
+    return QCBOREncode_FinishGetSize(&ec, payload_len);
+}
+
 void decode_ota_version(union pyrinas_cloud_ota_version *p_version, QCBORDecodeContext *dc, int64_t label)
 {
 
@@ -134,8 +154,58 @@ QCBORError decode_ota_data(struct pyrinas_cloud_ota_data *ota_data, const char *
         goto Done;
     }
 
+    /* Delta is optional. Without one the full image is used. */
+    UsefulBufC delta_data;
+    decode_ota_version(&ota_data->base, &dc, base_pos);
+    QCBORDecode_GetTextStringInMapN(&dc, delta_file_pos, &delta_data);
+
+    uErr = QCBORDecode_GetAndResetError(&dc);
+    ota_data->has_delta = uErr == QCBOR_SUCCESS && delta_data.len < sizeof(ota_data->delta_file);
+
+    if (ota_data->has_delta)
+    {
+        memcpy(ota_data->delta_file, delta_data.ptr, delta_data.len);
+        ota_data->delta_file[delta_data.len] = '\0';
+    }
+
+    /* Size and digest are optional too. Without them the image is taken as is. */
+    uint64_t size;
+    QCBORDecode_GetUInt64ConvertAllInMapN(&dc, size_pos, QCBOR_CONVERT_TYPE_XINT64, &size);
+    ota_data->size = QCBORDecode_GetAndResetError(&dc) == QCBOR_SUCCESS ? size : 0;
+
+    /* Byte string. Anything but a whole SHA-256 is ignored. */
+    UsefulBufC digest_data;
+    QCBORDecode_GetByteStringInMapN(&dc, digest_pos, &digest_data);
+
+    uErr = QCBORDecode_GetAndResetError(&dc);
+    ota_data->has_digest = uErr == QCBOR_SUCCESS && digest_data.len == sizeof(ota_data->digest);
+
+    if (ota_data->has_digest)
+    {
+        memcpy(ota_data->digest, digest_data.ptr, digest_data.len);
+    }
+    else if (uErr == QCBOR_ERR_UNEXPECTED_TYPE)
+    {
+        /* Array of bytes like the version hash. What manifest-generator.ts
+         * writes and backends pass on as is. */
+        QCBORDecode_EnterArrayFromMapN(&dc, digest_pos);
+        for (int64_t i = 0; i < sizeof(ota_data->digest); i++)
+        {
+            uint64_t temp;
+            QCBORDecode_GetUInt64(&dc, &temp);
+            ota_data->digest[i] = temp;
+        }
+        QCBORDecode_ExitArray(&dc);
+
+        ota_data->has_digest = QCBORDecode_GetAndResetError(&dc) == QCBOR_SUCCESS;
+    }
+
     LOG_INF("URL: %s%s", ota_data->host, ota_data->file);
     LOG_INF("Force: %d", ota_data->force);
+    LOG_INF("Size: %d Digest: %d", ota_data->size, ota_data->has_digest);
+
+    if (ota_data->has_delta)
+        LOG_INF("Delta: %s%s", ota_data->host, ota_data->delta_file);
 
     /* Exit main map and return*/
     QCBORDecode_ExitMap(&dc);
@@ -145,7 +215,145 @@ Done:
     return QCBORDecode_Finish(&dc);
 }
 
-QCBORError encode_telemetry_data(struct pyrinas_cloud_telemetry_data *p_data, uint8_t *p_buf, size_t data_len, size_t *payload_len)
+/* Encoders for each field kind */
+#define TELEMETRY_ENCODE_uint(ec, key, value) QCBOREncode_AddUInt64ToMapN(ec, key, value)
+#define TELEMETRY_ENCODE_int(ec, key, value) QCBOREncode_AddInt64ToMapN(ec, key, value)
+#define TELEMETRY_ENCODE_text(ec, key, value) QCBOREncode_AddSZStringToMapN(ec, key, value)
+
+#define TELEMETRY_ENCODE(name, key, kind, type, count, deadband) \
+    if (p_data->has_##name)                            \
+        TELEMETRY_ENCODE_##kind(&ec, key, p_data->name);
+
+/* Decoders for each field kind */
+#define TELEMETRY_DECODE_uint(p, name, item, count) TELEMETRY_DECODE_int(p, name, item, count)
+#define TELEMETRY_DECODE_int(p, name, item, count) \
+    if ((item)->uDataType == QCBOR_TYPE_INT64)     \
+    {                                              \
+        (p)->name = (item)->val.int64;             \
+        (p)->has_##name = true;                    \
+    }
+#define TELEMETRY_DECODE_text(p, name, item, count)                         \
+    if ((item)->uDataType == QCBOR_TYPE_TEXT_STRING)                        \
+    {                                                                       \
+        size_t len = MIN((item)->val.string.len, (count)-1);                \
+        memcpy((p)->name, (item)->val.string.ptr, len);                     \
+        (p)->name[len] = '\0';                                              \
+        (p)->has_##name = true;                                             \
+    }
+
+#define TELEMETRY_DECODE(name, key, kind, type, count, deadband) \
+    case key:                                          \
+        TELEMETRY_DECODE_##kind(p_data, name, &item, count) break;
+
+/* Deadband checks for each field kind */
+#define TELEMETRY_UNCHANGED_uint(last, data, name, deadband) TELEMETRY_UNCHANGED_int(last, data, name, deadband)
+#define TELEMETRY_UNCHANGED_int(last, data, name, deadband) \
+    (abs((int32_t)(data)->name - (int32_t)(last)->name) <= (deadband))
+#define TELEMETRY_UNCHANGED_text(last, data, name, deadband) \
+    (strncmp((data)->name, (last)->name, sizeof((data)->name)) == 0)
+
+#define TELEMETRY_DELTA(name, key, kind, type, count, deadband)                                          \
+    if (p_data->has_##name && p_last->has_##name && TELEMETRY_UNCHANGED_##kind(p_last, p_data, name, deadband)) \
+        p_data->has_##name = false;                                                                     \
+    left += p_data->has_##name;
+
+#define TELEMETRY_MERGE(name, key, kind, type, count, deadband)      \
+    if (p_data->has_##name)                                          \
+    {                                                                \
+        p_last->has_##name = true;                                   \
+        memcpy(&p_last->name, &p_data->name, sizeof(p_last->name)); \
+    }
+
+int telemetry_delta(const struct pyrinas_cloud_telemetry_data *p_last, struct pyrinas_cloud_telemetry_data *p_data)
+{
+    int left = 0;
+
+    PYRINAS_CLOUD_TELEMETRY_FIELDS(TELEMETRY_DELTA)
+
+    return left;
+}
+
+void telemetry_merge(struct pyrinas_cloud_telemetry_data *p_last, const struct pyrinas_cloud_telemetry_data *p_data)
+{
+    PYRINAS_CLOUD_TELEMETRY_FIELDS(TELEMETRY_MERGE)
+}
+
+static size_t telemetry_app_field_max_size(const struct pyrinas_cloud_telemetry_field *field)
+{
+    size_t key_size = CBOR_HEAD_SIZE(field->key);
+
+    if (field->type == tel_field_text)
+        return key_size + CBOR_HEAD_SIZE(field->max_size) + field->max_size;
+
+    return key_size + 1 + field->max_size;
+}
+
+/* Only encoded once they've been checked */
+static bool app_fields_valid;
+
+int telemetry_app_fields_check(void)
+{
+    size_t total = 0;
+
+    app_fields_valid = false;
+
+    Z_STRUCT_SECTION_FOREACH(pyrinas_cloud_telemetry_field, field)
+    {
+        if (field->key < tel_type_app_start)
+        {
+            LOG_ERR("Telemetry key %d is reserved", (int)field->key);
+            return -EINVAL;
+        }
+
+        total += telemetry_app_field_max_size(field);
+    }
+
+    if (total > CONFIG_PYRINAS_CLOUD_TELEMETRY_APP_MAX_SIZE)
+    {
+        LOG_ERR("Application telemetry needs %d bytes. Increase CONFIG_PYRINAS_CLOUD_TELEMETRY_APP_MAX_SIZE.", total);
+        return -ENOMEM;
+    }
+
+    app_fields_valid = true;
+
+    return 0;
+}
+
+static void encode_telemetry_app_fields(QCBOREncodeContext *ec)
+{
+    union pyrinas_cloud_telemetry_value value;
+
+    /* Could overrun the record */
+    if (!app_fields_valid)
+        return;
+
+    Z_STRUCT_SECTION_FOREACH(pyrinas_cloud_telemetry_field, field)
+    {
+        /* Nothing to report */
+        if (!field->get(&value))
+            continue;
+
+        switch (field->type)
+        {
+        case tel_field_uint:
+            QCBOREncode_AddUInt64ToMapN(ec, field->key, value.u);
+            break;
+        case tel_field_int:
+            QCBOREncode_AddInt64ToMapN(ec, field->key, value.i);
+            break;
+        case tel_field_text:
+        {
+            UsefulBufC text = {
+                .ptr = value.text,
+                .len = strnlen(value.text, field->max_size)};
+            QCBOREncode_AddTextToMapN(ec, field->key, text);
+            break;
+        }
+        }
+    }
+}
+
+QCBORError encode_telemetry_data(struct pyrinas_cloud_telemetry_data *p_data, bool central, uint8_t *p_buf, size_t data_len, size_t *payload_len)
 {
     /* Setup of the goods */
     UsefulBuf buf = {
@@ -157,32 +365,107 @@ QCBORError encode_telemetry_data(struct pyrinas_cloud_telemetry_data *p_data, ui
     /* Create over-arching map */
     QCBOREncode_OpenMap(&ec);
 
-    /*Add versio if it's there*/
-    if (p_data->has_version)
-    {
-        QCBOREncode_AddSZStringToMapN(&ec, tel_type_version, p_data->version);
-    }
+    /* Add every field that's set */
+    PYRINAS_CLOUD_TELEMETRY_FIELDS(TELEMETRY_ENCODE)
 
-    /* Add RSRP if valid*/
-    if (p_data->has_rsrp)
+    if (central)
     {
-        QCBOREncode_AddUInt64ToMapN(&ec, tel_type_rsrp, p_data->rsrp);
+        encode_telemetry_app_fields(&ec);
+
+#if defined(CONFIG_PYRINAS_CLOUD_STATS)
+        /* Everything collected since the last send */
+        pyrinas_cloud_stats_encode(&ec, tel_type_stats);
+#endif
+
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA)
+        /* Once after each download */
+        pyrinas_cloud_fota_metrics_encode(&ec, tel_type_ota);
+#endif
     }
 
-    /* Add Hub RSSI if valid*/
-    if (p_data->has_central_rssi)
+    QCBOREncode_CloseMap(&ec);
+
+    /* Finish and get size */
+    return QCBOREncode_FinishGetSize(&ec, payload_len);
+}
+
+QCBORError decode_telemetry_data(struct pyrinas_cloud_telemetry_data *p_data, const uint8_t *data, size_t data_len)
+{
+    /* Setup of the goods */
+    QCBORItem item;
+    QCBORError uErr;
+    UsefulBufC buf = {
+        .ptr = data,
+        .len = data_len};
+    QCBORDecodeContext dc;
+    QCBORDecode_Init(&dc, buf, QCBOR_DECODE_MODE_NORMAL);
+    QCBORDecode_EnterMap(&dc, NULL);
+
+    memset(p_data, 0, sizeof(*p_data));
+
+    /* Walk the map. Unknown keys are skipped. */
+    while ((uErr = QCBORDecode_GetNext(&dc, &item)) == QCBOR_SUCCESS)
     {
-        QCBOREncode_AddInt64ToMapN(&ec, tel_type_rssi_central, p_data->central_rssi);
+        if (item.uLabelType != QCBOR_TYPE_INT64)
+            continue;
+
+        switch (item.label.int64)
+        {
+            PYRINAS_CLOUD_TELEMETRY_FIELDS(TELEMETRY_DECODE)
+        default:
+            break;
+        }
     }
 
-    /* Add Cabinet RSSI if valid*/
-    if (p_data->has_peripheral_rssi)
+    if (uErr != QCBOR_ERR_NO_MORE_ITEMS)
+        return uErr;
+
+    /* Exit main map and return*/
+    QCBORDecode_ExitMap(&dc);
+
+    return QCBORDecode_Finish(&dc);
+}
+
+QCBORError decode_config_data(struct pyrinas_cloud_telemetry_interval *p_interval, const char *data, size_t data_len)
+{
+    /* Setup of the goods */
+    QCBORItem item;
+    QCBORError uErr;
+    UsefulBufC buf = {
+        .ptr = data,
+        .len = data_len};
+    QCBORDecodeContext dc;
+    QCBORDecode_Init(&dc, buf, QCBOR_DECODE_MODE_NORMAL);
+    QCBORDecode_EnterMap(&dc, NULL);
+
+    /* Walk the map. Unknown keys are skipped. */
+    while ((uErr = QCBORDecode_GetNext(&dc, &item)) == QCBOR_SUCCESS)
     {
-        QCBOREncode_AddInt64ToMapN(&ec, tel_type_rssi_peripheral, p_data->peripheral_rssi);
+        if (item.uLabelType != QCBOR_TYPE_INT64 || item.uDataType != QCBOR_TYPE_INT64 ||
+            item.val.int64 < 0 || item.val.int64 > UINT32_MAX)
+            continue;
+
+        switch (item.label.int64)
+        {
+        case config_telemetry_min_pos:
+            p_interval->min_sec = item.val.int64;
+            break;
+        case config_telemetry_base_pos:
+            p_interval->base_sec = item.val.int64;
+            break;
+        case config_telemetry_max_pos:
+            p_interval->max_sec = item.val.int64;
+            break;
+        default:
+            break;
+        }
     }
 
-    QCBOREncode_CloseMap(&ec);
+    if (uErr != QCBOR_ERR_NO_MORE_ITEMS)
+        return uErr;
 
-    /* Finish and get size */
-    return QCBOREncode_FinishGetSize(&ec, payload_len);
-}
\ No newline at end of file
+    /* Exit main map and return*/
+    QCBORDecode_ExitMap(&dc);
+
+    return QCBORDecode_Finish(&dc);
+}
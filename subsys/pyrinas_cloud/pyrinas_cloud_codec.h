@@ -26,10 +26,92 @@ typedef enum
     host_pos,
     file_pos,
     force_pos,
+    base_pos,       /* Optional. Version the delta applies to. */
+    delta_file_pos, /* Optional */
+    size_pos,       /* Optional. Bytes in the full image. */
+    digest_pos,     /* Optional. SHA-256 of the full image. Byte string or array. */
 } pyrinas_cloud_ota_data_pos_t;
 
+typedef enum
+{
+    config_telemetry_min_pos,
+    config_telemetry_base_pos,
+    config_telemetry_max_pos,
+} pyrinas_cloud_config_pos_t;
+
+/* Bytes needed for a CBOR head carrying n */
+#define CBOR_HEAD_SIZE(n) ((n) < 24 ? 1 : (n) <= UINT8_MAX ? 2 : (n) <= UINT16_MAX ? 3 : (n) <= UINT32_MAX ? 5 : 9)
+
+/* Worst case for a single field. Integers need one byte per byte of the type plus the head. */
+#define TELEMETRY_VALUE_MAX_SIZE_uint(type, count) (1 + sizeof(type))
+#define TELEMETRY_VALUE_MAX_SIZE_int(type, count) (1 + sizeof(type))
+#define TELEMETRY_VALUE_MAX_SIZE_text(type, count) (CBOR_HEAD_SIZE((count)-1) + (count)-1)
+
+#define TELEMETRY_FIELD_MAX_SIZE(name, key, kind, type, count, deadband) \
+    +(CBOR_HEAD_SIZE(key) + TELEMETRY_VALUE_MAX_SIZE_##kind(type, count))
+
+#define TELEMETRY_FIELD_COUNT(name, key, kind, type, count, deadband) +1
+
+/* Map header is sized for the built ins plus any application fields */
+#define TELEMETRY_MAP_HEADER_MAX_SIZE 3
+
+/* Exact worst case for the built in fields */
+#define TELEMETRY_BUILTIN_MAX_SIZE (0 PYRINAS_CLOUD_TELEMETRY_FIELDS(TELEMETRY_FIELD_MAX_SIZE))
+
+#if defined(CONFIG_PYRINAS_CLOUD_STATS)
+#include "pyrinas_cloud_stats.h"
+#define TELEMETRY_STATS_MAX_SIZE STATS_ENCODED_MAX_SIZE
+#else
+#define TELEMETRY_STATS_MAX_SIZE 0
+#endif
+
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA)
+#include "pyrinas_cloud_fota.h"
+#define TELEMETRY_FOTA_MAX_SIZE FOTA_METRICS_ENCODED_MAX_SIZE
+#else
+#define TELEMETRY_FOTA_MAX_SIZE 0
+#endif
+
+/* Largest encoded telemetry. Use this for buffers. */
+#define TELEMETRY_ENCODED_MAX_SIZE (TELEMETRY_MAP_HEADER_MAX_SIZE + TELEMETRY_BUILTIN_MAX_SIZE + \
+                                    CONFIG_PYRINAS_CLOUD_TELEMETRY_APP_MAX_SIZE + TELEMETRY_STATS_MAX_SIZE +  \
+                                    TELEMETRY_FOTA_MAX_SIZE)
+
+/* Largest manifest. Versions are small integers, strings fill their buffer less the NUL. */
+#define OTA_MEMBER_SIZE(member) sizeof(((struct pyrinas_cloud_ota_data *)0)->member)
+#define OTA_VERSION_ENCODED_MAX_SIZE (1 + 4 * (1 + 2) + 1 + 1 + 8 * 2)
+#define OTA_TEXT_ENCODED_MAX_SIZE(member) (CBOR_HEAD_SIZE(OTA_MEMBER_SIZE(member) - 1) + OTA_MEMBER_SIZE(member) - 1)
+
+#define OTA_DATA_ENCODED_MAX_SIZE (1 +                                                \
+                                   2 * (1 + OTA_VERSION_ENCODED_MAX_SIZE) +           \
+                                   1 + OTA_TEXT_ENCODED_MAX_SIZE(host) +              \
+                                   1 + OTA_TEXT_ENCODED_MAX_SIZE(file) +              \
+                                   1 + OTA_TEXT_ENCODED_MAX_SIZE(delta_file) +        \
+                                   1 + 1 +                                            \
+                                   1 + 5 +                                            \
+                                   1 + CBOR_HEAD_SIZE(OTA_MEMBER_SIZE(digest)) + 2 * OTA_MEMBER_SIZE(digest))
+
 QCBORError encode_ota_request(enum pyrinas_cloud_ota_cmd_type cmd_type, uint8_t *buf, size_t data_len, size_t *payload_len);
 QCBORError decode_ota_data(struct pyrinas_cloud_ota_data *ota_data, const char *data, size_t data_len);
-QCBORError encode_telemetry_data(struct pyrinas_cloud_telemetry_data *p_data, uint8_t *buf, size_t data_len, size_t *payload_len);
+/* Encode set fields. Central telemetry also carries application fields, link stats and OTA metrics. */
+QCBORError encode_telemetry_data(struct pyrinas_cloud_telemetry_data *p_data, bool central, uint8_t *buf, size_t data_len, size_t *payload_len);
+QCBORError decode_telemetry_data(struct pyrinas_cloud_telemetry_data *p_data, const uint8_t *data, size_t data_len);
+
+/* Alias registration. A map of alias id to full topic. */
+QCBORError encode_alias_register(uint8_t alias, const uint8_t *topic, size_t topic_len, uint8_t *buf, size_t data_len, size_t *payload_len);
+
+/* Remote config. Only the keys present are changed. */
+QCBORError decode_config_data(struct pyrinas_cloud_telemetry_interval *p_interval, const char *data, size_t data_len);
+
+/* Clear fields in p_data that are within their deadband of p_last.
+ * Returns the number of built in fields left to send. */
+int telemetry_delta(const struct pyrinas_cloud_telemetry_data *p_last, struct pyrinas_cloud_telemetry_data *p_data);
+
+/* Copy every field set in p_data over p_last */
+void telemetry_merge(struct pyrinas_cloud_telemetry_data *p_last, const struct pyrinas_cloud_telemetry_data *p_data);
+
+/* Checks application fields fit in CONFIG_PYRINAS_CLOUD_TELEMETRY_APP_MAX_SIZE.
+ * They're left out of telemetry until this passes. */
+int telemetry_app_fields_check(void);
 
 #endif /* _PYRINAS_CLOUD_CBOR_PARSER_H */
\ No newline at end of file
@@ -0,0 +1,342 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <string.h>
+#include <sys/byteorder.h>
+
+#include "pyrinas_cloud_compress.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(pyrinas_cloud_compress);
+
+/* LZSS. A flag byte covers the next 8 items, LSB first. 1 is a literal byte,
+ * 0 a two byte match of a 12 bit offset - 1 and a 4 bit length - 3. */
+#define MATCH_MIN 3
+#define MATCH_MAX (MATCH_MIN + 15)
+#define MATCH_OFFSET_MAX 4096
+
+#define CBOR_MAJOR_UINT 0
+#define CBOR_MAJOR_BSTR 2
+#define CBOR_MAJOR_ARRAY 4
+
+BUILD_ASSERT(COMPRESS_WINDOW_SIZE <= MATCH_OFFSET_MAX, "Window too large for 12 bit offsets");
+
+static const uint8_t tag_head[] = {0xDA, 0x50, 0x59, 0x5A, 0x31};
+
+BUILD_ASSERT(sizeof(tag_head) == 5 && COMPRESS_CBOR_TAG == 0x50595A31, "Tag head out of sync");
+
+/* The header has to be readable from the first segment of a stream, before the
+ * byte string is complete, so it's written and read by hand. */
+static size_t cbor_head_put(uint8_t *p, uint8_t major, uint32_t value)
+{
+    if (value < 24)
+    {
+        p[0] = (major << 5) | value;
+        return 1;
+    }
+    else if (value <= UINT8_MAX)
+    {
+        p[0] = (major << 5) | 24;
+        p[1] = value;
+        return 2;
+    }
+    else if (value <= UINT16_MAX)
+    {
+        p[0] = (major << 5) | 25;
+        sys_put_be16(value, &p[1]);
+        return 3;
+    }
+
+    p[0] = (major << 5) | 26;
+    sys_put_be32(value, &p[1]);
+    return 5;
+}
+
+/* Returns the head size or 0 if it's not there */
+static size_t cbor_head_get(const uint8_t *p, size_t len, uint8_t major, uint32_t *value)
+{
+    if (len < 1 || (p[0] >> 5) != major)
+        return 0;
+
+    uint8_t info = p[0] & 0x1F;
+
+    if (info < 24)
+    {
+        *value = info;
+        return 1;
+    }
+    else if (info == 24 && len >= 2)
+    {
+        *value = p[1];
+        return 2;
+    }
+    else if (info == 25 && len >= 3)
+    {
+        *value = sys_get_be16(&p[1]);
+        return 3;
+    }
+    else if (info == 26 && len >= 5)
+    {
+        *value = sys_get_be32(&p[1]);
+        return 5;
+    }
+
+    return 0;
+}
+
+bool pyrinas_cloud_compress_is_compressed(const uint8_t *data, size_t len)
+{
+    return len > sizeof(tag_head) && memcmp(data, tag_head, sizeof(tag_head)) == 0;
+}
+
+/* Longest earlier match in the window. Brute force, the window is small. */
+static size_t match_find(const uint8_t *in, size_t in_len, size_t pos, size_t *offset)
+{
+    size_t start = pos > COMPRESS_WINDOW_SIZE ? pos - COMPRESS_WINDOW_SIZE : 0;
+    size_t limit = MIN(MATCH_MAX, in_len - pos);
+    size_t best = 0;
+
+    for (size_t s = pos; s-- > start;)
+    {
+        size_t len = 0;
+
+        /* May run into the bytes being encoded. The decoder copies one at a time. */
+        while (len < limit && in[s + len] == in[pos + len])
+            len++;
+
+        if (len > best)
+        {
+            best = len;
+            *offset = pos - s;
+
+            if (best == limit)
+                break;
+        }
+    }
+
+    return best;
+}
+
+int pyrinas_cloud_compress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_size, size_t *out_len)
+{
+    /* Leave room for the header. Moved down once the size is known. */
+    size_t limit = MIN(out_size, in_len);
+    size_t o = COMPRESS_HEADER_MAX_SIZE;
+    size_t flag_pos = 0;
+    uint8_t flag_bit = 8;
+    size_t pos = 0;
+
+    while (pos < in_len)
+    {
+        size_t offset = 0;
+        size_t len = match_find(in, in_len, pos, &offset);
+
+        /* New flag byte every 8 items. Worst case this item is 2 bytes. */
+        if (flag_bit == 8)
+        {
+            if (o + 3 > limit)
+                return -ENOSPC;
+
+            flag_pos = o++;
+            out[flag_pos] = 0;
+            flag_bit = 0;
+        }
+        else if (o + 2 > limit)
+        {
+            return -ENOSPC;
+        }
+
+        if (len >= MATCH_MIN)
+        {
+            out[o++] = (offset - 1) >> 4;
+            out[o++] = ((offset - 1) & 0x0F) << 4 | (len - MATCH_MIN);
+            pos += len;
+        }
+        else
+        {
+            out[flag_pos] |= BIT(flag_bit);
+            out[o++] = in[pos++];
+        }
+
+        flag_bit++;
+    }
+
+    size_t stream_len = o - COMPRESS_HEADER_MAX_SIZE;
+    uint8_t header[COMPRESS_HEADER_MAX_SIZE];
+    size_t h = 0;
+
+    memcpy(header, tag_head, sizeof(tag_head));
+    h += sizeof(tag_head);
+    h += cbor_head_put(&header[h], CBOR_MAJOR_ARRAY, 3);
+    h += cbor_head_put(&header[h], CBOR_MAJOR_UINT, in_len);
+    h += cbor_head_put(&header[h], CBOR_MAJOR_UINT, CONFIG_PYRINAS_CLOUD_COMPRESS_WINDOW_BITS);
+    h += cbor_head_put(&header[h], CBOR_MAJOR_BSTR, stream_len);
+
+    if (h + stream_len >= limit)
+        return -ENOSPC;
+
+    memmove(&out[h], &out[COMPRESS_HEADER_MAX_SIZE], stream_len);
+    memcpy(out, header, h);
+
+    *out_len = h + stream_len;
+
+    return 0;
+}
+
+int pyrinas_cloud_decompress_init(struct pyrinas_cloud_decompress *ctx, const uint8_t *data, size_t len,
+                                  size_t *header_len, pyrinas_cloud_decompress_out_t out, void *user_data)
+{
+    uint32_t count, total, window_bits, stream_len;
+    size_t h, n;
+
+    if (!pyrinas_cloud_compress_is_compressed(data, len))
+        return -EINVAL;
+
+    h = sizeof(tag_head);
+
+    if (!(n = cbor_head_get(&data[h], len - h, CBOR_MAJOR_ARRAY, &count)) || count != 3)
+        return -EINVAL;
+    h += n;
+
+    if (!(n = cbor_head_get(&data[h], len - h, CBOR_MAJOR_UINT, &total)))
+        return -EINVAL;
+    h += n;
+
+    if (!(n = cbor_head_get(&data[h], len - h, CBOR_MAJOR_UINT, &window_bits)))
+        return -EINVAL;
+    h += n;
+
+    if (!(n = cbor_head_get(&data[h], len - h, CBOR_MAJOR_BSTR, &stream_len)))
+        return -EINVAL;
+    h += n;
+
+    /* Matches could reach further back than we remember */
+    if (window_bits > CONFIG_PYRINAS_CLOUD_COMPRESS_WINDOW_BITS)
+    {
+        LOG_WRN("Window of %d bits not supported", window_bits);
+        return -ENOTSUP;
+    }
+
+    memset(ctx, 0, offsetof(struct pyrinas_cloud_decompress, window));
+    ctx->out = out;
+    ctx->user_data = user_data;
+    ctx->total = total;
+
+    *header_len = h;
+
+    return 0;
+}
+
+static void window_flush(struct pyrinas_cloud_decompress *ctx, size_t end)
+{
+    if (end > ctx->flushed)
+        ctx->out(&ctx->window[ctx->flushed], end - ctx->flushed, ctx->user_data);
+
+    ctx->flushed = end % COMPRESS_WINDOW_SIZE;
+}
+
+static void window_put(struct pyrinas_cloud_decompress *ctx, uint8_t value)
+{
+    size_t index = ctx->pos % COMPRESS_WINDOW_SIZE;
+
+    ctx->window[index] = value;
+    ctx->pos++;
+
+    /* Hand over the window before it wraps */
+    if (index == COMPRESS_WINDOW_SIZE - 1)
+        window_flush(ctx, COMPRESS_WINDOW_SIZE);
+}
+
+int pyrinas_cloud_decompress_feed(struct pyrinas_cloud_decompress *ctx, const uint8_t *data, size_t len)
+{
+    int err = 0;
+
+    for (size_t i = 0; i < len && ctx->pos < ctx->total; i++)
+    {
+        uint8_t value = data[i];
+
+        if (ctx->flag_bits == 0)
+        {
+            ctx->flags = value;
+            ctx->flag_bits = 8;
+        }
+        else if (ctx->flags & BIT(0))
+        {
+            window_put(ctx, value);
+            ctx->flags >>= 1;
+            ctx->flag_bits--;
+        }
+        else if (!ctx->has_token)
+        {
+            ctx->token = value;
+            ctx->has_token = true;
+        }
+        else
+        {
+            size_t offset = ((ctx->token << 4) | (value >> 4)) + 1;
+            size_t count = (value & 0x0F) + MATCH_MIN;
+
+            ctx->has_token = false;
+            ctx->flags >>= 1;
+            ctx->flag_bits--;
+
+            if (offset > ctx->pos || offset > COMPRESS_WINDOW_SIZE)
+            {
+                err = -EINVAL;
+                break;
+            }
+
+            for (; count > 0 && ctx->pos < ctx->total; count--)
+                window_put(ctx, ctx->window[(ctx->pos - offset) % COMPRESS_WINDOW_SIZE]);
+        }
+    }
+
+    window_flush(ctx, ctx->pos % COMPRESS_WINDOW_SIZE);
+
+    return err;
+}
+
+struct decompress_buf
+{
+    uint8_t *data;
+    size_t len;
+};
+
+static void decompress_buf_out(const uint8_t *data, size_t len, void *user_data)
+{
+    struct decompress_buf *buf = user_data;
+
+    /* Size is checked up front */
+    memcpy(&buf->data[buf->len], data, len);
+    buf->len += len;
+}
+
+int pyrinas_cloud_decompress(struct pyrinas_cloud_decompress *ctx, const uint8_t *in, size_t in_len, uint8_t *out, size_t out_size)
+{
+    struct decompress_buf buf = {
+        .data = out,
+    };
+    size_t header_len;
+    int err;
+
+    err = pyrinas_cloud_decompress_init(ctx, in, in_len, &header_len, decompress_buf_out, &buf);
+    if (err)
+        return err;
+
+    if (ctx->total > out_size)
+        return -ENOSPC;
+
+    err = pyrinas_cloud_decompress_feed(ctx, &in[header_len], in_len - header_len);
+    if (err)
+        return err;
+
+    /* Stream ended early */
+    if (buf.len != ctx->total)
+        return -EINVAL;
+
+    return buf.len;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _PYRINAS_CLOUD_COMPRESS_H
+#define _PYRINAS_CLOUD_COMPRESS_H
+
+#include <zephyr.h>
+
+/* Compressed payloads are tag(0x50595A31, [original length, window bits, h'lzss'])
+ * so they can be told apart from plain payloads by the first bytes. */
+#define COMPRESS_CBOR_TAG 0x50595A31
+
+/* Tag, array head and worst case heads for two uints and the byte string */
+#define COMPRESS_HEADER_MAX_SIZE (5 + 1 + 5 + 1 + 5)
+
+#define COMPRESS_WINDOW_SIZE BIT(CONFIG_PYRINAS_CLOUD_COMPRESS_WINDOW_BITS)
+
+/* Called with each run of decompressed bytes */
+typedef void (*pyrinas_cloud_decompress_out_t)(const uint8_t *data, size_t len, void *user_data);
+
+/* Streaming decoder. Only the window is kept so any payload size works. */
+struct pyrinas_cloud_decompress
+{
+    pyrinas_cloud_decompress_out_t out;
+    void *user_data;
+    size_t total;
+    size_t pos;
+    size_t flushed;
+    uint8_t flags;
+    uint8_t flag_bits;
+    uint8_t token;
+    bool has_token;
+    uint8_t window[COMPRESS_WINDOW_SIZE];
+};
+
+/* True if data starts with the compressed payload tag */
+bool pyrinas_cloud_compress_is_compressed(const uint8_t *data, size_t len);
+
+/* Compress in into out. Returns -ENOSPC if it doesn't fit in out or isn't any smaller. */
+int pyrinas_cloud_compress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_size, size_t *out_len);
+
+/* Parse the header at the start of a compressed payload. header_len is where the
+ * compressed stream starts and ctx->total the decompressed size. */
+int pyrinas_cloud_decompress_init(struct pyrinas_cloud_decompress *ctx, const uint8_t *data, size_t len,
+                                  size_t *header_len, pyrinas_cloud_decompress_out_t out, void *user_data);
+
+/* Feed the next part of the compressed stream. Output goes to the callback. */
+int pyrinas_cloud_decompress_feed(struct pyrinas_cloud_decompress *ctx, const uint8_t *data, size_t len);
+
+/* Decompress a whole payload into out. Returns the decompressed size, -ENOSPC if
+ * it doesn't fit in out_size, or another negative error. */
+int pyrinas_cloud_decompress(struct pyrinas_cloud_decompress *ctx, const uint8_t *in, size_t in_len, uint8_t *out, size_t out_size);
+
+#endif /* _PYRINAS_CLOUD_COMPRESS_H */
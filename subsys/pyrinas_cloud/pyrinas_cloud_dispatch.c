@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <string.h>
+
+#include "pyrinas_cloud_dispatch.h"
+#include "pyrinas_cloud_helper.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(pyrinas_cloud_dispatch);
+
+#define DISPATCH_BUCKET_COUNT CONFIG_PYRINAS_CLOUD_APPLICATION_CALLBACK_BUCKET_COUNT
+#define DISPATCH_END -1
+
+BUILD_ASSERT((DISPATCH_BUCKET_COUNT & (DISPATCH_BUCKET_COUNT - 1)) == 0,
+             "Bucket count must be a power of two");
+BUILD_ASSERT(CONFIG_PYRINAS_CLOUD_APPLICATION_CALLBACK_MAX_COUNT < INT16_MAX,
+             "Too many callbacks for 16 bit indexes");
+
+struct dispatch_entry
+{
+    union
+    {
+        pyrinas_cloud_application_cb_t cb;
+        pyrinas_cloud_application_stream_cb_t stream_cb;
+    };
+    uint32_t hash;
+    int16_t next;
+    uint8_t topic_len;
+    bool in_use;
+    bool wildcard;
+    bool stream;
+    char topic[CONFIG_PYRINAS_CLOUD_APPLICATION_EVENT_NAME_MAX_SIZE];
+};
+
+/* Exact topics chain off a bucket, wildcard topics off their own list */
+static struct dispatch_entry entries[CONFIG_PYRINAS_CLOUD_APPLICATION_CALLBACK_MAX_COUNT];
+static int16_t buckets[DISPATCH_BUCKET_COUNT] = {[0 ... DISPATCH_BUCKET_COUNT - 1] = DISPATCH_END};
+static int16_t wildcards = DISPATCH_END;
+
+/* Subscribes come from the app, dispatch from the cloud thread */
+static K_MUTEX_DEFINE(dispatch_mutex);
+
+/* FNV-1a */
+static uint32_t topic_hash(const uint8_t *topic, size_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= topic[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static bool topic_has_wildcard(const char *topic, size_t len)
+{
+    return memchr(topic, '+', len) != NULL || memchr(topic, '#', len) != NULL;
+}
+
+/* MQTT style match. + is one level, # is the remaining levels. */
+static bool topic_matches(const char *filter, size_t filter_len, const uint8_t *topic, size_t topic_len)
+{
+    size_t f = 0;
+    size_t t = 0;
+
+    while (f < filter_len)
+    {
+        if (filter[f] == '#')
+            return true;
+
+        if (filter[f] == '+')
+        {
+            while (t < topic_len && topic[t] != '/')
+                t++;
+
+            f++;
+            continue;
+        }
+
+        if (t >= topic_len || filter[f] != topic[t])
+        {
+            /* "a/#" also matches "a" */
+            return t == topic_len && f + 2 == filter_len &&
+                   filter[f] == '/' && filter[f + 1] == '#';
+        }
+
+        f++;
+        t++;
+    }
+
+    return t == topic_len;
+}
+
+static int16_t *chain_head(struct dispatch_entry *entry)
+{
+    if (entry->wildcard)
+        return &wildcards;
+
+    return &buckets[entry->hash & (DISPATCH_BUCKET_COUNT - 1)];
+}
+
+static int dispatch_add(const char *topic, size_t topic_len, void *cb, bool stream)
+{
+    int err = -ENOMEM;
+
+    /* Return if name is greater than name size */
+    if (topic_len == 0 || topic_len > sizeof(entries[0].topic) || cb == NULL)
+        return -EINVAL;
+
+    k_mutex_lock(&dispatch_mutex, K_FOREVER);
+
+    for (int16_t i = 0; i < ARRAY_SIZE(entries); i++)
+    {
+        struct dispatch_entry *entry = &entries[i];
+
+        if (entry->in_use)
+            continue;
+
+        /* Set the values */
+        if (stream)
+            entry->stream_cb = cb;
+        else
+            entry->cb = cb;
+
+        entry->stream = stream;
+        entry->topic_len = topic_len;
+        entry->wildcard = topic_has_wildcard(topic, topic_len);
+        entry->hash = topic_hash(topic, topic_len);
+        memcpy(entry->topic, topic, topic_len);
+        entry->in_use = true;
+
+        /* Link in at the head */
+        int16_t *head = chain_head(entry);
+        entry->next = *head;
+        *head = i;
+
+        char topic_str[sizeof(entry->topic) + 1];
+
+        LOG_DBG("Added %s%s", log_strdup(str_terminate(topic_str, sizeof(topic_str), topic, topic_len)),
+                entry->wildcard ? " (wildcard)" : "");
+
+        err = 0;
+        break;
+    }
+
+    k_mutex_unlock(&dispatch_mutex);
+
+    /* Can't add new entry. They're all occupied! */
+    return err;
+}
+
+int pyrinas_cloud_dispatch_add(const char *topic, size_t topic_len, pyrinas_cloud_application_cb_t cb)
+{
+    return dispatch_add(topic, topic_len, cb, false);
+}
+
+int pyrinas_cloud_dispatch_add_stream(const char *topic, size_t topic_len, pyrinas_cloud_application_stream_cb_t cb)
+{
+    return dispatch_add(topic, topic_len, cb, true);
+}
+
+int pyrinas_cloud_dispatch_remove(const char *topic, size_t topic_len)
+{
+    struct dispatch_entry match = {
+        .wildcard = topic_has_wildcard(topic, topic_len),
+        .hash = topic_hash(topic, topic_len),
+    };
+    int removed = 0;
+
+    k_mutex_lock(&dispatch_mutex, K_FOREVER);
+
+    int16_t *link = chain_head(&match);
+
+    while (*link != DISPATCH_END)
+    {
+        struct dispatch_entry *entry = &entries[*link];
+
+        if (entry->hash == match.hash &&
+            entry->topic_len == topic_len &&
+            memcmp(entry->topic, topic, topic_len) == 0)
+        {
+            /* Unlink */
+            *link = entry->next;
+            entry->in_use = false;
+            removed++;
+            continue;
+        }
+
+        link = &entry->next;
+    }
+
+    k_mutex_unlock(&dispatch_mutex);
+
+    /* Entry not found */
+    return removed ? 0 : -ENOENT;
+}
+
+static void entry_call(struct dispatch_entry *entry, const uint8_t *topic, size_t topic_len,
+                       const uint8_t *data, size_t data_len,
+                       size_t offset, size_t total_len, bool segment, int *count)
+{
+    if (entry->stream)
+    {
+        entry->stream_cb(topic, topic_len, data, data_len, offset, total_len);
+        (*count)++;
+    }
+    else if (!segment)
+    {
+        entry->cb(topic, topic_len, data, data_len);
+        (*count)++;
+    }
+}
+
+static int dispatch_call(const uint8_t *topic, size_t topic_len,
+                         const uint8_t *data, size_t data_len,
+                         size_t offset, size_t total_len, bool segment)
+{
+    uint32_t hash = topic_hash(topic, topic_len);
+    int count = 0;
+
+    k_mutex_lock(&dispatch_mutex, K_FOREVER);
+
+    /* Exact matches */
+    for (int16_t i = buckets[hash & (DISPATCH_BUCKET_COUNT - 1)]; i != DISPATCH_END; i = entries[i].next)
+    {
+        struct dispatch_entry *entry = &entries[i];
+
+        if (entry->hash == hash &&
+            entry->topic_len == topic_len &&
+            memcmp(entry->topic, topic, topic_len) == 0)
+        {
+            entry_call(entry, topic, topic_len, data, data_len, offset, total_len, segment, &count);
+        }
+    }
+
+    /* Wildcards */
+    for (int16_t i = wildcards; i != DISPATCH_END; i = entries[i].next)
+    {
+        struct dispatch_entry *entry = &entries[i];
+
+        if (topic_matches(entry->topic, entry->topic_len, topic, topic_len))
+            entry_call(entry, topic, topic_len, data, data_len, offset, total_len, segment, &count);
+    }
+
+    k_mutex_unlock(&dispatch_mutex);
+
+    return count;
+}
+
+int pyrinas_cloud_dispatch(const uint8_t *topic, size_t topic_len, const uint8_t *data, size_t data_len)
+{
+    return dispatch_call(topic, topic_len, data, data_len, 0, data_len, false);
+}
+
+int pyrinas_cloud_dispatch_segment(const uint8_t *topic, size_t topic_len,
+                                   const uint8_t *data, size_t data_len,
+                                   size_t offset, size_t total_len)
+{
+    return dispatch_call(topic, topic_len, data, data_len, offset, total_len, true);
+}
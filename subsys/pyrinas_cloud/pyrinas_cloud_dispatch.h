@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _PYRINAS_CLOUD_DISPATCH_H
+#define _PYRINAS_CLOUD_DISPATCH_H
+
+#include <zephyr.h>
+#include <pyrinas_cloud/pyrinas_cloud.h>
+
+/* Register a handler for an application topic suffix. Supports + and # wildcards. */
+int pyrinas_cloud_dispatch_add(const char *topic, size_t topic_len, pyrinas_cloud_application_cb_t cb);
+
+/* Register a handler that receives payloads in segments */
+int pyrinas_cloud_dispatch_add_stream(const char *topic, size_t topic_len, pyrinas_cloud_application_stream_cb_t cb);
+
+/* Remove all handlers registered for this exact suffix */
+int pyrinas_cloud_dispatch_remove(const char *topic, size_t topic_len);
+
+/* Call every handler matching the suffix with a complete payload.
+ * Stream handlers get it as a single segment. Returns number of handlers called. */
+int pyrinas_cloud_dispatch(const uint8_t *topic, size_t topic_len, const uint8_t *data, size_t data_len);
+
+/* Pass one segment of a larger payload to the matching stream handlers.
+ * Returns number of handlers called. */
+int pyrinas_cloud_dispatch_segment(const uint8_t *topic, size_t topic_len,
+                                   const uint8_t *data, size_t data_len,
+                                   size_t offset, size_t total_len);
+
+#endif /* _PYRINAS_CLOUD_DISPATCH_H */
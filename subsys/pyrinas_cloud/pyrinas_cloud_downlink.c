@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <string.h>
+#include <sys/util.h>
+
+#include "pyrinas_cloud_helper.h"
+#include "pyrinas_cloud_downlink.h"
+#include "pyrinas_cloud_peripheral.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(pyrinas_cloud_downlink);
+
+/* Guarded by the registry lock */
+static pyrinas_cloud_downlink_cb_t downlink_cb;
+
+/* Registry lock must be held */
+static void queue_put(struct pyrinas_cloud_downlink_queue *queue, const pyrinas_event_t *evt)
+{
+    /* Newest wins. Stale commands are the least useful. */
+    if (queue->count == ARRAY_SIZE(queue->evts))
+    {
+        LOG_WRN("Downlink queue full. Dropping oldest.");
+        queue->head = (queue->head + 1) % ARRAY_SIZE(queue->evts);
+        queue->count--;
+    }
+
+    queue->evts[(queue->head + queue->count) % ARRAY_SIZE(queue->evts)] = *evt;
+    queue->count++;
+}
+
+/* Registry lock must be held. Back at the head after a failed send. */
+static void queue_put_front(struct pyrinas_cloud_downlink_queue *queue, const pyrinas_event_t *evt)
+{
+    /* Newer ones came in meanwhile and filled it */
+    if (queue->count == ARRAY_SIZE(queue->evts))
+    {
+        LOG_WRN("Downlink queue full. Dropping oldest.");
+        return;
+    }
+
+    queue->head = (queue->head + ARRAY_SIZE(queue->evts) - 1) % ARRAY_SIZE(queue->evts);
+    queue->evts[queue->head] = *evt;
+    queue->count++;
+}
+
+static bool peripheral_busy(int err)
+{
+    return err == -ENOTCONN || err == -EAGAIN || err == -EBUSY;
+}
+
+/* Sends whatever is queued, oldest first, until the peripheral stops
+ * taking them. The callback is a GATT write so it runs without the
+ * registry lock. Only one caller sends at a time to keep the order. */
+static void queue_flush(struct pyrinas_cloud_peripheral *peripheral)
+{
+    struct pyrinas_cloud_downlink_queue *queue = &peripheral->downlink;
+    pyrinas_cloud_downlink_cb_t cb;
+    pyrinas_event_t evt;
+
+    pyrinas_cloud_peripheral_lock();
+
+    /* Whoever is sending picks up what was just queued */
+    if (queue->sending)
+    {
+        pyrinas_cloud_peripheral_unlock();
+        return;
+    }
+
+    queue->sending = true;
+
+    while (queue->count && downlink_cb)
+    {
+        /* Taken off while it's sent. sending keeps the entry. */
+        evt = queue->evts[queue->head];
+        queue->head = (queue->head + 1) % ARRAY_SIZE(queue->evts);
+        queue->count--;
+        cb = downlink_cb;
+
+        pyrinas_cloud_peripheral_unlock();
+        int err = cb(evt.peripheral_addr, &evt);
+        pyrinas_cloud_peripheral_lock();
+
+        if (peripheral_busy(err))
+        {
+            LOG_DBG("Downlink flush stopped. Err: %d", err);
+            queue_put_front(queue, &evt);
+            break;
+        }
+
+        if (err)
+            LOG_WRN("Unable to send downlink. Err: %d", err);
+    }
+
+    queue->sending = false;
+
+    pyrinas_cloud_peripheral_unlock();
+}
+
+int pyrinas_cloud_downlink_route(const uint8_t *suffix, size_t suffix_len, const uint8_t *data, size_t data_len)
+{
+    pyrinas_event_t evt = {0};
+    char suffix_str[CONFIG_PYRINAS_CLOUD_PUBLISH_TOPIC_MAX_SIZE + 1];
+    int err;
+
+    /* <uid>/<name> */
+    if (suffix_len < PERIPHERAL_UID_LEN + 2 || suffix[PERIPHERAL_UID_LEN] != '/' ||
+        hex2bin(suffix, PERIPHERAL_UID_LEN, evt.peripheral_addr, PERIPHERAL_ADDR_LEN) != PERIPHERAL_ADDR_LEN)
+    {
+        LOG_WRN("Bad downlink topic %s", log_strdup(str_terminate(suffix_str, sizeof(suffix_str), suffix, suffix_len)));
+        return -EINVAL;
+    }
+
+    const uint8_t *name = suffix + PERIPHERAL_UID_LEN + 1;
+    size_t name_len = suffix_len - PERIPHERAL_UID_LEN - 1;
+
+    /* Names go over BLE with their terminator */
+    if (name_len + 1 > sizeof(evt.name.bytes) || data_len > sizeof(evt.data.bytes))
+    {
+        LOG_WRN("Downlink too large. Name: %d Data: %d", name_len, data_len);
+        return -EMSGSIZE;
+    }
+
+    memcpy(evt.name.bytes, name, name_len);
+    evt.name.bytes[name_len] = '\0';
+    evt.name.size = name_len + 1;
+
+    memcpy(evt.data.bytes, data, data_len);
+    evt.data.size = data_len;
+
+    pyrinas_cloud_peripheral_lock();
+
+    /* Queued messages keep the entry until they're delivered */
+    struct pyrinas_cloud_peripheral *peripheral = pyrinas_cloud_peripheral_get(evt.peripheral_addr, true);
+
+    if (downlink_cb == NULL)
+    {
+        err = -ENOTSUP;
+    }
+    else if (peripheral == NULL)
+    {
+        err = -ENOMEM;
+    }
+    else
+    {
+        /* Behind anything older so the order holds */
+        queue_put(&peripheral->downlink, &evt);
+        err = 0;
+    }
+
+    pyrinas_cloud_peripheral_unlock();
+
+    if (err)
+    {
+        LOG_WRN("Unable to route downlink. Err: %d", err);
+        return err;
+    }
+
+    queue_flush(peripheral);
+
+    return 0;
+}
+
+void pyrinas_cloud_downlink_flush(const uint8_t *peripheral_addr)
+{
+    pyrinas_cloud_peripheral_lock();
+
+    struct pyrinas_cloud_peripheral *peripheral = pyrinas_cloud_peripheral_get(peripheral_addr, false);
+
+    /* Something queued pins the entry until the flush is done with it */
+    bool queued = peripheral && peripheral->downlink.count;
+
+    if (queued)
+        LOG_INF("Sending %d queued downlinks", peripheral->downlink.count);
+
+    pyrinas_cloud_peripheral_unlock();
+
+    if (queued)
+        queue_flush(peripheral);
+}
+
+void pyrinas_cloud_register_downlink(pyrinas_cloud_downlink_cb_t cb)
+{
+    pyrinas_cloud_peripheral_lock();
+    downlink_cb = cb;
+    pyrinas_cloud_peripheral_unlock();
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _PYRINAS_CLOUD_DOWNLINK_H
+#define _PYRINAS_CLOUD_DOWNLINK_H
+
+#include <zephyr.h>
+#include <pyrinas_cloud/pyrinas_cloud.h>
+
+/* Messages for one peripheral that couldn't take them yet. Kept in its
+ * registry entry. */
+struct pyrinas_cloud_downlink_queue
+{
+    size_t head;
+    size_t count;
+    bool sending; /* One is off the queue and on its way */
+    pyrinas_event_t evts[CONFIG_PYRINAS_CLOUD_DOWNLINK_QUEUE_SIZE];
+};
+
+/* Route a downlink to its peripheral. suffix is "<uid>/<event name>",
+ * what's left of the topic after the downlink prefix. Sent after
+ * anything still queued. Stays queued if the peripheral isn't
+ * connected or busy. */
+int pyrinas_cloud_downlink_route(const uint8_t *suffix, size_t suffix_len, const uint8_t *data, size_t data_len);
+
+/* Send anything queued for the peripheral. Stops at the first failure. */
+void pyrinas_cloud_downlink_flush(const uint8_t *peripheral_addr);
+
+#endif /* _PYRINAS_CLOUD_DOWNLINK_H */
@@ -0,0 +1,1028 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <string.h>
+#include <net/download_client.h>
+#include <storage/flash_map.h>
+#include <dfu/mcuboot.h>
+#include <settings/settings.h>
+#include <sys/crc.h>
+#include <sys/byteorder.h>
+
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_DELTA)
+#include <app/version.h>
+#endif
+
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_VERIFY)
+#include <tinycrypt/sha256.h>
+#include <tinycrypt/constants.h>
+#endif
+
+#include "pyrinas_cloud_fota.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(pyrinas_cloud_fota);
+
+#define FOTA_SETTINGS_KEY "pyrinas/fota"
+#define FOTA_SETTINGS_NAME "progress"
+#define FOTA_SETTINGS_METRICS "metrics"
+
+#define FOTA_BUF_SIZE CONFIG_PYRINAS_CLOUD_FOTA_BUF_SIZE
+
+#define FOTA_FLASH_STACK_SIZE CONFIG_PYRINAS_CLOUD_FOTA_FLASH_STACK_SIZE
+
+BUILD_ASSERT(CONFIG_PYRINAS_CLOUD_FOTA_SAVE_INTERVAL % FOTA_BUF_SIZE == 0,
+             "Progress is saved on buffer boundaries");
+
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_DELTA)
+/* Patch format, little endian. Made by scripts/delta-generator.ts.
+ *   header  "PYD1" | image size u32 | base size u32 | base crc32 u32
+ *   insert  0x01 | len u32 | len bytes of data
+ *   copy    0x02 | len u32 | base offset u32
+ */
+#define DELTA_MAGIC "PYD1"
+#define DELTA_HEADER_SIZE 16
+
+enum delta_op
+{
+    delta_op_none,
+    delta_op_insert,
+    delta_op_copy,
+};
+
+/* Where the patch stands. Saved along with the offset it produced. */
+struct delta_state
+{
+    uint32_t in;        /* Patch bytes consumed */
+    uint32_t base_size;
+    uint32_t remaining; /* Of the current op */
+    uint32_t src;       /* Next base byte to copy */
+    uint8_t op;
+    uint8_t hdr_len;
+    uint8_t hdr[DELTA_HEADER_SIZE];
+};
+#endif
+
+/* Stored as is in settings */
+struct fota_progress
+{
+    uint32_t id;     /* Which image. crc of the version and url. */
+    uint32_t offset; /* Written to flash. Multiple of the buffer size. */
+    uint32_t size;
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_DELTA)
+    struct delta_state patch;
+#endif
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_VERIFY)
+    struct tc_sha256_state_struct sha; /* Of the image up to offset */
+#endif
+};
+
+static struct fota_progress saved;
+
+/* flash_q saves the offset while the download client thread sets the size */
+static K_MUTEX_DEFINE(saved_mutex);
+
+/* How the last download went. Saved when it ends so it survives the
+ * reboot and goes out with the next telemetry. */
+struct fota_metrics
+{
+    uint32_t bytes; /* Downloaded */
+    uint32_t download_ms;
+    uint32_t flash_bytes;
+    uint32_t flash_ms; /* Erasing and writing */
+    uint32_t stall_ms; /* Download waiting on flash */
+};
+
+static struct fota_metrics metrics;
+static atomic_t metrics_pending;
+static struct k_work metrics_clear_work;
+
+static struct k_work_q *fota_q;
+static struct k_delayed_work retry_work;
+static pyrinas_cloud_fota_evt_handler_t evt_handler;
+
+static struct download_client dlc;
+static const struct flash_area *fa;
+static struct pyrinas_cloud_ota_data fota_data;
+static const char *file;
+static bool use_delta;
+static atomic_t busy;
+static uint8_t retries;
+
+/* Write state. Only touched from the download client thread once started. */
+static uint8_t *buf;
+static size_t buf_len;
+static uint32_t offset; /* Handed to the writer */
+
+/* One buffer fills from the network while the other is on its way to
+ * flash. Each job erases and writes one buffer on flash_q. */
+struct flash_job
+{
+    struct k_work work;
+    uint8_t *data;
+    size_t len;
+    uint32_t offset;
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_DELTA)
+    struct delta_state patch; /* As of the end of this buffer */
+#endif
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_VERIFY)
+    struct tc_sha256_state_struct sha; /* Same */
+#endif
+};
+
+static uint8_t bufs[2][FOTA_BUF_SIZE];
+static struct flash_job jobs[2];
+static uint8_t fill;
+static atomic_t write_err;
+
+/* Given back once the buffer not being filled is written */
+static K_SEM_DEFINE(buf_free, 1, 1);
+
+static struct k_work_q flash_q;
+static K_THREAD_STACK_DEFINE(flash_q_stack, FOTA_FLASH_STACK_SIZE);
+
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_DELTA)
+static struct delta_state patch;
+static const struct flash_area *base_fa;
+#endif
+
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_VERIFY)
+/* Hashed as buffers go to the writer. Nothing is read back. */
+static struct tc_sha256_state_struct sha;
+#endif
+
+/* Progress of this attempt */
+static struct pyrinas_cloud_ota_progress progress;
+static uint32_t start_offset;
+static int64_t start_time;
+static K_MUTEX_DEFINE(progress_mutex); /* Also guards metrics */
+
+static uint32_t fota_id(const struct pyrinas_cloud_ota_data *data, const char *path)
+{
+    uint32_t crc = crc32_ieee(data->version.raw, sizeof(data->version.raw));
+
+    crc = crc32_ieee_update(crc, data->host, strlen(data->host));
+    return crc32_ieee_update(crc, path, strlen(path));
+}
+
+/* Bytes of the download handled so far */
+static uint32_t download_pos(void)
+{
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_DELTA)
+    if (use_delta)
+        return patch.in;
+#endif
+
+    return offset + buf_len;
+}
+
+static int fota_settings_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+    const char *next;
+
+    if (settings_name_steq(name, FOTA_SETTINGS_METRICS, &next) && !next)
+    {
+        if (len != sizeof(metrics))
+            return 0;
+
+        int rc = read_cb(cb_arg, &metrics, sizeof(metrics));
+        if (rc < 0)
+            return rc;
+
+        /* Not sent before the reboot */
+        atomic_set(&metrics_pending, 1);
+        return 0;
+    }
+
+    if (!settings_name_steq(name, FOTA_SETTINGS_NAME, &next) || next)
+        return -ENOENT;
+
+    /* Layout changed. Ignore. */
+    if (len != sizeof(saved))
+        return 0;
+
+    int rc = read_cb(cb_arg, &saved, sizeof(saved));
+    if (rc < 0)
+        return rc;
+
+    /* Garbage */
+    if (saved.offset % FOTA_BUF_SIZE || (saved.size && saved.offset > saved.size))
+        memset(&saved, 0, sizeof(saved));
+
+    LOG_INF("FOTA progress %d of %d bytes", saved.offset, saved.size);
+
+    return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(pyrinas_cloud_fota, FOTA_SETTINGS_KEY, NULL, fota_settings_set, NULL, NULL);
+
+static void progress_save(void)
+{
+    k_mutex_lock(&saved_mutex, K_FOREVER);
+    int err = settings_save_one(FOTA_SETTINGS_KEY "/" FOTA_SETTINGS_NAME, &saved, sizeof(saved));
+    k_mutex_unlock(&saved_mutex);
+
+    if (err)
+        LOG_WRN("Unable to save FOTA progress. Err: %i", err);
+}
+
+/* Start over on a new image */
+static void progress_reset(uint32_t id)
+{
+    k_mutex_lock(&saved_mutex, K_FOREVER);
+    memset(&saved, 0, sizeof(saved));
+    saved.id = id;
+    progress_save();
+    k_mutex_unlock(&saved_mutex);
+}
+
+static void progress_size_set(uint32_t size)
+{
+    k_mutex_lock(&saved_mutex, K_FOREVER);
+    saved.size = size;
+    k_mutex_unlock(&saved_mutex);
+}
+
+static void progress_update(size_t total)
+{
+    uint32_t bytes = download_pos();
+    uint32_t elapsed = k_uptime_get() - start_time;
+    bool report;
+
+    k_mutex_lock(&progress_mutex, K_FOREVER);
+
+    uint8_t percent = total ? (uint64_t)bytes * 100 / total : 0;
+
+    /* Every step and the very first fragment */
+    report = progress.bytes == progress.resumed_from ||
+             percent / CONFIG_PYRINAS_CLOUD_FOTA_PROGRESS_STEP != progress.percent / CONFIG_PYRINAS_CLOUD_FOTA_PROGRESS_STEP;
+
+    progress.bytes = bytes;
+    progress.total = total;
+    progress.percent = percent;
+    progress.throughput = elapsed ? (uint64_t)(bytes - start_offset) * MSEC_PER_SEC / elapsed : 0;
+    progress.flash_throughput = metrics.flash_ms ? (uint64_t)metrics.flash_bytes * MSEC_PER_SEC / metrics.flash_ms : 0;
+
+    k_mutex_unlock(&progress_mutex);
+
+    if (report)
+        evt_handler(fota_evt_progress);
+}
+
+/* Add this attempt to the metrics */
+static void metrics_attempt_end(void)
+{
+    k_mutex_lock(&progress_mutex, K_FOREVER);
+    metrics.bytes += download_pos() - start_offset;
+    metrics.download_ms += k_uptime_get() - start_time;
+    k_mutex_unlock(&progress_mutex);
+}
+
+/* The download is over one way or the other */
+static void metrics_save(void)
+{
+    int err = settings_save_one(FOTA_SETTINGS_KEY "/" FOTA_SETTINGS_METRICS, &metrics, sizeof(metrics));
+    if (err)
+        LOG_WRN("Unable to save FOTA metrics. Err: %i", err);
+
+    atomic_set(&metrics_pending, 1);
+
+    LOG_INF("FOTA %d bytes in %d ms. Flash %d ms. Stalled %d ms.", metrics.bytes, metrics.download_ms, metrics.flash_ms,
+            metrics.stall_ms);
+}
+
+/* How close the writer came to its stack size */
+static void flash_stack_log(void)
+{
+#if defined(CONFIG_INIT_STACKS) && defined(CONFIG_THREAD_STACK_INFO)
+    size_t unused;
+
+    if (k_thread_stack_space_get(&flash_q.thread, &unused) == 0)
+        LOG_DBG("Flash writer stack %d of %d bytes unused", unused, FOTA_FLASH_STACK_SIZE);
+#endif
+}
+
+static void metrics_clear_work_fn(struct k_work *unused)
+{
+    ARG_UNUSED(unused);
+
+    settings_delete(FOTA_SETTINGS_KEY "/" FOTA_SETTINGS_METRICS);
+}
+
+/* Runs on flash_q. Each buffer starts on a page so it's erased first. */
+static void flash_work_fn(struct k_work *work)
+{
+    struct flash_job *job = CONTAINER_OF(work, struct flash_job, work);
+    size_t len = ROUND_UP(job->len, flash_area_align(fa));
+    int64_t start = k_uptime_get();
+    int err;
+
+    /* Nothing after a failed write counts */
+    if (atomic_get(&write_err))
+        goto done;
+
+    /* Padding on the last one */
+    memset(&job->data[job->len], 0xff, len - job->len);
+
+    err = flash_area_erase(fa, job->offset, FOTA_BUF_SIZE);
+    if (err == 0)
+        err = flash_area_write(fa, job->offset, job->data, len);
+
+    if (err)
+    {
+        atomic_cas(&write_err, 0, err);
+        goto done;
+    }
+
+    k_mutex_lock(&progress_mutex, K_FOREVER);
+    metrics.flash_bytes += job->len;
+    metrics.flash_ms += k_uptime_get() - start;
+    k_mutex_unlock(&progress_mutex);
+
+    uint32_t end = job->offset + job->len;
+
+    /* Only whole buffers count. A partial last one is never resumed from. */
+    k_mutex_lock(&saved_mutex, K_FOREVER);
+
+    if (end % FOTA_BUF_SIZE == 0 && end - saved.offset >= CONFIG_PYRINAS_CLOUD_FOTA_SAVE_INTERVAL)
+    {
+        saved.offset = end;
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_DELTA)
+        saved.patch = job->patch;
+#endif
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_VERIFY)
+        saved.sha = job->sha;
+#endif
+        progress_save();
+    }
+
+    k_mutex_unlock(&saved_mutex);
+
+done:
+    k_sem_give(&buf_free);
+}
+
+/* Hand the buffer to the writer and carry on in the other one */
+static int buf_flush(void)
+{
+    struct flash_job *job = &jobs[fill];
+    int64_t start = k_uptime_get();
+    int err;
+
+    if (buf_len == 0)
+        return 0;
+
+    if (offset + FOTA_BUF_SIZE > fa->fa_size)
+        return -EFBIG;
+
+    /* Still writing the other one. Flash is the slow side right now. */
+    k_sem_take(&buf_free, K_FOREVER);
+
+    k_mutex_lock(&progress_mutex, K_FOREVER);
+    metrics.stall_ms += k_uptime_get() - start;
+    k_mutex_unlock(&progress_mutex);
+
+    err = atomic_get(&write_err);
+    if (err)
+    {
+        k_sem_give(&buf_free);
+        return err;
+    }
+
+    job->len = buf_len;
+    job->offset = offset;
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_DELTA)
+    job->patch = patch;
+#endif
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_VERIFY)
+    tc_sha256_update(&sha, buf, buf_len);
+    job->sha = sha;
+#endif
+    k_work_submit_to_queue(&flash_q, &job->work);
+
+    offset += buf_len;
+    fill ^= 1;
+    buf = bufs[fill];
+    buf_len = 0;
+
+    return 0;
+}
+
+/* Wait for the writer to finish. Returns its error, if any. */
+static int buf_drain(void)
+{
+    k_sem_take(&buf_free, K_FOREVER);
+    k_sem_give(&buf_free);
+
+    return atomic_get(&write_err);
+}
+
+static int fragment_write(const uint8_t *data, size_t len)
+{
+    while (len)
+    {
+        size_t chunk = MIN(len, FOTA_BUF_SIZE - buf_len);
+
+        memcpy(&buf[buf_len], data, chunk);
+        buf_len += chunk;
+        data += chunk;
+        len -= chunk;
+
+        if (buf_len == FOTA_BUF_SIZE)
+        {
+            int err = buf_flush();
+            if (err)
+                return err;
+        }
+    }
+
+    return 0;
+}
+
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_DELTA)
+static size_t delta_op_size(uint8_t op)
+{
+    switch (op)
+    {
+    case delta_op_insert:
+        return 5;
+    case delta_op_copy:
+        return 9;
+    default:
+        return 0;
+    }
+}
+
+static int delta_header(void)
+{
+    uint32_t size = sys_get_le32(&patch.hdr[4]);
+    uint32_t base_size = sys_get_le32(&patch.hdr[8]);
+    uint32_t base_crc = sys_get_le32(&patch.hdr[12]);
+    uint32_t crc = 0;
+
+    if (memcmp(patch.hdr, DELTA_MAGIC, strlen(DELTA_MAGIC)) != 0)
+        return -EBADMSG;
+
+    if (size > fa->fa_size || base_size > base_fa->fa_size)
+        return -EBADMSG;
+
+    /* Built for some other image */
+    if (fota_data.size && size != fota_data.size)
+        return -EBADMSG;
+
+    /* The version matched. Make sure the bytes do too. Nothing is
+     * buffered yet so buf is free. */
+    for (uint32_t pos = 0; pos < base_size; pos += FOTA_BUF_SIZE)
+    {
+        size_t len = MIN(FOTA_BUF_SIZE, base_size - pos);
+
+        int err = flash_area_read(base_fa, pos, buf, len);
+        if (err)
+            return err;
+
+        crc = crc32_ieee_update(crc, buf, len);
+    }
+
+    if (crc != base_crc)
+        return -ESTALE;
+
+    progress_size_set(size);
+    patch.base_size = base_size;
+
+    return 0;
+}
+
+static int delta_op_start(void)
+{
+    patch.op = patch.hdr[0];
+    patch.remaining = sys_get_le32(&patch.hdr[1]);
+
+    if (patch.op == delta_op_copy)
+    {
+        patch.src = sys_get_le32(&patch.hdr[5]);
+
+        if (patch.src > patch.base_size || patch.remaining > patch.base_size - patch.src)
+            return -EBADMSG;
+    }
+
+    return 0;
+}
+
+/* Patch in, image out. Copies come straight from the primary slot. */
+static int delta_write(const uint8_t *data, size_t len)
+{
+    int err;
+
+    while (len || (patch.op == delta_op_copy && patch.remaining))
+    {
+        /* Never past the end of buf. A flush then always saves a state
+         * that matches what is on flash. */
+        size_t room = FOTA_BUF_SIZE - buf_len;
+
+        if (patch.remaining == 0)
+        {
+            /* The op byte tells how long the rest of its header is */
+            size_t want = patch.in < DELTA_HEADER_SIZE ? DELTA_HEADER_SIZE
+                          : patch.hdr_len              ? delta_op_size(patch.hdr[0])
+                                                       : 1;
+            size_t chunk = MIN(len, want - patch.hdr_len);
+
+            memcpy(&patch.hdr[patch.hdr_len], data, chunk);
+            patch.hdr_len += chunk;
+            patch.in += chunk;
+            data += chunk;
+            len -= chunk;
+
+            if (patch.hdr_len < want)
+                continue;
+
+            if (patch.in == DELTA_HEADER_SIZE)
+            {
+                err = delta_header();
+            }
+            else if (want == 1)
+            {
+                if (delta_op_size(patch.hdr[0]) == 0)
+                    return -EBADMSG;
+
+                continue;
+            }
+            else
+            {
+                err = delta_op_start();
+            }
+
+            if (err)
+                return err;
+
+            patch.hdr_len = 0;
+        }
+        else if (patch.op == delta_op_insert)
+        {
+            size_t chunk = MIN(MIN(len, patch.remaining), room);
+
+            patch.remaining -= chunk;
+            patch.in += chunk;
+
+            err = fragment_write(data, chunk);
+            if (err)
+                return err;
+
+            data += chunk;
+            len -= chunk;
+        }
+        else
+        {
+            size_t chunk = MIN(patch.remaining, room);
+
+            err = flash_area_read(base_fa, patch.src, &buf[buf_len], chunk);
+            if (err)
+                return err;
+
+            patch.remaining -= chunk;
+            patch.src += chunk;
+            buf_len += chunk;
+
+            if (buf_len == FOTA_BUF_SIZE)
+            {
+                err = buf_flush();
+                if (err)
+                    return err;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Full image instead. What's in the slot so far is useless. */
+static void delta_fallback(int err)
+{
+    LOG_WRN("Unable to apply delta. Err: %d. Getting the full image.", err);
+
+    buf_drain();
+    metrics_attempt_end();
+
+    use_delta = false;
+    file = fota_data.file;
+    progress_reset(fota_id(&fota_data, file));
+
+    k_delayed_work_submit_to_queue(fota_q, &retry_work, K_NO_WAIT);
+}
+#endif
+
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_VERIFY)
+/* Everything is on flash. Check it against the manifest. */
+static int image_verify(void)
+{
+    uint8_t digest[TC_SHA256_DIGEST_SIZE];
+
+    if (fota_data.size && offset != fota_data.size)
+    {
+        LOG_ERR("Image is %d bytes. Manifest says %d.", offset, fota_data.size);
+        return -EBADMSG;
+    }
+
+    if (!fota_data.has_digest)
+    {
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_ALLOW_UNVERIFIED)
+        LOG_WRN("No digest in manifest. Image not verified.");
+        return 0;
+#else
+        LOG_ERR("No digest in manifest");
+        return -EBADMSG;
+#endif
+    }
+
+    tc_sha256_final(digest, &sha);
+
+    if (memcmp(digest, fota_data.digest, sizeof(digest)) != 0)
+    {
+        LOG_ERR("Image digest mismatch");
+        return -EBADMSG;
+    }
+
+    LOG_INF("Image verified");
+
+    return 0;
+}
+#endif
+
+static int image_done(void)
+{
+    int err = buf_flush();
+    if (err == 0)
+        err = buf_drain();
+
+    if (err)
+        return err;
+
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_DELTA)
+    /* Cut off in the middle of an op */
+    if (use_delta && (patch.remaining || patch.hdr_len))
+    {
+        LOG_ERR("Delta ended early");
+        return -EIO;
+    }
+#endif
+
+    if (saved.size && offset != saved.size)
+    {
+        LOG_ERR("Image is %d bytes. Expected %d.", offset, saved.size);
+        return -EIO;
+    }
+
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_VERIFY)
+    err = image_verify();
+    if (err)
+    {
+        /* Bad image. Don't resume it next time. */
+        progress_reset(0);
+        return err;
+    }
+#endif
+
+    /* MCUboot swaps it in on the next boot */
+    err = boot_request_upgrade(BOOT_UPGRADE_TEST);
+    if (err)
+        return err;
+
+    /* Done with this one */
+    progress_reset(0);
+
+    return 0;
+}
+
+static void retry_schedule(int err)
+{
+    /* Anything not saved yet gets downloaded again */
+    buf_drain();
+    buf_len = 0;
+
+    metrics_attempt_end();
+
+    if (retries >= CONFIG_PYRINAS_CLOUD_FOTA_RETRY_MAX)
+    {
+        LOG_ERR("FOTA failed at %d of %d bytes. Err: %d", offset, saved.size, err);
+
+        metrics_save();
+        atomic_set(&busy, 0);
+        evt_handler(fota_evt_error);
+        return;
+    }
+
+    /* Backs off. Marginal links need time to come back. */
+    uint32_t delay = CONFIG_PYRINAS_CLOUD_FOTA_RETRY_DELAY_SEC << retries;
+
+    retries++;
+
+    LOG_WRN("FOTA interrupted at %d bytes. Err: %d. Retry %d in %d s.", offset, err, retries, delay);
+
+    k_delayed_work_submit_to_queue(fota_q, &retry_work, K_SECONDS(delay));
+}
+
+static int download_client_callback(const struct download_client_evt *event)
+{
+    int err;
+
+    switch (event->id)
+    {
+    case DOWNLOAD_CLIENT_EVT_FRAGMENT:
+    {
+        size_t total = 0;
+
+        /* A patch has its own idea of the image size */
+        if (download_client_file_size_get(&dlc, &total) == 0 && !use_delta && saved.size != total)
+        {
+            /* Wrong file or doesn't fit. No point downloading it. */
+            if (total > fa->fa_size || (fota_data.size && total != fota_data.size))
+            {
+                LOG_ERR("Image of %d bytes doesn't fit the slot or the manifest", total);
+                buf_drain();
+                metrics_attempt_end();
+                metrics_save();
+                atomic_set(&busy, 0);
+                evt_handler(fota_evt_error);
+                return -EFBIG;
+            }
+
+            progress_size_set(total);
+        }
+
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_DELTA)
+        if (use_delta)
+        {
+            err = delta_write(event->fragment.buf, event->fragment.len);
+
+            /* Wrong base or a broken patch. Retrying won't help. */
+            if (err == -ESTALE || err == -EBADMSG)
+            {
+                delta_fallback(err);
+                return err;
+            }
+        }
+        else
+#endif
+            err = fragment_write(event->fragment.buf, event->fragment.len);
+
+        if (err)
+        {
+            LOG_ERR("Unable to write image. Err: %d", err);
+            retry_schedule(err);
+            return err;
+        }
+
+        /* A good fragment means the link is back */
+        retries = 0;
+
+        progress_update(total);
+        return 0;
+    }
+
+    case DOWNLOAD_CLIENT_EVT_DONE:
+        download_client_disconnect(&dlc);
+
+        err = image_done();
+
+        metrics_attempt_end();
+        metrics_save();
+        flash_stack_log();
+        atomic_set(&busy, 0);
+
+        if (err)
+        {
+            LOG_ERR("Unable to finish image. Err: %d", err);
+            evt_handler(fota_evt_error);
+            return 0;
+        }
+
+        evt_handler(fota_evt_done);
+        return 0;
+
+    case DOWNLOAD_CLIENT_EVT_ERROR:
+        /* The client reconnects and continues with a range request */
+        if (event->error == -ECONNRESET)
+            return 0;
+
+        retry_schedule(event->error);
+
+        /* Stop. The retry reconnects. */
+        return event->error;
+
+    default:
+        return 0;
+    }
+}
+
+static int download_start(void)
+{
+    int sec_tag = -1;
+    int err;
+
+    /* Set the security tag if TLS is enabled. */
+#if defined(CONFIG_PYRINAS_CLOUD_HTTPS_SEC_TAG)
+    sec_tag = CONFIG_PYRINAS_CLOUD_HTTPS_SEC_TAG;
+#endif
+
+    const struct download_client_cfg config = {
+        .sec_tag = sec_tag,
+        .frag_size_override = CONFIG_PYRINAS_CLOUD_FOTA_FRAG_SIZE,
+    };
+
+    /* Resume from the last whole buffer on flash */
+    buf = bufs[fill];
+    buf_len = 0;
+    atomic_set(&write_err, 0);
+
+    k_mutex_lock(&saved_mutex, K_FOREVER);
+
+    offset = saved.offset;
+
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_DELTA)
+    patch = saved.patch;
+#endif
+
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_VERIFY)
+    /* The hash saved with the offset covers everything before it */
+    if (offset)
+        sha = saved.sha;
+    else
+        tc_sha256_init(&sha);
+#endif
+
+    k_mutex_unlock(&saved_mutex);
+
+    uint32_t from = download_pos();
+
+    k_mutex_lock(&progress_mutex, K_FOREVER);
+    progress.bytes = from;
+    progress.resumed_from = from;
+    k_mutex_unlock(&progress_mutex);
+
+    start_offset = from;
+    start_time = k_uptime_get();
+
+    err = download_client_connect(&dlc, fota_data.host, &config);
+    if (err)
+        return err;
+
+    return download_client_start(&dlc, file, from);
+}
+
+static void retry_work_fn(struct k_work *unused)
+{
+    ARG_UNUSED(unused);
+
+    /* Might still be open from the failed attempt */
+    download_client_disconnect(&dlc);
+
+    int err = download_start();
+    if (err)
+        retry_schedule(err);
+}
+
+int pyrinas_cloud_fota_start(const struct pyrinas_cloud_ota_data *data)
+{
+    int err;
+
+    if (!atomic_cas(&busy, 0, 1))
+        return -EBUSY;
+
+    if (fa == NULL)
+    {
+        err = flash_area_open(FLASH_AREA_ID(image_1), &fa);
+        if (err)
+        {
+            atomic_set(&busy, 0);
+            return err;
+        }
+    }
+
+    fota_data = *data;
+    retries = 0;
+    use_delta = false;
+    file = fota_data.file;
+
+#if defined(CONFIG_PYRINAS_CLOUD_FOTA_DELTA)
+    /* A patch only applies to the build it was made from. A full image
+     * that is already partly down wins. */
+    bool full_started = saved.id == fota_id(&fota_data, fota_data.file) && saved.offset;
+
+    if (fota_data.has_delta && !full_started &&
+        memcmp(fota_data.base.raw, pyrinas_version.raw, sizeof(pyrinas_version.raw)) == 0)
+    {
+        err = base_fa ? 0 : flash_area_open(FLASH_AREA_ID(image_0), &base_fa);
+        if (err == 0)
+        {
+            use_delta = true;
+            file = fota_data.delta_file;
+        }
+    }
+#endif
+
+    uint32_t id = fota_id(&fota_data, file);
+
+    if (saved.id == id && saved.offset)
+    {
+        LOG_INF("Resuming %s%s at %d of %d bytes", log_strdup(fota_data.host), log_strdup(file), saved.offset, saved.size);
+    }
+    else
+    {
+        /* Different image. Whatever is in the slot is useless. */
+        progress_reset(id);
+    }
+
+    k_mutex_lock(&progress_mutex, K_FOREVER);
+    memset(&progress, 0, sizeof(progress));
+    memset(&metrics, 0, sizeof(metrics));
+    k_mutex_unlock(&progress_mutex);
+
+    err = download_start();
+    if (err)
+        retry_schedule(err);
+
+    return 0;
+}
+
+int pyrinas_cloud_ota_progress_get(struct pyrinas_cloud_ota_progress *value)
+{
+    k_mutex_lock(&progress_mutex, K_FOREVER);
+    *value = progress;
+    k_mutex_unlock(&progress_mutex);
+
+    return atomic_get(&busy) ? 0 : -ENODATA;
+}
+
+int pyrinas_cloud_fota_init(struct k_work_q *task_q, pyrinas_cloud_fota_evt_handler_t handler)
+{
+    __ASSERT(task_q != NULL, "Task queue must not be NULL.");
+    __ASSERT(handler != NULL, "Handler must not be NULL.");
+
+    fota_q = task_q;
+    evt_handler = handler;
+
+    k_delayed_work_init(&retry_work, retry_work_fn);
+    k_work_init(&metrics_clear_work, metrics_clear_work_fn);
+
+    for (int i = 0; i < ARRAY_SIZE(jobs); i++)
+    {
+        jobs[i].data = bufs[i];
+        k_work_init(&jobs[i].work, flash_work_fn);
+    }
+
+    /* Flash writes overlap with the download */
+    k_work_q_start(&flash_q, flash_q_stack, K_THREAD_STACK_SIZEOF(flash_q_stack), K_LOWEST_APPLICATION_THREAD_PRIO);
+
+    int err = download_client_init(&dlc, download_client_callback);
+    if (err)
+    {
+        LOG_ERR("Unable to init download client. Err: %d", err);
+        return err;
+    }
+
+    err = settings_subsys_init();
+    if (err)
+    {
+        LOG_WRN("Unable to init settings. Err: %i", err);
+        return err;
+    }
+
+    /* Progress from before the last reboot */
+    err = settings_load_subtree(FOTA_SETTINGS_KEY);
+    if (err)
+        LOG_WRN("Unable to load FOTA progress. Err: %i", err);
+
+    return 0;
+}
+
+void pyrinas_cloud_fota_metrics_encode(QCBOREncodeContext *ec, int64_t key)
+{
+    static struct fota_metrics snapshot;
+
+    if (!atomic_cas(&metrics_pending, 1, 0))
+        return;
+
+    k_mutex_lock(&progress_mutex, K_FOREVER);
+    snapshot = metrics;
+    k_mutex_unlock(&progress_mutex);
+
+    QCBOREncode_OpenMapInMapN(ec, key);
+
+    if (snapshot.download_ms)
+        QCBOREncode_AddUInt64ToMapN(ec, fota_metrics_download_rate, (uint64_t)snapshot.bytes * MSEC_PER_SEC / snapshot.download_ms);
+
+    if (snapshot.flash_ms)
+        QCBOREncode_AddUInt64ToMapN(ec, fota_metrics_flash_rate, (uint64_t)snapshot.flash_bytes * MSEC_PER_SEC / snapshot.flash_ms);
+
+    QCBOREncode_AddUInt64ToMapN(ec, fota_metrics_bytes, snapshot.bytes);
+    QCBOREncode_AddUInt64ToMapN(ec, fota_metrics_stall, snapshot.stall_ms);
+
+    QCBOREncode_CloseMap(ec);
+
+    /* Sent once. Not again after the next reboot. */
+    k_work_submit_to_queue(fota_q, &metrics_clear_work);
+}
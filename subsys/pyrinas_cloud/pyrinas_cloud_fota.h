@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _PYRINAS_CLOUD_FOTA_H
+#define _PYRINAS_CLOUD_FOTA_H
+
+#include <zephyr.h>
+#include <qcbor/qcbor.h>
+#include <pyrinas_cloud/pyrinas_cloud.h>
+
+enum pyrinas_cloud_fota_evt
+{
+    fota_evt_progress,
+    fota_evt_done, /* Image is in the secondary slot and marked for test */
+    fota_evt_error, /* Out of retries. Progress is kept for next time. */
+};
+
+/* Keys inside the OTA metrics block */
+enum pyrinas_cloud_fota_metrics_type
+{
+    fota_metrics_download_rate, /* Bytes per second over the network */
+    fota_metrics_flash_rate,    /* Bytes per second erased and written */
+    fota_metrics_bytes,
+    fota_metrics_stall, /* ms the download waited on flash */
+};
+
+/* Outer key, map head, four keyed 32 bit values */
+#define FOTA_METRICS_ENCODED_MAX_SIZE (1 + 1 + 4 * (1 + 5))
+
+/* Called from the download client thread or task_q */
+typedef void (*pyrinas_cloud_fota_evt_handler_t)(enum pyrinas_cloud_fota_evt evt);
+
+/* Loads saved progress. Retries run on task_q. */
+int pyrinas_cloud_fota_init(struct k_work_q *task_q, pyrinas_cloud_fota_evt_handler_t handler);
+
+/* Download the image. Picks up where the last attempt at the same image
+ * left off. */
+int pyrinas_cloud_fota_start(const struct pyrinas_cloud_ota_data *data);
+
+/* Metrics of the last download as a map under key. Only added once per
+ * download, even if it ended before a reboot. */
+void pyrinas_cloud_fota_metrics_encode(QCBOREncodeContext *ec, int64_t key);
+
+#endif /* _PYRINAS_CLOUD_FOTA_H */
@@ -51,4 +51,14 @@ int ver_comp(const union pyrinas_cloud_ota_version *first, const union pyrinas_c
   {
     return 0;
   }
-}
\ No newline at end of file
+}
+
+char *str_terminate(char *buf, size_t size, const void *str, size_t len)
+{
+  len = MIN(len, size - 1);
+
+  memcpy(buf, str, len);
+  buf[len] = '\0';
+
+  return buf;
+}
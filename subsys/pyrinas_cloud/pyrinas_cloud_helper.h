@@ -11,4 +11,9 @@
 
 int ver_comp(const union pyrinas_cloud_ota_version *first, const union pyrinas_cloud_ota_version *second);
 
+/* Terminated copy of a length delimited string, truncated to fit. Topics
+ * straight out of the receive buffer aren't terminated so they can't go
+ * to log_strdup() as is. */
+char *str_terminate(char *buf, size_t size, const void *str, size_t len);
+
 #endif /* _PYRINAS_CLOUD_VERSION_H */
\ No newline at end of file
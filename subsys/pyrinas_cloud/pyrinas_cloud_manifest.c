@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <string.h>
+#include <settings/settings.h>
+#include <sys/crc.h>
+#include <app/version.h>
+
+#include "pyrinas_cloud_manifest.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(pyrinas_cloud_manifest);
+
+#define MANIFEST_SETTINGS_KEY "pyrinas/ota"
+#define MANIFEST_SETTINGS_NAME "manifest"
+
+/* Stored as is in settings */
+struct manifest_cache
+{
+    uint32_t crc;
+    uint32_t len;
+    union pyrinas_cloud_ota_version running; /* Build that checked it */
+};
+
+static struct manifest_cache cache;
+
+static void manifest_hash(const uint8_t *data, size_t len, struct manifest_cache *out)
+{
+    out->crc = crc32_ieee(data, len);
+    out->len = len;
+    out->running = pyrinas_version;
+}
+
+static int manifest_settings_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+    const char *next;
+
+    if (!settings_name_steq(name, MANIFEST_SETTINGS_NAME, &next) || next)
+        return -ENOENT;
+
+    /* Layout changed. Ignore. */
+    if (len != sizeof(cache))
+        return 0;
+
+    int rc = read_cb(cb_arg, &cache, sizeof(cache));
+    if (rc < 0)
+        return rc;
+
+    LOG_INF("Cached manifest %08x", cache.crc);
+
+    return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(pyrinas_cloud_manifest, MANIFEST_SETTINGS_KEY, NULL, manifest_settings_set, NULL, NULL);
+
+bool pyrinas_cloud_manifest_cached(const uint8_t *data, size_t len)
+{
+    struct manifest_cache incoming;
+
+    if (cache.len == 0)
+        return false;
+
+    manifest_hash(data, len, &incoming);
+
+    /* A different build may come to a different answer */
+    return memcmp(&cache, &incoming, sizeof(cache)) == 0;
+}
+
+void pyrinas_cloud_manifest_cache_store(const uint8_t *data, size_t len)
+{
+    struct manifest_cache update;
+
+    manifest_hash(data, len, &update);
+
+    /* Save flash writes when nothing changed */
+    if (memcmp(&cache, &update, sizeof(cache)) == 0)
+        return;
+
+    cache = update;
+
+    int err = settings_save_one(MANIFEST_SETTINGS_KEY "/" MANIFEST_SETTINGS_NAME, &cache, sizeof(cache));
+    if (err)
+        LOG_WRN("Unable to save manifest. Err: %i", err);
+}
+
+void pyrinas_cloud_manifest_cache_init(void)
+{
+    int err = settings_subsys_init();
+    if (err)
+    {
+        LOG_WRN("Unable to init settings. Err: %i", err);
+        return;
+    }
+
+    err = settings_load_subtree(MANIFEST_SETTINGS_KEY);
+    if (err)
+        LOG_WRN("Unable to load manifest. Err: %i", err);
+}
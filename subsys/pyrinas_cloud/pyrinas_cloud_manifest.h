@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _PYRINAS_CLOUD_MANIFEST_H
+#define _PYRINAS_CLOUD_MANIFEST_H
+
+#include <zephyr.h>
+
+/* Loads the manifest seen on the last boot */
+void pyrinas_cloud_manifest_cache_init(void);
+
+/* Same manifest as the last one found to need no update, on the same build */
+bool pyrinas_cloud_manifest_cached(const uint8_t *data, size_t len);
+
+/* Manifest needed no update. Skip it next time. */
+void pyrinas_cloud_manifest_cache_store(const uint8_t *data, size_t len);
+
+#endif /* _PYRINAS_CLOUD_MANIFEST_H */
@@ -0,0 +1,469 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <string.h>
+#include <fs/fs.h>
+
+#include "pyrinas_cloud_outbox.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(pyrinas_cloud_outbox);
+
+/* "PCOB" */
+#define OUTBOX_MAGIC 0x50434f42
+#define OUTBOX_COPY_CHUNK_SIZE 64
+
+/* Stored at the start of the file. Head is the offset of the oldest record. */
+struct outbox_header
+{
+    uint32_t magic;
+    uint32_t head;
+};
+
+/* Prepended to every record. Topic and data follow directly after. */
+struct outbox_record
+{
+    uint16_t topic_len;
+    uint16_t data_len;
+};
+
+#define OUTBOX_DATA_START sizeof(struct outbox_header)
+
+BUILD_ASSERT(CONFIG_PYRINAS_CLOUD_OUTBOX_SIZE >= CONFIG_PYRINAS_CLOUD_OUTBOX_RECORD_MAX_SIZE + sizeof(struct outbox_record),
+             "Outbox must be able to hold at least one record");
+
+/* Tokens are the window generation and the index in the window */
+#define OUTBOX_WINDOW_SIZE CONFIG_PYRINAS_CLOUD_OUTBOX_DRAIN_BATCH_COUNT
+#define OUTBOX_TOKEN(gen, idx) (((gen) << 8) | (idx))
+#define OUTBOX_TOKEN_IDX(token) ((token)&0xff)
+
+BUILD_ASSERT(OUTBOX_WINDOW_SIZE <= 256, "Window index is 8 bit");
+
+/* File state */
+static struct fs_file_t outbox_file;
+static struct outbox_header header;
+static size_t outbox_end;
+static bool outbox_ready;
+static bool header_dirty; /* head moved since the header was saved */
+
+/* Records from head on that went out and aren't done yet. head only
+ * moves over the ones at the front that were delivered. */
+static struct
+{
+    uint32_t gen;
+    size_t count;
+    size_t start;
+    uint16_t len[OUTBOX_WINDOW_SIZE];
+    bool done[OUTBOX_WINDOW_SIZE];
+} window;
+
+/* Publishes can come from many contexts */
+static K_MUTEX_DEFINE(outbox_mutex);
+
+/* Scratch for reading back records. Extra byte to null terminate the topic. */
+static uint8_t record_buf[CONFIG_PYRINAS_CLOUD_OUTBOX_RECORD_MAX_SIZE + 1];
+
+static int outbox_read_at(off_t offset, void *buf, size_t len)
+{
+    int err = fs_seek(&outbox_file, offset, FS_SEEK_SET);
+    if (err)
+        return err;
+
+    ssize_t ret = fs_read(&outbox_file, buf, len);
+    if (ret < 0)
+        return ret;
+
+    return ret == len ? 0 : -EIO;
+}
+
+static int outbox_write_at(off_t offset, const void *buf, size_t len)
+{
+    int err = fs_seek(&outbox_file, offset, FS_SEEK_SET);
+    if (err)
+        return err;
+
+    ssize_t ret = fs_write(&outbox_file, buf, len);
+    if (ret < 0)
+        return ret;
+
+    return ret == len ? 0 : -EIO;
+}
+
+/* Whatever is still out is sent again from head. Done for anything
+ * that moves records around. */
+static void window_reset(void)
+{
+    window.gen++;
+    window.count = 0;
+    window.start = 0;
+    memset(window.done, 0, sizeof(window.done));
+}
+
+static int outbox_header_save(void)
+{
+    int err = outbox_write_at(0, &header, sizeof(header));
+    if (err)
+        return err;
+
+    header_dirty = false;
+
+    return fs_sync(&outbox_file);
+}
+
+/* Throw everything away and start with an empty file */
+static int outbox_reset(void)
+{
+    int err = fs_truncate(&outbox_file, 0);
+    if (err)
+        return err;
+
+    window_reset();
+
+    header.magic = OUTBOX_MAGIC;
+    header.head = OUTBOX_DATA_START;
+    outbox_end = OUTBOX_DATA_START;
+
+    return outbox_header_save();
+}
+
+static int outbox_drop_oldest(void)
+{
+    struct outbox_record rec;
+
+    int err = outbox_read_at(header.head, &rec, sizeof(rec));
+    if (err)
+        return err;
+
+    window_reset();
+
+    header.head += sizeof(rec) + rec.topic_len + rec.data_len;
+
+    /* Something is off. Start over. */
+    if (header.head > outbox_end)
+    {
+        LOG_ERR("Outbox corrupted. Resetting.");
+        return outbox_reset();
+    }
+
+    return 0;
+}
+
+/* Move live records to the start of the file. Only called when the dead
+ * region is at least as large as the live one so the source is never
+ * overwritten before the header points at the new location. */
+static int outbox_compact(void)
+{
+    uint8_t chunk[OUTBOX_COPY_CHUNK_SIZE];
+    size_t live = outbox_end - header.head;
+    int err;
+
+    for (size_t pos = 0; pos < live; pos += sizeof(chunk))
+    {
+        size_t len = MIN(sizeof(chunk), live - pos);
+
+        err = outbox_read_at(header.head + pos, chunk, len);
+        if (err)
+            return err;
+
+        err = outbox_write_at(OUTBOX_DATA_START + pos, chunk, len);
+        if (err)
+            return err;
+    }
+
+    window_reset();
+
+    header.head = OUTBOX_DATA_START;
+    outbox_end = OUTBOX_DATA_START + live;
+
+    /* Header first. A loss before truncating only results in duplicates. */
+    err = outbox_header_save();
+    if (err)
+        return err;
+
+    return fs_truncate(&outbox_file, outbox_end);
+}
+
+int pyrinas_cloud_outbox_init(void)
+{
+    struct fs_dirent entry;
+    int err;
+
+    k_mutex_lock(&outbox_mutex, K_FOREVER);
+
+    err = fs_open(&outbox_file, CONFIG_PYRINAS_CLOUD_OUTBOX_PATH);
+    if (err)
+    {
+        LOG_ERR("Unable to open %s. Err: %i", CONFIG_PYRINAS_CLOUD_OUTBOX_PATH, err);
+        goto done;
+    }
+
+    err = fs_stat(CONFIG_PYRINAS_CLOUD_OUTBOX_PATH, &entry);
+    if (err)
+    {
+        LOG_ERR("Unable to stat outbox. Err: %i", err);
+        goto done;
+    }
+
+    outbox_end = entry.size;
+
+    /* Re-use existing contents if the header checks out */
+    if (outbox_end < OUTBOX_DATA_START ||
+        outbox_read_at(0, &header, sizeof(header)) != 0 ||
+        header.magic != OUTBOX_MAGIC ||
+        header.head < OUTBOX_DATA_START ||
+        header.head > outbox_end)
+    {
+        err = outbox_reset();
+        if (err)
+        {
+            LOG_ERR("Unable to reset outbox. Err: %i", err);
+            goto done;
+        }
+    }
+
+    outbox_ready = true;
+
+    LOG_INF("Outbox: %d bytes pending", outbox_end - header.head);
+
+done:
+    k_mutex_unlock(&outbox_mutex);
+
+    return err;
+}
+
+int pyrinas_cloud_outbox_put(const uint8_t *topic, size_t topic_len, const uint8_t *data, size_t data_len)
+{
+    struct outbox_record rec = {
+        .topic_len = topic_len,
+        .data_len = data_len};
+    size_t rec_len = sizeof(rec) + topic_len + data_len;
+    size_t dropped = 0;
+    int err = 0;
+
+    /* Has to fit in the read back buffer */
+    if (topic_len + data_len > CONFIG_PYRINAS_CLOUD_OUTBOX_RECORD_MAX_SIZE)
+        return -EMSGSIZE;
+
+    k_mutex_lock(&outbox_mutex, K_FOREVER);
+
+    if (!outbox_ready)
+    {
+        err = -ENODEV;
+        goto done;
+    }
+
+    /* Drop oldest entries until the new one fits in the budget */
+    while (outbox_end - header.head + rec_len > CONFIG_PYRINAS_CLOUD_OUTBOX_SIZE)
+    {
+        err = outbox_drop_oldest();
+        if (err)
+            goto done;
+
+        header_dirty = true;
+        dropped++;
+    }
+
+    if (dropped)
+        LOG_WRN("Outbox full. Dropped %d oldest entries.", dropped);
+
+    /* Reclaim space before growing the file */
+    size_t dead = header.head - OUTBOX_DATA_START;
+    size_t live = outbox_end - header.head;
+
+    /* Both save the header */
+    if (live == 0 && dead)
+        err = outbox_reset();
+    else if (dead >= live && dead >= CONFIG_PYRINAS_CLOUD_OUTBOX_SIZE / 2)
+        err = outbox_compact();
+
+    if (err)
+        goto done;
+
+    /* Append */
+    err = outbox_write_at(outbox_end, &rec, sizeof(rec));
+    if (err)
+        goto done;
+
+    err = fs_write(&outbox_file, topic, topic_len);
+    if (err != topic_len)
+    {
+        err = err < 0 ? err : -EIO;
+        goto done;
+    }
+
+    err = fs_write(&outbox_file, data, data_len);
+    if (err != data_len)
+    {
+        err = err < 0 ? err : -EIO;
+        goto done;
+    }
+
+    outbox_end += rec_len;
+
+    if (header_dirty)
+        err = outbox_header_save();
+    else
+        err = fs_sync(&outbox_file);
+
+    LOG_DBG("Stored %d bytes. %d pending.", rec_len, outbox_end - header.head);
+
+done:
+    k_mutex_unlock(&outbox_mutex);
+
+    return err;
+}
+
+int pyrinas_cloud_outbox_drain(pyrinas_cloud_outbox_publish_t publish, size_t max_count, size_t max_bytes)
+{
+    struct outbox_record rec;
+    size_t pos;
+    size_t bytes = 0;
+    int count = 0;
+    int err = 0;
+
+    max_count = MIN(max_count, OUTBOX_WINDOW_SIZE);
+
+    k_mutex_lock(&outbox_mutex, K_FOREVER);
+
+    if (!outbox_ready)
+    {
+        err = -ENODEV;
+        goto done;
+    }
+
+    /* Delivered since the last drain */
+    if (header_dirty)
+    {
+        if (header.head == outbox_end)
+            err = outbox_reset();
+        else
+            err = outbox_header_save();
+
+        if (err)
+            goto done;
+
+        LOG_INF("Outbox delivered. %d bytes pending.", outbox_end - header.head);
+    }
+
+    /* One batch at a time. The next one goes once it's all delivered. */
+    if (window.count)
+        goto done;
+
+    pos = header.head;
+
+    while (pos < outbox_end && count < max_count)
+    {
+        err = outbox_read_at(pos, &rec, sizeof(rec));
+        if (err)
+            break;
+
+        size_t rec_len = sizeof(rec) + rec.topic_len + rec.data_len;
+
+        /* Sanity check before reading into the static buffer */
+        if (rec.topic_len + rec.data_len > CONFIG_PYRINAS_CLOUD_OUTBOX_RECORD_MAX_SIZE ||
+            pos + rec_len > outbox_end)
+        {
+            LOG_ERR("Outbox corrupted. Resetting.");
+            err = outbox_reset();
+            goto done;
+        }
+
+        /* Always let at least one through */
+        if (count && bytes + rec.data_len > max_bytes)
+            break;
+
+        /* Topic, terminator, then data */
+        err = outbox_read_at(pos + sizeof(rec), record_buf, rec.topic_len);
+        if (err)
+            break;
+
+        record_buf[rec.topic_len] = '\0';
+
+        err = fs_read(&outbox_file, record_buf + rec.topic_len + 1, rec.data_len);
+        if (err != rec.data_len)
+        {
+            err = err < 0 ? err : -EIO;
+            break;
+        }
+
+        /* Completions wait on the lock so the slot can be filled in first */
+        window.len[count] = rec_len;
+        window.done[count] = false;
+
+        /* Leave it in place if it can't go out now */
+        err = publish(record_buf, rec.topic_len, record_buf + rec.topic_len + 1, rec.data_len,
+                      OUTBOX_TOKEN(window.gen, count));
+        if (err)
+            break;
+
+        pos += rec_len;
+        bytes += rec.data_len;
+        count++;
+        window.count = count;
+    }
+
+    if (count)
+        LOG_INF("Outbox sending %d entries. %d bytes pending.", count, outbox_end - header.head);
+
+done:
+    k_mutex_unlock(&outbox_mutex);
+
+    return (err && count == 0) ? err : count;
+}
+
+bool pyrinas_cloud_outbox_sent(uint32_t token, int result)
+{
+    bool finished = false;
+
+    k_mutex_lock(&outbox_mutex, K_FOREVER);
+
+    size_t idx = OUTBOX_TOKEN_IDX(token);
+
+    /* From before the records moved. Sent again already. */
+    if (idx >= window.count || token != OUTBOX_TOKEN(window.gen, idx))
+        goto done;
+
+    if (result)
+    {
+        /* Kept where it is. Goes again with the next drain. */
+        LOG_WRN("Stored publish not delivered. Err: %i", result);
+        window_reset();
+        goto done;
+    }
+
+    window.done[idx] = true;
+
+    /* In order. Anything delivered behind an open one waits for it. */
+    while (window.start < window.count && window.done[window.start])
+    {
+        header.head += window.len[window.start];
+        header_dirty = true;
+        window.start++;
+    }
+
+    if (window.start == window.count)
+    {
+        window_reset();
+        finished = true;
+    }
+
+done:
+    k_mutex_unlock(&outbox_mutex);
+
+    return finished;
+}
+
+bool pyrinas_cloud_outbox_is_empty(void)
+{
+    bool empty;
+
+    k_mutex_lock(&outbox_mutex, K_FOREVER);
+    empty = !outbox_ready || header.head == outbox_end;
+    k_mutex_unlock(&outbox_mutex);
+
+    return empty;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _PYRINAS_CLOUD_OUTBOX_H
+#define _PYRINAS_CLOUD_OUTBOX_H
+
+#include <zephyr.h>
+
+/* Used to hand stored records back to the cloud for publishing. token
+ * goes back to pyrinas_cloud_outbox_sent() once the publish is done. */
+typedef int (*pyrinas_cloud_outbox_publish_t)(const uint8_t *topic, size_t topic_len, const uint8_t *data, size_t data_len,
+                                              uint32_t token);
+
+/* Open (or create) the outbox file. Requires the file system to be mounted. */
+int pyrinas_cloud_outbox_init(void);
+
+/* Append a publish. Oldest entries are dropped to stay within the byte budget. */
+int pyrinas_cloud_outbox_put(const uint8_t *topic, size_t topic_len, const uint8_t *data, size_t data_len);
+
+/* Publish up to max_count entries / max_bytes of payload. Nothing new
+ * goes out until the last batch is done. Returns number published or error. */
+int pyrinas_cloud_outbox_drain(pyrinas_cloud_outbox_publish_t publish, size_t max_count, size_t max_bytes);
+
+/* A drained entry was delivered (result 0) or not. Entries are only
+ * removed once delivered, in order. A failure sends everything not yet
+ * removed again with the next drain. Returns true once the whole batch
+ * is delivered. The next drain saves that and sends more. */
+bool pyrinas_cloud_outbox_sent(uint32_t token, int result);
+
+/* Returns true if there is nothing stored */
+bool pyrinas_cloud_outbox_is_empty(void);
+
+#endif /* _PYRINAS_CLOUD_OUTBOX_H */
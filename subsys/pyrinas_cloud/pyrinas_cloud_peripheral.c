@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/util.h>
+
+#include "pyrinas_cloud_peripheral.h"
+
+#if defined(CONFIG_PYRINAS_CLOUD_DOWNLINK)
+#include "pyrinas_cloud_downlink.h"
+#endif
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(pyrinas_cloud_peripheral);
+
+BUILD_ASSERT(PERIPHERAL_ADDR_LEN * 2 == PERIPHERAL_UID_LEN, "uid is the hex address");
+
+static struct pyrinas_cloud_peripheral entries[CONFIG_PYRINAS_CLOUD_PERIPHERAL_COUNT];
+
+static K_MUTEX_DEFINE(peripheral_mutex);
+
+static void topics_format(const uint8_t *addr, struct pyrinas_cloud_peripheral_topics *topics)
+{
+    char uid[PERIPHERAL_UID_LEN + 1];
+
+    snprintf(uid, sizeof(uid), "%02x%02x%02x%02x%02x%02x",
+             addr[0], addr[1], addr[2], addr[3], addr[4], addr[5]);
+
+    /* Event name goes last so it's left off */
+    topics->app_prefix_len = snprintf(topics->app_prefix, sizeof(topics->app_prefix),
+                                      CONFIG_PYRINAS_CLOUD_MQTT_APPLICATION_PUB_TOPIC,
+                                      PERIPHERAL_UID_LEN, uid, 0, "");
+    topics->app_prefix_len = MIN(topics->app_prefix_len, sizeof(topics->app_prefix) - 1);
+
+#if defined(CONFIG_PYRINAS_CLOUD_BATCH)
+    topics->batch_prefix_len = snprintf(topics->batch_prefix, sizeof(topics->batch_prefix),
+                                        CONFIG_PYRINAS_CLOUD_MQTT_APPLICATION_BATCH_PUB_TOPIC,
+                                        PERIPHERAL_UID_LEN, uid, 0, "");
+    topics->batch_prefix_len = MIN(topics->batch_prefix_len, sizeof(topics->batch_prefix) - 1);
+#endif
+
+    topics->telemetry_len = snprintf(topics->telemetry, sizeof(topics->telemetry),
+                                     CONFIG_PYRINAS_CLOUD_MQTT_TELEMETRY_PUB_TOPIC,
+                                     PERIPHERAL_UID_LEN, uid);
+    topics->telemetry_len = MIN(topics->telemetry_len, sizeof(topics->telemetry) - 1);
+}
+
+void pyrinas_cloud_peripheral_lock(void)
+{
+    k_mutex_lock(&peripheral_mutex, K_FOREVER);
+}
+
+void pyrinas_cloud_peripheral_unlock(void)
+{
+    k_mutex_unlock(&peripheral_mutex);
+}
+
+/* Entries that can't be replaced by a new peripheral */
+static bool entry_pinned(const struct pyrinas_cloud_peripheral *entry)
+{
+    if (entry->registered || entry->connected)
+        return true;
+
+#if defined(CONFIG_PYRINAS_CLOUD_DOWNLINK)
+    if (entry->downlink.count || entry->downlink.sending)
+        return true;
+#endif
+
+    return false;
+}
+
+static struct pyrinas_cloud_peripheral *entry_add(const uint8_t *addr)
+{
+    struct pyrinas_cloud_peripheral *oldest = NULL;
+
+    for (int i = 0; i < ARRAY_SIZE(entries); i++)
+    {
+        struct pyrinas_cloud_peripheral *entry = &entries[i];
+
+        if (!entry->in_use)
+        {
+            oldest = entry;
+            break;
+        }
+
+        if (!entry_pinned(entry) && (oldest == NULL || entry->last_seen < oldest->last_seen))
+            oldest = entry;
+    }
+
+    if (oldest == NULL)
+        return NULL;
+
+    memset(oldest, 0, sizeof(*oldest));
+    memcpy(oldest->addr, addr, PERIPHERAL_ADDR_LEN);
+    oldest->in_use = true;
+
+    topics_format(addr, &oldest->topics);
+
+    return oldest;
+}
+
+struct pyrinas_cloud_peripheral *pyrinas_cloud_peripheral_get(const uint8_t *addr, bool add)
+{
+    for (int i = 0; i < ARRAY_SIZE(entries); i++)
+    {
+        if (entries[i].in_use && memcmp(entries[i].addr, addr, PERIPHERAL_ADDR_LEN) == 0)
+            return &entries[i];
+    }
+
+    return add ? entry_add(addr) : NULL;
+}
+
+struct pyrinas_cloud_peripheral *pyrinas_cloud_peripheral_at(size_t index)
+{
+    if (index >= ARRAY_SIZE(entries) || !entries[index].in_use)
+        return NULL;
+
+    return &entries[index];
+}
+
+void pyrinas_cloud_peripheral_seen(const uint8_t *addr, size_t data_len, struct pyrinas_cloud_peripheral_topics *topics)
+{
+    k_mutex_lock(&peripheral_mutex, K_FOREVER);
+
+    struct pyrinas_cloud_peripheral *entry = pyrinas_cloud_peripheral_get(addr, true);
+
+    if (entry)
+    {
+        entry->events++;
+        entry->bytes += data_len;
+        entry->last_seen = k_uptime_get();
+
+        *topics = entry->topics;
+    }
+
+    k_mutex_unlock(&peripheral_mutex);
+
+    /* Table is full of registered or connected peripherals */
+    if (entry == NULL)
+        topics_format(addr, topics);
+}
+
+void pyrinas_cloud_peripheral_error(const uint8_t *addr)
+{
+    k_mutex_lock(&peripheral_mutex, K_FOREVER);
+
+    struct pyrinas_cloud_peripheral *entry = pyrinas_cloud_peripheral_get(addr, false);
+
+    if (entry)
+        entry->errors++;
+
+    k_mutex_unlock(&peripheral_mutex);
+}
+
+size_t pyrinas_cloud_peripheral_topic(const char *prefix, size_t prefix_len, const uint8_t *name, size_t name_len,
+                                      char *topic, size_t size)
+{
+    size_t len = MIN(prefix_len, size - 1);
+
+    memcpy(topic, prefix, len);
+
+    name_len = strnlen((const char *)name, MIN(name_len, size - 1 - len));
+    memcpy(&topic[len], name, name_len);
+    len += name_len;
+
+    topic[len] = '\0';
+
+    return len;
+}
+
+static void connected_set(const uint8_t *addr, bool connected)
+{
+    k_mutex_lock(&peripheral_mutex, K_FOREVER);
+
+    struct pyrinas_cloud_peripheral *entry = pyrinas_cloud_peripheral_get(addr, connected);
+
+    if (entry)
+    {
+        entry->connected = connected;
+        entry->last_seen = k_uptime_get();
+    }
+
+    k_mutex_unlock(&peripheral_mutex);
+}
+
+void pyrinas_cloud_peripheral_connected(const uint8_t *peripheral_addr)
+{
+    connected_set(peripheral_addr, true);
+
+    /* Coming back is as interesting as going away */
+    pyrinas_cloud_telemetry_anomaly();
+
+#if defined(CONFIG_PYRINAS_CLOUD_DOWNLINK)
+    pyrinas_cloud_downlink_flush(peripheral_addr);
+#endif
+}
+
+void pyrinas_cloud_peripheral_disconnected(const uint8_t *peripheral_addr)
+{
+    connected_set(peripheral_addr, false);
+    pyrinas_cloud_telemetry_anomaly();
+}
+
+static int uid_parse(const char *uid, uint8_t *addr)
+{
+    if (uid == NULL || strlen(uid) != PERIPHERAL_UID_LEN)
+        return -EINVAL;
+
+    if (hex2bin(uid, PERIPHERAL_UID_LEN, addr, PERIPHERAL_ADDR_LEN) != PERIPHERAL_ADDR_LEN)
+        return -EINVAL;
+
+    return 0;
+}
+
+int pyrinas_cloud_register_uid(char *uid)
+{
+    uint8_t addr[PERIPHERAL_ADDR_LEN];
+    int err = uid_parse(uid, addr);
+
+    if (err)
+        return err;
+
+    k_mutex_lock(&peripheral_mutex, K_FOREVER);
+
+    struct pyrinas_cloud_peripheral *entry = pyrinas_cloud_peripheral_get(addr, true);
+
+    if (entry)
+        entry->registered = true;
+
+    k_mutex_unlock(&peripheral_mutex);
+
+    if (entry == NULL)
+    {
+        LOG_WRN("No room to register %s", log_strdup(uid));
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+int pyrinas_cloud_unregister_uid(char *uid)
+{
+    uint8_t addr[PERIPHERAL_ADDR_LEN];
+    int err = uid_parse(uid, addr);
+
+    if (err)
+        return err;
+
+    k_mutex_lock(&peripheral_mutex, K_FOREVER);
+
+    struct pyrinas_cloud_peripheral *entry = pyrinas_cloud_peripheral_get(addr, false);
+
+    /* Up for replacement like any other */
+    if (entry)
+        entry->registered = false;
+
+    k_mutex_unlock(&peripheral_mutex);
+
+    return entry ? 0 : -ENOENT;
+}
+
+int pyrinas_cloud_peripheral_info_get(const uint8_t *addr, struct pyrinas_cloud_peripheral_info *info)
+{
+    k_mutex_lock(&peripheral_mutex, K_FOREVER);
+
+    struct pyrinas_cloud_peripheral *entry = pyrinas_cloud_peripheral_get(addr, false);
+
+    if (entry)
+    {
+        memcpy(info->addr, entry->addr, sizeof(info->addr));
+        info->registered = entry->registered;
+        info->connected = entry->connected;
+        info->events = entry->events;
+        info->bytes = entry->bytes;
+        info->errors = entry->errors;
+        info->last_seen = entry->last_seen;
+    }
+
+    k_mutex_unlock(&peripheral_mutex);
+
+    return entry ? 0 : -ENOENT;
+}
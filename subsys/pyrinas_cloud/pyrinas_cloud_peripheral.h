@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _PYRINAS_CLOUD_PERIPHERAL_H
+#define _PYRINAS_CLOUD_PERIPHERAL_H
+
+#include <zephyr.h>
+#include <pyrinas_cloud/pyrinas_cloud.h>
+
+#if defined(CONFIG_PYRINAS_CLOUD_STATS)
+#include "pyrinas_cloud_stats.h"
+#endif
+
+#if defined(CONFIG_PYRINAS_CLOUD_DOWNLINK)
+#include "pyrinas_cloud_downlink.h"
+#endif
+
+#define PERIPHERAL_ADDR_LEN sizeof(((pyrinas_event_t *)0)->peripheral_addr)
+
+/* 6 byte address as hex */
+#define PERIPHERAL_UID_LEN 12
+
+/* Topics for one peripheral. Event topics are the prefix plus the event name. */
+struct pyrinas_cloud_peripheral_topics
+{
+    char app_prefix[sizeof(CONFIG_PYRINAS_CLOUD_MQTT_APPLICATION_PUB_TOPIC) + PERIPHERAL_UID_LEN];
+    size_t app_prefix_len;
+#if defined(CONFIG_PYRINAS_CLOUD_BATCH)
+    char batch_prefix[sizeof(CONFIG_PYRINAS_CLOUD_MQTT_APPLICATION_BATCH_PUB_TOPIC) + PERIPHERAL_UID_LEN];
+    size_t batch_prefix_len;
+#endif
+    char telemetry[sizeof(CONFIG_PYRINAS_CLOUD_MQTT_TELEMETRY_PUB_TOPIC) + PERIPHERAL_UID_LEN];
+    size_t telemetry_len;
+};
+
+/* One per peripheral. Every module keeps its per-peripheral state here. */
+struct pyrinas_cloud_peripheral
+{
+    bool in_use;
+    bool registered;
+    bool connected;
+    uint8_t addr[PERIPHERAL_ADDR_LEN];
+    uint32_t events;
+    uint32_t bytes;
+    uint32_t errors;
+    int64_t last_seen;
+
+    /* Formatted once when the entry is added */
+    struct pyrinas_cloud_peripheral_topics topics;
+
+#if defined(CONFIG_PYRINAS_CLOUD_STATS)
+    struct pyrinas_cloud_stats_peripheral stats;
+#endif
+
+#if defined(CONFIG_PYRINAS_CLOUD_DOWNLINK)
+    struct pyrinas_cloud_downlink_queue downlink;
+#endif
+};
+
+/* Entries may only be touched between these. Events come from the BLE
+ * context, routing from the cloud thread, registration from the application. */
+void pyrinas_cloud_peripheral_lock(void);
+void pyrinas_cloud_peripheral_unlock(void);
+
+/* Entry for addr. With add an unknown peripheral takes the slot of the least
+ * recently seen one that isn't registered, connected or holding downlinks.
+ * NULL if there's none. Lock must be held. */
+struct pyrinas_cloud_peripheral *pyrinas_cloud_peripheral_get(const uint8_t *addr, bool add);
+
+/* Entry at index or NULL if it's unused. index is below
+ * CONFIG_PYRINAS_CLOUD_PERIPHERAL_COUNT. Lock must be held. */
+struct pyrinas_cloud_peripheral *pyrinas_cloud_peripheral_at(size_t index);
+
+/* Count an event of data_len bytes and copy out the topics. Unknown
+ * peripherals take the slot of the least recently seen unregistered one. */
+void pyrinas_cloud_peripheral_seen(const uint8_t *addr, size_t data_len, struct pyrinas_cloud_peripheral_topics *topics);
+
+/* A publish for this peripheral failed */
+void pyrinas_cloud_peripheral_error(const uint8_t *addr);
+
+/* prefix + name into topic. name stops at its terminator, if any. Returns the topic length. */
+size_t pyrinas_cloud_peripheral_topic(const char *prefix, size_t prefix_len, const uint8_t *name, size_t name_len,
+                                      char *topic, size_t size);
+
+#endif /* _PYRINAS_CLOUD_PERIPHERAL_H */
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <random/rand32.h>
+#include <cellular/cellular.h>
+#include <pyrinas_cloud/pyrinas_cloud.h>
+#include <pyrinas_cloud/pyrinas_cloud_reconnect.h>
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(pyrinas_cloud_reconnect);
+
+/* Stop doubling once we pass the cap anyway */
+#define RECONNECT_STEP_MAX 16
+
+static struct k_work_q *reconnect_q;
+static struct k_delayed_work reconnect_work;
+
+/* Work queue, cloud state and LTE events all end up in here */
+static K_MUTEX_DEFINE(reconnect_mutex);
+static struct pyrinas_cloud_reconnect_stats stats;
+static uint32_t step;
+static bool waiting_for_lte;
+static bool active;
+static int64_t connected_time;
+
+/* Random value in [0, range) */
+static uint32_t rand_range(uint32_t range)
+{
+    if (range == 0)
+        return 0;
+
+    return sys_rand32_get() % range;
+}
+
+/* Exponential backoff with the top JITTER_PERCENT randomized */
+static uint32_t backoff_delay_ms(void)
+{
+    uint32_t delay = CONFIG_PYRINAS_CLOUD_RECONNECT_BASE_MS;
+
+    for (uint32_t i = 0; i < step && delay < CONFIG_PYRINAS_CLOUD_RECONNECT_MAX_MS; i++)
+        delay *= 2;
+
+    delay = MIN(delay, CONFIG_PYRINAS_CLOUD_RECONNECT_MAX_MS);
+
+    uint32_t jitter = delay / 100 * CONFIG_PYRINAS_CLOUD_RECONNECT_JITTER_PERCENT;
+
+    return delay - jitter + rand_range(jitter + 1);
+}
+
+/* Must be called with reconnect_mutex held */
+static void attempt_schedule(uint32_t delay_ms)
+{
+    stats.next_delay_ms = delay_ms;
+
+    LOG_INF("Reconnecting in %d ms", delay_ms);
+
+    k_delayed_work_submit_to_queue(reconnect_q, &reconnect_work, K_MSEC(delay_ms));
+}
+
+static void reconnect_work_fn(struct k_work *item)
+{
+    k_mutex_lock(&reconnect_mutex, K_FOREVER);
+
+    /* Network went away in the mean time */
+    if (!cellular_is_registered())
+    {
+        waiting_for_lte = true;
+        stats.deferred++;
+        goto done;
+    }
+
+    stats.attempts++;
+
+    k_mutex_unlock(&reconnect_mutex);
+
+    /* Not under the lock. Connecting blocks and LTE events
+     * come from the AT command context. */
+    int err = pyrinas_cloud_connect();
+
+    k_mutex_lock(&reconnect_mutex, K_FOREVER);
+
+    if (err == 0 || err == -EINPROGRESS)
+    {
+        stats.successes++;
+        stats.consecutive_failures = 0;
+        connected_time = k_uptime_get();
+        active = false;
+        goto done;
+    }
+
+    LOG_WRN("Unable to re-connect. Err: %d", err);
+
+    stats.failures++;
+    stats.consecutive_failures++;
+
+    if (step < RECONNECT_STEP_MAX)
+        step++;
+
+    attempt_schedule(backoff_delay_ms());
+
+done:
+    k_mutex_unlock(&reconnect_mutex);
+}
+
+static void cellular_reg_evt(bool registered)
+{
+    k_mutex_lock(&reconnect_mutex, K_FOREVER);
+
+    if (!active)
+        goto done;
+
+    if (!registered)
+    {
+        /* No point trying until we're back */
+        LOG_INF("LTE lost. Holding reconnect.");
+        k_delayed_work_cancel(&reconnect_work);
+        waiting_for_lte = true;
+        stats.deferred++;
+    }
+    else if (waiting_for_lte)
+    {
+        /* Whole cell comes back at once. Spread out the attempts. */
+        waiting_for_lte = false;
+        attempt_schedule(rand_range(CONFIG_PYRINAS_CLOUD_RECONNECT_BASE_MS));
+    }
+
+done:
+    k_mutex_unlock(&reconnect_mutex);
+}
+
+void pyrinas_cloud_reconnect_start(void)
+{
+    k_mutex_lock(&reconnect_mutex, K_FOREVER);
+
+    /* Don't reset the backoff for connections that didn't stick */
+    if (k_uptime_get() - connected_time >= CONFIG_PYRINAS_CLOUD_RECONNECT_STABLE_SEC * MSEC_PER_SEC)
+        step = 0;
+
+    active = true;
+
+    if (!cellular_is_registered())
+    {
+        LOG_INF("Waiting for LTE to reconnect");
+        waiting_for_lte = true;
+        stats.deferred++;
+    }
+    else
+    {
+        waiting_for_lte = false;
+        attempt_schedule(backoff_delay_ms());
+    }
+
+    k_mutex_unlock(&reconnect_mutex);
+}
+
+void pyrinas_cloud_reconnect_get_stats(struct pyrinas_cloud_reconnect_stats *out)
+{
+    k_mutex_lock(&reconnect_mutex, K_FOREVER);
+    *out = stats;
+    k_mutex_unlock(&reconnect_mutex);
+}
+
+void pyrinas_cloud_reconnect_init(struct k_work_q *task_q)
+{
+    __ASSERT(task_q != NULL, "Task queue must not be NULL.");
+
+    reconnect_q = task_q;
+
+    k_delayed_work_init(&reconnect_work, reconnect_work_fn);
+
+    /* Follow the network */
+    cellular_register_reg_evt(cellular_reg_evt);
+}
@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <string.h>
+#include <net/socket.h>
+
+#if defined(CONFIG_PYRINAS_CLOUD_RESOLVER_CACHE)
+#include <settings/settings.h>
+#include <sys/crc.h>
+#endif
+
+#include "pyrinas_cloud_resolver.h"
+#include "pyrinas_cloud_transport.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(pyrinas_cloud_resolver);
+
+#define RESOLVER_ADDR_MAX_SIZE 16
+#define RESOLVER_SETTINGS_KEY "pyrinas/resolver"
+#define RESOLVER_SETTINGS_NAME "addrs"
+
+/* Give the connection a chance to settle before refreshing in the background */
+#define RESOLVER_REFRESH_DELAY K_SECONDS(10)
+
+struct resolver_entry
+{
+    uint8_t family;
+    uint8_t addr[RESOLVER_ADDR_MAX_SIZE];
+};
+
+/* Stored as is in settings */
+struct resolver_cache
+{
+    uint32_t host_crc;
+    uint8_t count;
+    struct resolver_entry entries[CONFIG_PYRINAS_CLOUD_RESOLVER_MAX_ADDR];
+};
+
+static struct resolver_cache cache;
+
+/* Connect and background refresh can overlap */
+static K_MUTEX_DEFINE(resolver_mutex);
+
+#if defined(CONFIG_PYRINAS_CLOUD_RESOLVER_CACHE)
+/* Only set once resolved since boot. Entries loaded from flash have an unknown age. */
+static bool cache_fresh;
+static int64_t cache_time;
+static bool cache_invalid;
+
+static struct k_work_q *resolver_q;
+static struct k_delayed_work refresh_work;
+#endif
+
+static int resolve(struct resolver_cache *out)
+{
+    int err;
+    struct addrinfo *result;
+    struct addrinfo *addr;
+    struct addrinfo hints = {.ai_family = IS_ENABLED(CONFIG_PYRINAS_CLOUD_RESOLVER_IPV6) ? AF_UNSPEC : AF_INET,
+                             .ai_socktype = PYRINAS_CLOUD_TRANSPORT_SOCKTYPE};
+
+    err = getaddrinfo(CONFIG_PYRINAS_CLOUD_MQTT_BROKER_HOSTNAME, NULL, &hints, &result);
+    if (err)
+    {
+        LOG_WRN("Unable to resolve %s. Err: %i", CONFIG_PYRINAS_CLOUD_MQTT_BROKER_HOSTNAME, err);
+        return err;
+    }
+
+    memset(out, 0, sizeof(*out));
+
+    /* Keep every usable address */
+    for (addr = result; addr != NULL && out->count < ARRAY_SIZE(out->entries); addr = addr->ai_next)
+    {
+        struct resolver_entry *entry = &out->entries[out->count];
+
+        if (addr->ai_family == AF_INET)
+        {
+            struct sockaddr_in *addr4 = (struct sockaddr_in *)addr->ai_addr;
+            memcpy(entry->addr, &addr4->sin_addr, sizeof(addr4->sin_addr));
+        }
+        else if (addr->ai_family == AF_INET6)
+        {
+            struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr->ai_addr;
+            memcpy(entry->addr, &addr6->sin6_addr, sizeof(addr6->sin6_addr));
+        }
+        else
+        {
+            continue;
+        }
+
+        entry->family = addr->ai_family;
+        out->count++;
+    }
+
+    /* Free the address. */
+    freeaddrinfo(result);
+
+    return out->count ? 0 : -ENOENT;
+}
+
+#if defined(CONFIG_PYRINAS_CLOUD_RESOLVER_CACHE)
+static uint32_t host_crc(void)
+{
+    return crc32_ieee(CONFIG_PYRINAS_CLOUD_MQTT_BROKER_HOSTNAME, strlen(CONFIG_PYRINAS_CLOUD_MQTT_BROKER_HOSTNAME));
+}
+
+static int resolver_settings_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+    struct resolver_cache loaded;
+    const char *next;
+
+    if (!settings_name_steq(name, RESOLVER_SETTINGS_NAME, &next) || next)
+        return -ENOENT;
+
+    /* Layout changed. Ignore. */
+    if (len != sizeof(loaded))
+        return 0;
+
+    int rc = read_cb(cb_arg, &loaded, sizeof(loaded));
+    if (rc < 0)
+        return rc;
+
+    /* Hostname changed or garbage */
+    if (loaded.host_crc != host_crc() || loaded.count > ARRAY_SIZE(loaded.entries))
+        return 0;
+
+    k_mutex_lock(&resolver_mutex, K_FOREVER);
+
+    if (cache.count == 0)
+        cache = loaded;
+
+    k_mutex_unlock(&resolver_mutex);
+
+    LOG_INF("Loaded %d cached broker addresses", loaded.count);
+
+    return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(pyrinas_cloud_resolver, RESOLVER_SETTINGS_KEY, NULL, resolver_settings_set, NULL, NULL);
+
+/* Must be called with resolver_mutex held */
+static void cache_update(struct resolver_cache *update)
+{
+    update->host_crc = host_crc();
+
+    cache_fresh = true;
+    cache_invalid = false;
+    cache_time = k_uptime_get();
+
+    /* Save flash writes when nothing changed */
+    if (memcmp(&cache, update, sizeof(cache)) == 0)
+        return;
+
+    cache = *update;
+
+    int err = settings_save_one(RESOLVER_SETTINGS_KEY "/" RESOLVER_SETTINGS_NAME, &cache, sizeof(cache));
+    if (err)
+        LOG_WRN("Unable to save broker addresses. Err: %i", err);
+}
+
+static bool cache_expired(void)
+{
+    return !cache_fresh ||
+           k_uptime_get() - cache_time > CONFIG_PYRINAS_CLOUD_RESOLVER_TTL_SEC * MSEC_PER_SEC;
+}
+
+static void refresh_work_fn(struct k_work *unused)
+{
+    struct resolver_cache update;
+
+    if (resolve(&update) != 0)
+        return;
+
+    k_mutex_lock(&resolver_mutex, K_FOREVER);
+    cache_update(&update);
+    k_mutex_unlock(&resolver_mutex);
+
+    LOG_DBG("Refreshed %d broker addresses", update.count);
+}
+#endif
+
+static void cache_copy(struct sockaddr_storage *addrs, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        struct resolver_entry *entry = &cache.entries[i];
+
+        memset(&addrs[i], 0, sizeof(addrs[i]));
+
+        if (entry->family == AF_INET6)
+        {
+            struct sockaddr_in6 *broker6 = (struct sockaddr_in6 *)&addrs[i];
+
+            broker6->sin6_family = AF_INET6;
+            broker6->sin6_port = htons(PYRINAS_CLOUD_TRANSPORT_PORT);
+            memcpy(&broker6->sin6_addr, entry->addr, sizeof(broker6->sin6_addr));
+        }
+        else
+        {
+            struct sockaddr_in *broker4 = (struct sockaddr_in *)&addrs[i];
+
+            broker4->sin_family = AF_INET;
+            broker4->sin_port = htons(PYRINAS_CLOUD_TRANSPORT_PORT);
+            memcpy(&broker4->sin_addr, entry->addr, sizeof(broker4->sin_addr));
+        }
+    }
+}
+
+int pyrinas_cloud_resolver_lookup(struct sockaddr_storage *addrs, size_t max_count)
+{
+    struct resolver_cache update;
+    int err = 0;
+
+    k_mutex_lock(&resolver_mutex, K_FOREVER);
+
+#if defined(CONFIG_PYRINAS_CLOUD_RESOLVER_CACHE)
+    if (cache.count == 0 || cache_invalid)
+    {
+        err = resolve(&update);
+        if (err == 0)
+        {
+            cache_update(&update);
+        }
+        else if (cache.count)
+        {
+            /* DNS is down. Old addresses are better than none. */
+            LOG_WRN("Using stale broker addresses");
+            err = 0;
+        }
+    }
+    else if (cache_expired())
+    {
+        /* Use what we have and refresh in the background */
+        k_delayed_work_submit_to_queue(resolver_q, &refresh_work, RESOLVER_REFRESH_DELAY);
+    }
+#else
+    err = resolve(&update);
+    if (err == 0)
+        cache = update;
+#endif
+
+    int count = MIN(cache.count, max_count);
+
+    if (err == 0)
+        cache_copy(addrs, count);
+
+    k_mutex_unlock(&resolver_mutex);
+
+    return err ? err : count;
+}
+
+void pyrinas_cloud_resolver_invalidate(void)
+{
+#if defined(CONFIG_PYRINAS_CLOUD_RESOLVER_CACHE)
+    k_mutex_lock(&resolver_mutex, K_FOREVER);
+    cache_invalid = true;
+    k_mutex_unlock(&resolver_mutex);
+#endif
+}
+
+void pyrinas_cloud_resolver_init(struct k_work_q *task_q)
+{
+    __ASSERT(task_q != NULL, "Task queue must not be NULL.");
+
+#if defined(CONFIG_PYRINAS_CLOUD_RESOLVER_CACHE)
+    resolver_q = task_q;
+    k_delayed_work_init(&refresh_work, refresh_work_fn);
+
+    int err = settings_subsys_init();
+    if (err)
+    {
+        LOG_WRN("Unable to init settings. Err: %i", err);
+        return;
+    }
+
+    /* Pick up addresses from the last boot */
+    err = settings_load_subtree(RESOLVER_SETTINGS_KEY);
+    if (err)
+        LOG_WRN("Unable to load broker addresses. Err: %i", err);
+#endif
+}
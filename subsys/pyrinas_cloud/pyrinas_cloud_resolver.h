@@ -0,0 +1,23 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _PYRINAS_CLOUD_RESOLVER_H
+#define _PYRINAS_CLOUD_RESOLVER_H
+
+#include <zephyr.h>
+#include <net/socket.h>
+
+/* Set up the resolver. Loads cached addresses if enabled. Refreshes run on task_q. */
+void pyrinas_cloud_resolver_init(struct k_work_q *task_q);
+
+/* Fill addrs with up to max_count broker addresses, port included.
+ * Returns number of addresses or error. */
+int pyrinas_cloud_resolver_lookup(struct sockaddr_storage *addrs, size_t max_count);
+
+/* None of the addresses worked. Resolve again on the next lookup. */
+void pyrinas_cloud_resolver_invalidate(void);
+
+#endif /* _PYRINAS_CLOUD_RESOLVER_H */
@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(CONFIG_PYRINAS_CLOUD_TELEMETRY_INTERVAL_PERSIST)
+#include <settings/settings.h>
+#endif
+
+#include "pyrinas_cloud_scheduler.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(pyrinas_cloud_scheduler);
+
+#define SCHEDULER_SETTINGS_KEY "pyrinas/telemetry"
+#define SCHEDULER_SETTINGS_NAME "interval"
+
+static struct k_work_q *scheduler_q;
+static pyrinas_cloud_scheduler_cb_t scheduler_cb;
+static struct k_delayed_work send_work;
+
+/* Work queue, modem and cloud thread all end up in here */
+static K_MUTEX_DEFINE(scheduler_mutex);
+
+static struct pyrinas_cloud_telemetry_interval interval = {
+    .min_sec = CONFIG_PYRINAS_CLOUD_TELEMETRY_INTERVAL_MIN_SEC,
+    .base_sec = CONFIG_PYRINAS_CLOUD_TELEMETRY_INTERVAL_SEC,
+    .max_sec = CONFIG_PYRINAS_CLOUD_TELEMETRY_INTERVAL_MAX_SEC,
+};
+
+static bool running;
+static uint32_t current_sec;
+static uint32_t stable_count;
+static bool changed;
+
+/* RSRP at the last send and the latest update. -1 if unknown. */
+static int32_t rsrp_sent = -1;
+static int32_t rsrp_latest = -1;
+
+static bool interval_valid(const struct pyrinas_cloud_telemetry_interval *value)
+{
+    return value->min_sec > 0 &&
+           value->min_sec <= value->base_sec &&
+           value->base_sec <= value->max_sec;
+}
+
+/* Must be called with scheduler_mutex held */
+static void send_schedule(uint32_t delay_sec)
+{
+    current_sec = delay_sec;
+
+    LOG_DBG("Next telemetry in %d s", delay_sec);
+
+    k_delayed_work_submit_to_queue(scheduler_q, &send_work, K_SECONDS(delay_sec));
+}
+
+/* Must be called with scheduler_mutex held */
+static void anomaly(void)
+{
+    changed = true;
+    stable_count = 0;
+
+    if (!running)
+        return;
+
+    /* Only pull the next send in, never push it out */
+    if (k_delayed_work_remaining_get(&send_work) > interval.min_sec * MSEC_PER_SEC)
+    {
+        LOG_INF("Telemetry anomaly. Sending in %d s", interval.min_sec);
+        send_schedule(interval.min_sec);
+    }
+}
+
+static void send_work_fn(struct k_work *unused)
+{
+    k_mutex_lock(&scheduler_mutex, K_FOREVER);
+
+    if (!running)
+    {
+        k_mutex_unlock(&scheduler_mutex);
+        return;
+    }
+
+    /* Signal moved past the deadband since the last send */
+    if (rsrp_latest >= 0 &&
+        (rsrp_sent < 0 || abs(rsrp_latest - rsrp_sent) > CONFIG_PYRINAS_CLOUD_TELEMETRY_RSRP_DEADBAND))
+        changed = true;
+
+    if (changed)
+    {
+        /* Back to base, or keep climbing out of an anomaly */
+        stable_count = 0;
+        current_sec = MIN(current_sec, interval.base_sec);
+    }
+    else if (++stable_count >= CONFIG_PYRINAS_CLOUD_TELEMETRY_STABLE_COUNT)
+    {
+        stable_count = 0;
+        current_sec = MIN(current_sec * 2, interval.max_sec);
+    }
+
+    changed = false;
+    rsrp_sent = rsrp_latest;
+
+    send_schedule(current_sec);
+
+    k_mutex_unlock(&scheduler_mutex);
+
+    /* Not under the lock. Publishing takes a while. */
+    scheduler_cb();
+}
+
+void pyrinas_cloud_scheduler_start(void)
+{
+    k_mutex_lock(&scheduler_mutex, K_FOREVER);
+
+    running = true;
+    stable_count = 0;
+    changed = false;
+
+    /* Telemetry just went out with the connect */
+    rsrp_sent = rsrp_latest;
+
+    send_schedule(interval.base_sec);
+
+    k_mutex_unlock(&scheduler_mutex);
+}
+
+void pyrinas_cloud_scheduler_stop(void)
+{
+    k_mutex_lock(&scheduler_mutex, K_FOREVER);
+
+    running = false;
+    k_delayed_work_cancel(&send_work);
+
+    k_mutex_unlock(&scheduler_mutex);
+}
+
+void pyrinas_cloud_scheduler_rsrp_update(int32_t rsrp)
+{
+    k_mutex_lock(&scheduler_mutex, K_FOREVER);
+
+    /* Higher is better. A big drop is worth reporting early. */
+    if (rsrp_sent >= 0 && rsrp_sent - rsrp >= CONFIG_PYRINAS_CLOUD_TELEMETRY_RSRP_ANOMALY)
+        anomaly();
+
+    rsrp_latest = rsrp;
+
+    k_mutex_unlock(&scheduler_mutex);
+}
+
+void pyrinas_cloud_telemetry_anomaly(void)
+{
+    k_mutex_lock(&scheduler_mutex, K_FOREVER);
+    anomaly();
+    k_mutex_unlock(&scheduler_mutex);
+}
+
+#if defined(CONFIG_PYRINAS_CLOUD_TELEMETRY_INTERVAL_PERSIST)
+static int scheduler_settings_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+    struct pyrinas_cloud_telemetry_interval loaded;
+    const char *next;
+
+    if (!settings_name_steq(name, SCHEDULER_SETTINGS_NAME, &next) || next)
+        return -ENOENT;
+
+    /* Layout changed. Ignore. */
+    if (len != sizeof(loaded))
+        return 0;
+
+    int rc = read_cb(cb_arg, &loaded, sizeof(loaded));
+    if (rc < 0)
+        return rc;
+
+    if (!interval_valid(&loaded))
+        return 0;
+
+    k_mutex_lock(&scheduler_mutex, K_FOREVER);
+    interval = loaded;
+    k_mutex_unlock(&scheduler_mutex);
+
+    LOG_INF("Telemetry interval %d/%d/%d s", loaded.min_sec, loaded.base_sec, loaded.max_sec);
+
+    return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(pyrinas_cloud_scheduler, SCHEDULER_SETTINGS_KEY, NULL, scheduler_settings_set, NULL, NULL);
+#endif
+
+int pyrinas_cloud_telemetry_interval_set(const struct pyrinas_cloud_telemetry_interval *value)
+{
+    if (!interval_valid(value))
+        return -EINVAL;
+
+    k_mutex_lock(&scheduler_mutex, K_FOREVER);
+
+    bool update = memcmp(&interval, value, sizeof(interval)) != 0;
+
+    interval = *value;
+
+    /* Takes effect now rather than after the current wait */
+    if (running && update)
+    {
+        stable_count = 0;
+        send_schedule(interval.base_sec);
+    }
+
+    k_mutex_unlock(&scheduler_mutex);
+
+    if (!update)
+        return 0;
+
+    LOG_INF("Telemetry interval set to %d/%d/%d s", value->min_sec, value->base_sec, value->max_sec);
+
+#if defined(CONFIG_PYRINAS_CLOUD_TELEMETRY_INTERVAL_PERSIST)
+    int err = settings_save_one(SCHEDULER_SETTINGS_KEY "/" SCHEDULER_SETTINGS_NAME, value, sizeof(*value));
+    if (err)
+    {
+        LOG_WRN("Unable to save telemetry interval. Err: %i", err);
+        return err;
+    }
+#endif
+
+    return 0;
+}
+
+void pyrinas_cloud_telemetry_interval_get(struct pyrinas_cloud_telemetry_interval *value)
+{
+    k_mutex_lock(&scheduler_mutex, K_FOREVER);
+    *value = interval;
+    k_mutex_unlock(&scheduler_mutex);
+}
+
+void pyrinas_cloud_scheduler_init(struct k_work_q *task_q, pyrinas_cloud_scheduler_cb_t cb)
+{
+    __ASSERT(task_q != NULL, "Task queue must not be NULL.");
+    __ASSERT(cb != NULL, "Callback must not be NULL.");
+
+    scheduler_q = task_q;
+    scheduler_cb = cb;
+
+    k_delayed_work_init(&send_work, send_work_fn);
+
+#if defined(CONFIG_PYRINAS_CLOUD_TELEMETRY_INTERVAL_PERSIST)
+    int err = settings_subsys_init();
+    if (err)
+    {
+        LOG_WRN("Unable to init settings. Err: %i", err);
+        return;
+    }
+
+    /* Pick up the interval from the last boot */
+    err = settings_load_subtree(SCHEDULER_SETTINGS_KEY);
+    if (err)
+        LOG_WRN("Unable to load telemetry interval. Err: %i", err);
+#endif
+}
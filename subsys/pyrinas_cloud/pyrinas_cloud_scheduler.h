@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _PYRINAS_CLOUD_SCHEDULER_H
+#define _PYRINAS_CLOUD_SCHEDULER_H
+
+#include <zephyr.h>
+#include <pyrinas_cloud/pyrinas_cloud.h>
+
+/* Called from the task queue when telemetry is due */
+typedef void (*pyrinas_cloud_scheduler_cb_t)(void);
+
+/* Loads the stored interval. cb runs on task_q. */
+void pyrinas_cloud_scheduler_init(struct k_work_q *task_q, pyrinas_cloud_scheduler_cb_t cb);
+
+/* Start sending on connect, stop on disconnect */
+void pyrinas_cloud_scheduler_start(void);
+void pyrinas_cloud_scheduler_stop(void);
+
+/* Inputs for deciding when to back off or tighten */
+void pyrinas_cloud_scheduler_rsrp_update(int32_t rsrp);
+
+#endif /* _PYRINAS_CLOUD_SCHEDULER_H */
@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <string.h>
+
+#include "pyrinas_cloud_stats.h"
+#include "pyrinas_cloud_peripheral.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(pyrinas_cloud_stats);
+
+/* The central's own samples. Peripheral ones live in their registry entry. */
+struct stats_window
+{
+    struct pyrinas_cloud_stats_acc rsrp;
+    struct pyrinas_cloud_stats_acc latency;
+};
+
+struct stats_peripheral_snapshot
+{
+    uint8_t addr[PERIPHERAL_ADDR_LEN];
+    struct pyrinas_cloud_stats_rssi rssi;
+};
+
+static struct stats_window window;
+
+/* Encoded but not yet handed off. Goes back into the window if the send fails. */
+static struct stats_window pending;
+
+/* Where the next send starts looking. More peripherals than fit in one
+ * send take turns. */
+static size_t peripheral_next;
+
+/* Samples come from the modem, BLE and cloud threads */
+static K_MUTEX_DEFINE(stats_mutex);
+
+static void acc_add(struct pyrinas_cloud_stats_acc *acc, int32_t value)
+{
+    if (acc->count == 0)
+    {
+        acc->min = value;
+        acc->max = value;
+    }
+    else
+    {
+        acc->min = MIN(acc->min, value);
+        acc->max = MAX(acc->max, value);
+    }
+
+    acc->sum += value;
+    acc->last = value;
+    acc->count++;
+}
+
+/* Older samples back into an accumulator. last stays the newest. */
+static void acc_merge(struct pyrinas_cloud_stats_acc *acc, const struct pyrinas_cloud_stats_acc *older)
+{
+    if (older->count == 0)
+        return;
+
+    if (acc->count == 0)
+    {
+        *acc = *older;
+        return;
+    }
+
+    acc->min = MIN(acc->min, older->min);
+    acc->max = MAX(acc->max, older->max);
+    acc->sum += older->sum;
+    acc->count += older->count;
+}
+
+static void acc_encode(QCBOREncodeContext *ec, const struct pyrinas_cloud_stats_acc *acc)
+{
+    QCBOREncode_OpenArray(ec);
+    QCBOREncode_AddInt64(ec, acc->min);
+    QCBOREncode_AddInt64(ec, acc->max);
+    QCBOREncode_AddInt64(ec, acc->sum / acc->count);
+    QCBOREncode_AddUInt64(ec, acc->count);
+    QCBOREncode_AddInt64(ec, acc->last);
+    QCBOREncode_CloseArray(ec);
+}
+
+void pyrinas_cloud_stats_rsrp_add(int32_t rsrp)
+{
+    k_mutex_lock(&stats_mutex, K_FOREVER);
+    acc_add(&window.rsrp, rsrp);
+    k_mutex_unlock(&stats_mutex);
+}
+
+void pyrinas_cloud_stats_latency_add(uint32_t latency_ms)
+{
+    k_mutex_lock(&stats_mutex, K_FOREVER);
+    acc_add(&window.latency, MIN(latency_ms, INT32_MAX));
+    k_mutex_unlock(&stats_mutex);
+}
+
+static bool rssi_empty(const struct pyrinas_cloud_stats_rssi *rssi)
+{
+    return rssi->central.count == 0 && rssi->peripheral.count == 0;
+}
+
+/* Puts samples that couldn't be sent back in front of the current ones */
+static void rssi_restore(struct pyrinas_cloud_stats_peripheral *stats)
+{
+    acc_merge(&stats->window.central, &stats->pending.central);
+    acc_merge(&stats->window.peripheral, &stats->pending.peripheral);
+
+    memset(&stats->pending, 0, sizeof(stats->pending));
+}
+
+void pyrinas_cloud_stats_rssi_add(const uint8_t *peripheral_addr, int8_t central_rssi, int8_t peripheral_rssi)
+{
+    pyrinas_cloud_peripheral_lock();
+
+    struct pyrinas_cloud_peripheral *p = pyrinas_cloud_peripheral_get(peripheral_addr, true);
+
+    /* Registry is full of pinned peripherals */
+    if (p == NULL)
+    {
+        LOG_DBG("No registry entry for peripheral");
+        goto done;
+    }
+
+    /* Only negative values are valid */
+    if (central_rssi < 0)
+        acc_add(&p->stats.window.central, central_rssi);
+
+    if (peripheral_rssi < 0)
+        acc_add(&p->stats.window.peripheral, peripheral_rssi);
+
+done:
+    pyrinas_cloud_peripheral_unlock();
+}
+
+void pyrinas_cloud_stats_commit(bool sent)
+{
+    k_mutex_lock(&stats_mutex, K_FOREVER);
+
+    if (!sent)
+    {
+        acc_merge(&window.rsrp, &pending.rsrp);
+        acc_merge(&window.latency, &pending.latency);
+    }
+
+    memset(&pending, 0, sizeof(pending));
+
+    k_mutex_unlock(&stats_mutex);
+
+    pyrinas_cloud_peripheral_lock();
+
+    for (int i = 0; i < CONFIG_PYRINAS_CLOUD_PERIPHERAL_COUNT; i++)
+    {
+        struct pyrinas_cloud_peripheral *p = pyrinas_cloud_peripheral_at(i);
+
+        if (p == NULL)
+            continue;
+
+        if (sent)
+            memset(&p->stats.pending, 0, sizeof(p->stats.pending));
+        else
+            rssi_restore(&p->stats);
+    }
+
+    pyrinas_cloud_peripheral_unlock();
+}
+
+/* Moves up to CONFIG_PYRINAS_CLOUD_STATS_PERIPHERAL_MAX windows into
+ * snapshots. Returns how many. */
+static size_t peripherals_take(struct stats_peripheral_snapshot *snapshots)
+{
+    size_t count = 0;
+
+    pyrinas_cloud_peripheral_lock();
+
+    for (int i = 0; i < CONFIG_PYRINAS_CLOUD_PERIPHERAL_COUNT; i++)
+    {
+        size_t index = (peripheral_next + i) % CONFIG_PYRINAS_CLOUD_PERIPHERAL_COUNT;
+        struct pyrinas_cloud_peripheral *p = pyrinas_cloud_peripheral_at(index);
+
+        if (p == NULL)
+            continue;
+
+        /* Anything never committed comes along */
+        rssi_restore(&p->stats);
+
+        if (count == CONFIG_PYRINAS_CLOUD_STATS_PERIPHERAL_MAX || rssi_empty(&p->stats.window))
+            continue;
+
+        memcpy(snapshots[count].addr, p->addr, sizeof(snapshots[count].addr));
+        snapshots[count].rssi = p->stats.window;
+        count++;
+
+        p->stats.pending = p->stats.window;
+        memset(&p->stats.window, 0, sizeof(p->stats.window));
+
+        peripheral_next = (index + 1) % CONFIG_PYRINAS_CLOUD_PERIPHERAL_COUNT;
+    }
+
+    pyrinas_cloud_peripheral_unlock();
+
+    return count;
+}
+
+void pyrinas_cloud_stats_encode(QCBOREncodeContext *ec, int64_t key)
+{
+    static struct stats_peripheral_snapshot peripherals[CONFIG_PYRINAS_CLOUD_STATS_PERIPHERAL_MAX];
+    struct stats_window snapshot;
+    size_t peripheral_count;
+
+    /* Take the window and start over. Anything never committed comes along. */
+    k_mutex_lock(&stats_mutex, K_FOREVER);
+    acc_merge(&window.rsrp, &pending.rsrp);
+    acc_merge(&window.latency, &pending.latency);
+    pending = window;
+    snapshot = window;
+    memset(&window, 0, sizeof(window));
+    k_mutex_unlock(&stats_mutex);
+
+    peripheral_count = peripherals_take(peripherals);
+
+    if (snapshot.rsrp.count == 0 && snapshot.latency.count == 0 && peripheral_count == 0)
+        return;
+
+    QCBOREncode_OpenMapInMapN(ec, key);
+
+    if (snapshot.rsrp.count)
+    {
+        QCBOREncode_AddInt64(ec, stats_type_rsrp);
+        acc_encode(ec, &snapshot.rsrp);
+    }
+
+    if (snapshot.latency.count)
+    {
+        QCBOREncode_AddInt64(ec, stats_type_latency);
+        acc_encode(ec, &snapshot.latency);
+    }
+
+    if (peripheral_count)
+    {
+        QCBOREncode_OpenArrayInMapN(ec, stats_type_peripherals);
+
+        /* [addr, central rssi, peripheral rssi]. Empty accumulators are null. */
+        for (int i = 0; i < peripheral_count; i++)
+        {
+            struct stats_peripheral_snapshot *p = &peripherals[i];
+
+            UsefulBufC addr = {
+                .ptr = p->addr,
+                .len = sizeof(p->addr)};
+
+            QCBOREncode_OpenArray(ec);
+            QCBOREncode_AddBytes(ec, addr);
+
+            if (p->rssi.central.count)
+                acc_encode(ec, &p->rssi.central);
+            else
+                QCBOREncode_AddNULL(ec);
+
+            if (p->rssi.peripheral.count)
+                acc_encode(ec, &p->rssi.peripheral);
+            else
+                QCBOREncode_AddNULL(ec);
+
+            QCBOREncode_CloseArray(ec);
+        }
+
+        QCBOREncode_CloseArray(ec);
+    }
+
+    QCBOREncode_CloseMap(ec);
+}
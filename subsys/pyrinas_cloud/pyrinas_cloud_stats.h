@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _PYRINAS_CLOUD_STATS_H
+#define _PYRINAS_CLOUD_STATS_H
+
+#include <zephyr.h>
+#include <qcbor/qcbor.h>
+
+struct pyrinas_cloud_stats_acc
+{
+    int32_t min;
+    int32_t max;
+    int64_t sum;
+    uint32_t count;
+    int32_t last;
+};
+
+struct pyrinas_cloud_stats_rssi
+{
+    struct pyrinas_cloud_stats_acc central;
+    struct pyrinas_cloud_stats_acc peripheral;
+};
+
+/* Kept in the peripheral's registry entry */
+struct pyrinas_cloud_stats_peripheral
+{
+    struct pyrinas_cloud_stats_rssi window;
+
+    /* Encoded but not yet handed off */
+    struct pyrinas_cloud_stats_rssi pending;
+};
+
+/* Keys inside the stats block */
+enum pyrinas_cloud_stats_type
+{
+    stats_type_rsrp,
+    stats_type_latency,
+    stats_type_peripherals,
+};
+
+/* [min, max, mean, count, last]. Head plus five 32 bit values. */
+#define STATS_ACC_ENCODED_MAX_SIZE (1 + 5 * 5)
+
+/* [addr, central, peripheral]. Array head, 6 byte string and two accumulators. */
+#define STATS_PERIPHERAL_ENCODED_MAX_SIZE (1 + 7 + 2 * STATS_ACC_ENCODED_MAX_SIZE)
+
+/* Outer key, map head, two keyed accumulators, then the keyed peripheral array */
+#define STATS_ENCODED_MAX_SIZE (1 + 1 +                                \
+                                2 * (1 + STATS_ACC_ENCODED_MAX_SIZE) + \
+                                1 + 3 +                                \
+                                CONFIG_PYRINAS_CLOUD_STATS_PERIPHERAL_MAX * STATS_PERIPHERAL_ENCODED_MAX_SIZE)
+
+/* Add samples to the current window */
+void pyrinas_cloud_stats_rsrp_add(int32_t rsrp);
+void pyrinas_cloud_stats_latency_add(uint32_t latency_ms);
+void pyrinas_cloud_stats_rssi_add(const uint8_t *peripheral_addr, int8_t central_rssi, int8_t peripheral_rssi);
+
+/* Encode the window as a map under key and start a new one. Nothing is added if the window is empty.
+ * The samples are only dropped once pyrinas_cloud_stats_commit() says they were sent. */
+void pyrinas_cloud_stats_encode(QCBOREncodeContext *ec, int64_t key);
+
+/* After encoding. Samples that weren't sent go into the next window. */
+void pyrinas_cloud_stats_commit(bool sent);
+
+#endif /* _PYRINAS_CLOUD_STATS_H */
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _PYRINAS_CLOUD_TRANSPORT_H
+#define _PYRINAS_CLOUD_TRANSPORT_H
+
+#include <zephyr.h>
+#include <net/socket.h>
+#include <pyrinas_cloud/pyrinas_cloud.h>
+
+/* Where the resolver points the broker addresses */
+#if defined(CONFIG_PYRINAS_CLOUD_TRANSPORT_COAP)
+#define PYRINAS_CLOUD_TRANSPORT_PORT CONFIG_PYRINAS_CLOUD_COAP_SERVER_PORT
+#define PYRINAS_CLOUD_TRANSPORT_SOCKTYPE SOCK_DGRAM
+#else
+#define PYRINAS_CLOUD_TRANSPORT_PORT CONFIG_PYRINAS_CLOUD_MQTT_BROKER_PORT
+#define PYRINAS_CLOUD_TRANSPORT_SOCKTYPE SOCK_STREAM
+#endif
+
+/* Most topics in one subscribe */
+#define PYRINAS_CLOUD_TRANSPORT_TOPICS_MAX 4
+
+enum pyrinas_cloud_transport_evt_type
+{
+    transport_evt_connected,
+    transport_evt_disconnected,
+    transport_evt_message,
+    transport_evt_ack,
+    transport_evt_suback,
+};
+
+/* Incoming message. The payload is read with pyrinas_cloud_transport_read()
+ * before the handler returns. */
+struct pyrinas_cloud_transport_message
+{
+    const uint8_t *topic;
+    size_t topic_len;
+    size_t payload_len;
+    enum pyrinas_cloud_qos qos;
+    uint16_t message_id;
+};
+
+struct pyrinas_cloud_transport_evt
+{
+    enum pyrinas_cloud_transport_evt_type type;
+    int result;
+    union
+    {
+        /* connected */
+        bool session_present;
+        /* ack and suback */
+        uint16_t message_id;
+        /* message */
+        struct pyrinas_cloud_transport_message message;
+    };
+};
+
+/* Always called from the cloud thread */
+typedef void (*pyrinas_cloud_transport_evt_handler_t)(const struct pyrinas_cloud_transport_evt *evt);
+
+struct pyrinas_cloud_transport_publish
+{
+    const uint8_t *topic;
+    size_t topic_len;
+    const uint8_t *data;
+    size_t data_len;
+    enum pyrinas_cloud_qos qos;
+    uint16_t message_id;
+    bool dup;
+};
+
+struct pyrinas_cloud_transport_topic
+{
+    const uint8_t *topic;
+    size_t topic_len;
+};
+
+/* Returns once the link is secured. The connected event follows from
+ * the cloud thread. */
+int pyrinas_cloud_transport_connect(const char *client_id, size_t client_id_len, struct sockaddr_storage *server,
+                                    pyrinas_cloud_transport_evt_handler_t handler);
+
+/* Both emit a disconnected event before returning */
+int pyrinas_cloud_transport_disconnect(void);
+void pyrinas_cloud_transport_abort(void);
+
+/* QoS 1 publishes complete with an ack event carrying message_id */
+int pyrinas_cloud_transport_publish(const struct pyrinas_cloud_transport_publish *param);
+
+/* One suback event with message_id once every topic is answered */
+int pyrinas_cloud_transport_subscribe(const struct pyrinas_cloud_transport_topic *topics, size_t count,
+                                      uint16_t message_id);
+int pyrinas_cloud_transport_unsubscribe(const struct pyrinas_cloud_transport_topic *topic, uint16_t message_id);
+
+/* Payload of the message being handled. Returns bytes read. */
+int pyrinas_cloud_transport_read(uint8_t *buf, size_t len);
+
+/* A QoS 1 message has been handled */
+int pyrinas_cloud_transport_ack(uint16_t message_id);
+
+/* Socket has data */
+int pyrinas_cloud_transport_input(void);
+
+/* Keepalive and retransmissions. Returns 0 if a ping went out, -EAGAIN if
+ * nothing was due. Anything else means the link is gone. */
+int pyrinas_cloud_transport_live(void);
+
+/* ms until pyrinas_cloud_transport_live() has work to do. -1 if never. */
+int pyrinas_cloud_transport_time_left(void);
+
+/* Socket to poll */
+int pyrinas_cloud_transport_socket(void);
+
+#endif /* _PYRINAS_CLOUD_TRANSPORT_H */
@@ -0,0 +1,954 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <string.h>
+#include <random/rand32.h>
+#include <net/socket.h>
+#include <net/coap.h>
+
+#include "pyrinas_cloud_helper.h"
+#include "pyrinas_cloud_transport.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(pyrinas_cloud_transport_coap);
+
+/*
+ * Topics map onto Uri-Path. Publishes are PUTs, NON for QoS 0 and CON
+ * for QoS 1. Subscribing is an Observe GET on the topic with any
+ * trailing "/#" removed. Notifications on an observed "/#" topic have to
+ * carry the full topic in Location-Path so they resolve to an event
+ * name. Stock servers don't add it, so with those only exact topics work.
+ *
+ * CON messages, pings included, are retransmitted with backoff. When a
+ * CON runs out of retries the link is taken as dead and closed. The core
+ * reconnects, sends what's still in flight again and observes anew.
+ */
+
+/* RFC 7252 section 4.8 */
+#define COAP_MAX_RETRANSMIT 4
+
+#define COAP_OBSERVE_REGISTER 0
+#define COAP_OBSERVE_DEREGISTER 1
+
+#define COAP_RESPONSE_CLASS(code) ((code) >> 5)
+#define COAP_RESPONSE_CLASS_SUCCESS 2
+
+/* Only observations need one. Publishes are matched on message id. */
+#define OBSERVE_TOKEN_LEN 4
+
+/* Header, Uri-Path option headers and payload marker */
+#define COAP_OVERHEAD_MAX 32
+
+BUILD_ASSERT(CONFIG_PYRINAS_CLOUD_COAP_MESSAGE_BUFFER_SIZE >=
+                 CONFIG_PYRINAS_CLOUD_PUBLISH_TOPIC_MAX_SIZE + CONFIG_PYRINAS_CLOUD_PUBLISH_PAYLOAD_MAX_SIZE + COAP_OVERHEAD_MAX,
+             "A full publish must fit in one datagram");
+
+#if defined(CONFIG_PYRINAS_CLOUD_COAP_DTLS)
+#define COAP_PROTO IPPROTO_DTLS_1_2
+
+/* Security tag for fetching certs */
+static sec_tag_t sec_tag_list[] = {CONFIG_PYRINAS_CLOUD_SEC_TAG};
+#else
+#define COAP_PROTO IPPROTO_UDP
+#endif
+
+/* Retransmission state of a CON message */
+struct coap_retransmit
+{
+    uint16_t mid;
+    uint8_t retries;
+    uint32_t timeout;
+    int64_t next_tx;
+};
+
+/* CON publish waiting for its ACK. Kept whole for retransmission. */
+struct coap_pending
+{
+    bool in_use;
+    uint16_t message_id;
+    struct coap_retransmit rt;
+    uint16_t len;
+    uint8_t buf[CONFIG_PYRINAS_CLOUD_COAP_MESSAGE_BUFFER_SIZE];
+};
+
+enum coap_observation_state
+{
+    observation_waiting,
+    observation_acked,
+    observation_registered,
+    observation_refused,
+};
+
+struct coap_observation
+{
+    bool in_use;
+    enum coap_observation_state state;
+    uint16_t message_id;
+    struct coap_retransmit rt;
+    uint8_t token[OBSERVE_TOKEN_LEN];
+    char path[CONFIG_PYRINAS_CLOUD_PUBLISH_TOPIC_MAX_SIZE];
+    size_t path_len;
+
+    /* Subscribed with "/#". Notifications need a Location-Path. */
+    bool wildcard;
+};
+
+static int sock = -1;
+static bool connect_pending;
+static int64_t last_tx;
+
+/* Keepalive waiting for its reset */
+static bool ping_pending;
+static struct coap_retransmit ping_rt;
+static pyrinas_cloud_transport_evt_handler_t evt_handler;
+
+static uint8_t tx_buf[CONFIG_PYRINAS_CLOUD_COAP_MESSAGE_BUFFER_SIZE];
+static uint8_t rx_buf[CONFIG_PYRINAS_CLOUD_COAP_MESSAGE_BUFFER_SIZE];
+static char rx_topic[CONFIG_PYRINAS_CLOUD_PUBLISH_TOPIC_MAX_SIZE];
+
+/* Payload of the message being handled */
+static const uint8_t *rx_payload;
+static size_t rx_payload_len;
+static size_t rx_offset;
+
+static struct coap_pending pending[CONFIG_PYRINAS_CLOUD_INFLIGHT_MAX];
+static struct coap_observation observations[PYRINAS_CLOUD_TRANSPORT_TOPICS_MAX];
+
+static void evt_send(const struct pyrinas_cloud_transport_evt *evt)
+{
+    if (evt_handler)
+        evt_handler(evt);
+}
+
+static int datagram_send(const uint8_t *data, size_t len)
+{
+    if (send(sock, data, len, 0) < 0)
+        return -errno;
+
+    last_tx = k_uptime_get();
+
+    return 0;
+}
+
+static void retransmit_init(struct coap_retransmit *rt, uint16_t mid)
+{
+    /* ACK_TIMEOUT * ACK_RANDOM_FACTOR. Spreads out devices that lost
+     * the link at the same time. */
+    rt->mid = mid;
+    rt->retries = 0;
+    rt->timeout = CONFIG_PYRINAS_CLOUD_COAP_ACK_TIMEOUT_MS + sys_rand32_get() % (CONFIG_PYRINAS_CLOUD_COAP_ACK_TIMEOUT_MS / 2);
+    rt->next_tx = k_uptime_get() + rt->timeout;
+}
+
+/* Doubles the timeout. False once out of retries. */
+static bool retransmit_next(struct coap_retransmit *rt)
+{
+    if (rt->retries >= COAP_MAX_RETRANSMIT)
+        return false;
+
+    rt->retries++;
+    rt->timeout *= 2;
+    rt->next_tx = k_uptime_get() + rt->timeout;
+
+    return true;
+}
+
+/* One Uri-Path option per topic level */
+static int path_append(struct coap_packet *pkt, const uint8_t *path, size_t len)
+{
+    size_t start = 0;
+
+    for (size_t i = 0; i <= len; i++)
+    {
+        if (i < len && path[i] != '/')
+            continue;
+
+        if (i > start)
+        {
+            int err = coap_packet_append_option(pkt, COAP_OPTION_URI_PATH, &path[start], i - start);
+            if (err < 0)
+                return err;
+        }
+
+        start = i + 1;
+    }
+
+    return 0;
+}
+
+static int option_ext_get(const uint8_t **opt, const uint8_t *end, uint16_t *value)
+{
+    if (*value == 13)
+    {
+        if (*opt + 1 > end)
+            return -EINVAL;
+
+        *value = 13 + (*opt)[0];
+        *opt += 1;
+    }
+    else if (*value == 14)
+    {
+        if (*opt + 2 > end)
+            return -EINVAL;
+
+        *value = 269 + (((*opt)[0] << 8) | (*opt)[1]);
+        *opt += 2;
+    }
+    else if (*value == 15)
+    {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* Location-Path segments joined with '/'. Walked by hand since
+ * coap_find_options() can't hold segments as long as an IMEI.
+ * Returns 0 if there are none. */
+static size_t location_path_get(const struct coap_packet *pkt, char *topic, size_t size)
+{
+    const uint8_t *opt = pkt->data + pkt->hdr_len;
+    const uint8_t *end = opt + pkt->opt_len;
+    uint16_t number = 0;
+    size_t len = 0;
+
+    while (opt < end && *opt != COAP_PAYLOAD_MARKER)
+    {
+        uint16_t delta = *opt >> 4;
+        uint16_t opt_len = *opt & 0x0f;
+
+        opt++;
+
+        if (option_ext_get(&opt, end, &delta) || option_ext_get(&opt, end, &opt_len) || opt + opt_len > end)
+            return 0;
+
+        number += delta;
+
+        if (number == COAP_OPTION_LOCATION_PATH)
+        {
+            if (len + opt_len + 1 > size)
+                return 0;
+
+            if (len)
+                topic[len++] = '/';
+
+            memcpy(&topic[len], opt, opt_len);
+            len += opt_len;
+        }
+
+        opt += opt_len;
+    }
+
+    return len;
+}
+
+static struct coap_pending *pending_find(uint16_t mid)
+{
+    for (int i = 0; i < ARRAY_SIZE(pending); i++)
+    {
+        if (pending[i].in_use && pending[i].rt.mid == mid)
+            return &pending[i];
+    }
+
+    return NULL;
+}
+
+static struct coap_observation *observation_find_mid(uint16_t mid)
+{
+    for (int i = 0; i < ARRAY_SIZE(observations); i++)
+    {
+        struct coap_observation *obs = &observations[i];
+
+        if (obs->in_use && obs->rt.mid == mid &&
+            (obs->state == observation_waiting || obs->state == observation_acked))
+            return obs;
+    }
+
+    return NULL;
+}
+
+static struct coap_observation *observation_find_token(const uint8_t *token, uint8_t token_len)
+{
+    if (token_len != OBSERVE_TOKEN_LEN)
+        return NULL;
+
+    for (int i = 0; i < ARRAY_SIZE(observations); i++)
+    {
+        if (observations[i].in_use && memcmp(observations[i].token, token, OBSERVE_TOKEN_LEN) == 0)
+            return &observations[i];
+    }
+
+    return NULL;
+}
+
+static int observation_send(struct coap_observation *obs, uint32_t observe, uint8_t type, uint16_t mid)
+{
+    struct coap_packet pkt;
+    int err;
+
+    err = coap_packet_init(&pkt, tx_buf, sizeof(tx_buf), COAP_VERSION_1, type, OBSERVE_TOKEN_LEN, obs->token,
+                           COAP_METHOD_GET, mid);
+    if (err < 0)
+        return err;
+
+    /* Options go in ascending order */
+    err = coap_append_option_int(&pkt, COAP_OPTION_OBSERVE, observe);
+    if (err < 0)
+        return err;
+
+    err = path_append(&pkt, (const uint8_t *)obs->path, obs->path_len);
+    if (err < 0)
+        return err;
+
+    return datagram_send(pkt.data, pkt.offset);
+}
+
+/* Suback once every topic of a subscribe has an answer */
+static void suback_check(uint16_t message_id)
+{
+    struct pyrinas_cloud_transport_evt evt = {
+        .type = transport_evt_suback,
+        .message_id = message_id,
+    };
+
+    for (int i = 0; i < ARRAY_SIZE(observations); i++)
+    {
+        struct coap_observation *obs = &observations[i];
+
+        if (!obs->in_use || obs->message_id != message_id)
+            continue;
+
+        if (obs->state == observation_waiting || obs->state == observation_acked)
+            return;
+
+        if (obs->state == observation_refused)
+            evt.result = -EACCES;
+    }
+
+    /* Refused ones are done with */
+    for (int i = 0; i < ARRAY_SIZE(observations); i++)
+    {
+        if (observations[i].message_id == message_id && observations[i].state == observation_refused)
+            observations[i].in_use = false;
+    }
+
+    evt_send(&evt);
+}
+
+/* False if the message was dropped */
+static bool message_deliver(const struct coap_packet *pkt, const struct coap_observation *obs,
+                            enum pyrinas_cloud_qos qos, uint16_t mid)
+{
+    uint16_t payload_len = 0;
+    const uint8_t *payload = coap_packet_get_payload(pkt, &payload_len);
+    size_t topic_len = location_path_get(pkt, rx_topic, sizeof(rx_topic));
+
+    if (topic_len == 0)
+    {
+        /* Nothing to tell which event it is */
+        if (obs->wildcard)
+        {
+            char path_str[sizeof(obs->path) + 1];
+
+            LOG_WRN("Dropping notification on %s without Location-Path",
+                    log_strdup(str_terminate(path_str, sizeof(path_str), obs->path, obs->path_len)));
+            return false;
+        }
+
+        topic_len = obs->path_len;
+        memcpy(rx_topic, obs->path, topic_len);
+    }
+
+    rx_payload = payload;
+    rx_payload_len = payload ? payload_len : 0;
+    rx_offset = 0;
+
+    struct pyrinas_cloud_transport_evt evt = {
+        .type = transport_evt_message,
+        .message = {
+            .topic = (const uint8_t *)rx_topic,
+            .topic_len = topic_len,
+            .payload_len = rx_payload_len,
+            .qos = qos,
+            .message_id = mid,
+        },
+    };
+
+    evt_send(&evt);
+
+    rx_payload = NULL;
+
+    return true;
+}
+
+/* Reset is the usual answer but any reply to the ping will do */
+static bool ping_answered(uint16_t mid)
+{
+    if (!ping_pending || ping_rt.mid != mid)
+        return false;
+
+    ping_pending = false;
+    LOG_DBG("Ping answered");
+
+    return true;
+}
+
+static void ack_handle(const struct coap_packet *pkt, uint16_t mid, uint8_t code)
+{
+    bool success = code == COAP_CODE_EMPTY || COAP_RESPONSE_CLASS(code) == COAP_RESPONSE_CLASS_SUCCESS;
+    struct coap_pending *pub = pending_find(mid);
+
+    if (ping_answered(mid))
+        return;
+
+    if (pub)
+    {
+        struct pyrinas_cloud_transport_evt evt = {
+            .type = transport_evt_ack,
+            .result = success ? 0 : -EIO,
+            .message_id = pub->message_id,
+        };
+
+        if (!success)
+            LOG_WRN("Publish %u rejected. Code: %d.%02d", pub->message_id, code >> 5, code & 0x1f);
+
+        pub->in_use = false;
+        evt_send(&evt);
+        return;
+    }
+
+    struct coap_observation *obs = observation_find_mid(mid);
+
+    if (obs == NULL)
+        return;
+
+    /* The response follows separately */
+    if (code == COAP_CODE_EMPTY)
+    {
+        obs->state = observation_acked;
+        return;
+    }
+
+    /* Without Observe the server answered once and won't notify */
+    if (success && coap_get_option_int(pkt, COAP_OPTION_OBSERVE) >= 0)
+    {
+        obs->state = observation_registered;
+    }
+    else
+    {
+        char path_str[sizeof(obs->path) + 1];
+
+        LOG_WRN("Observe refused for %s. Code: %d.%02d",
+                log_strdup(str_terminate(path_str, sizeof(path_str), obs->path, obs->path_len)), code >> 5, code & 0x1f);
+        obs->state = observation_refused;
+    }
+
+    /* Current value, like a retained message */
+    uint16_t payload_len = 0;
+
+    if (success && coap_packet_get_payload(pkt, &payload_len))
+        message_deliver(pkt, obs, cloud_qos_at_most_once, mid);
+
+    suback_check(obs->message_id);
+}
+
+static void reset_handle(uint16_t mid)
+{
+    struct coap_pending *pub = pending_find(mid);
+
+    if (ping_answered(mid))
+        return;
+
+    if (pub)
+    {
+        struct pyrinas_cloud_transport_evt evt = {
+            .type = transport_evt_ack,
+            .result = -ECONNRESET,
+            .message_id = pub->message_id,
+        };
+
+        pub->in_use = false;
+        evt_send(&evt);
+        return;
+    }
+
+    struct coap_observation *obs = observation_find_mid(mid);
+
+    if (obs)
+    {
+        obs->state = observation_refused;
+        suback_check(obs->message_id);
+        return;
+    }
+
+    LOG_DBG("Reset for %u", mid);
+}
+
+static int empty_send(uint8_t type, uint16_t mid)
+{
+    struct coap_packet pkt;
+    uint8_t buf[4];
+
+    int err = coap_packet_init(&pkt, buf, sizeof(buf), COAP_VERSION_1, type, 0, NULL, COAP_CODE_EMPTY, mid);
+    if (err < 0)
+        return err;
+
+    return datagram_send(pkt.data, pkt.offset);
+}
+
+/* Notification or request from the server */
+static void request_handle(const struct coap_packet *pkt, uint8_t type, uint16_t mid, uint8_t code,
+                           const uint8_t *token, uint8_t token_len)
+{
+    struct coap_observation *obs = observation_find_token(token, token_len);
+
+    /* Tells the server to forget about us */
+    if (obs == NULL || obs->state == observation_refused)
+    {
+        LOG_DBG("Rejecting message %u", mid);
+        empty_send(COAP_TYPE_RESET, mid);
+        return;
+    }
+
+    /* Separate response to the register */
+    if (obs->state == observation_waiting || obs->state == observation_acked)
+    {
+        bool success = COAP_RESPONSE_CLASS(code) == COAP_RESPONSE_CLASS_SUCCESS &&
+                       coap_get_option_int(pkt, COAP_OPTION_OBSERVE) >= 0;
+
+        obs->state = success ? observation_registered : observation_refused;
+        suback_check(obs->message_id);
+
+        if (!success)
+        {
+            if (type == COAP_TYPE_CON)
+                empty_send(COAP_TYPE_ACK, mid);
+
+            return;
+        }
+    }
+    else if (COAP_RESPONSE_CLASS(code) != COAP_RESPONSE_CLASS_SUCCESS ||
+             coap_get_option_int(pkt, COAP_OPTION_OBSERVE) < 0)
+    {
+        /* Server ended the observation */
+        char path_str[sizeof(obs->path) + 1];
+
+        LOG_WRN("Observation of %s ended. Code: %d.%02d",
+                log_strdup(str_terminate(path_str, sizeof(path_str), obs->path, obs->path_len)), code >> 5, code & 0x1f);
+        obs->in_use = false;
+
+        if (type == COAP_TYPE_CON)
+            empty_send(COAP_TYPE_ACK, mid);
+
+        return;
+    }
+
+    /* CON is acked by the core once handled. Dropped ones are acked here
+     * so the server doesn't keep retransmitting them. */
+    if (!message_deliver(pkt, obs, type == COAP_TYPE_CON ? cloud_qos_at_least_once : cloud_qos_at_most_once, mid) &&
+        type == COAP_TYPE_CON)
+        empty_send(COAP_TYPE_ACK, mid);
+}
+
+int pyrinas_cloud_transport_connect(const char *client_id, size_t client_id_len, struct sockaddr_storage *server,
+                                    pyrinas_cloud_transport_evt_handler_t handler)
+{
+    int err;
+
+    /* Identity comes from the DTLS credentials and the topics */
+    ARG_UNUSED(client_id);
+    ARG_UNUSED(client_id_len);
+
+    evt_handler = handler;
+
+    sock = socket(server->ss_family, SOCK_DGRAM, COAP_PROTO);
+    if (sock < 0)
+        return -errno;
+
+#if defined(CONFIG_PYRINAS_CLOUD_COAP_DTLS)
+    int verify = CONFIG_PYRINAS_CLOUD_PEER_VERIFY;
+    int session_cache = IS_ENABLED(CONFIG_PYRINAS_CLOUD_TLS_SESSION_CACHE) ? TLS_SESSION_CACHE_ENABLED : TLS_SESSION_CACHE_DISABLED;
+
+    if (setsockopt(sock, SOL_TLS, TLS_SEC_TAG_LIST, sec_tag_list, sizeof(sec_tag_list)) ||
+        setsockopt(sock, SOL_TLS, TLS_HOSTNAME, CONFIG_PYRINAS_CLOUD_MQTT_BROKER_HOSTNAME,
+                   strlen(CONFIG_PYRINAS_CLOUD_MQTT_BROKER_HOSTNAME)) ||
+        setsockopt(sock, SOL_TLS, TLS_PEER_VERIFY, &verify, sizeof(verify)) ||
+        setsockopt(sock, SOL_TLS, TLS_SESSION_CACHE, &session_cache, sizeof(session_cache)))
+    {
+        err = -errno;
+        LOG_ERR("Unable to configure DTLS. Err: %d", err);
+        goto error;
+    }
+#endif
+
+    /* Does the DTLS handshake */
+    if (connect(sock, (struct sockaddr *)server,
+                server->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)))
+    {
+        err = -errno;
+        goto error;
+    }
+
+    /* Observations don't outlive the link. The connect reports no session
+     * so the core registers them again. */
+    memset(pending, 0, sizeof(pending));
+    memset(observations, 0, sizeof(observations));
+    ping_pending = false;
+
+    last_tx = k_uptime_get();
+
+    /* There's no CONNACK. Reported from the cloud thread on the next live. */
+    connect_pending = true;
+
+    return 0;
+
+error:
+    close(sock);
+    sock = -1;
+
+    return err;
+}
+
+static void link_close(int result)
+{
+    struct pyrinas_cloud_transport_evt evt = {
+        .type = transport_evt_disconnected,
+        .result = result,
+    };
+
+    (void)close(sock);
+    sock = -1;
+    connect_pending = false;
+
+    evt_send(&evt);
+}
+
+int pyrinas_cloud_transport_disconnect(void)
+{
+    if (sock < 0)
+        return -ENOTCONN;
+
+    /* Nothing to tell the server. Observations lapse on their own. */
+    link_close(0);
+
+    return 0;
+}
+
+void pyrinas_cloud_transport_abort(void)
+{
+    if (sock >= 0)
+        link_close(-ECONNABORTED);
+}
+
+int pyrinas_cloud_transport_publish(const struct pyrinas_cloud_transport_publish *p)
+{
+    struct coap_pending *pub = NULL;
+    struct coap_packet pkt;
+    uint8_t *buf = tx_buf;
+    size_t size = sizeof(tx_buf);
+    bool confirmable = p->qos == cloud_qos_at_least_once;
+    uint16_t mid = coap_next_id();
+    int err;
+
+    if (confirmable)
+    {
+        for (int i = 0; i < ARRAY_SIZE(pending) && pub == NULL; i++)
+        {
+            if (!pending[i].in_use)
+                pub = &pending[i];
+        }
+
+        if (pub == NULL)
+            return -ENOMEM;
+
+        buf = pub->buf;
+        size = sizeof(pub->buf);
+    }
+
+    /* No token. Saves bytes on every publish. */
+    err = coap_packet_init(&pkt, buf, size, COAP_VERSION_1, confirmable ? COAP_TYPE_CON : COAP_TYPE_NON_CON,
+                           0, NULL, COAP_METHOD_PUT, mid);
+    if (err < 0)
+        return err;
+
+    err = path_append(&pkt, p->topic, p->topic_len);
+    if (err < 0)
+        return err;
+
+    if (p->data_len)
+    {
+        err = coap_packet_append_payload_marker(&pkt);
+        if (err < 0)
+            return err;
+
+        err = coap_packet_append_payload(&pkt, (uint8_t *)p->data, p->data_len);
+        if (err < 0)
+            return err;
+    }
+
+    err = datagram_send(pkt.data, pkt.offset);
+    if (err || !confirmable)
+        return err;
+
+    pub->in_use = true;
+    pub->message_id = p->message_id;
+    pub->len = pkt.offset;
+    retransmit_init(&pub->rt, mid);
+
+    return 0;
+}
+
+int pyrinas_cloud_transport_subscribe(const struct pyrinas_cloud_transport_topic *topics, size_t count,
+                                      uint16_t message_id)
+{
+    int err = 0;
+
+    if (count > ARRAY_SIZE(observations))
+        return -EINVAL;
+
+    /* Starts over. Anything observed is registered again. */
+    memset(observations, 0, sizeof(observations));
+
+    for (size_t i = 0; i < count; i++)
+    {
+        struct coap_observation *obs = &observations[i];
+        size_t len = topics[i].topic_len;
+
+        /* Observing a path covers everything under it */
+        if (len >= 2 && memcmp(&topics[i].topic[len - 2], "/#", 2) == 0)
+            len -= 2;
+
+        if (len > sizeof(obs->path))
+            return -EMSGSIZE;
+
+        obs->wildcard = len != topics[i].topic_len;
+
+        memcpy(obs->path, topics[i].topic, len);
+        obs->path_len = len;
+        obs->message_id = message_id;
+        obs->state = observation_waiting;
+        sys_rand_get(obs->token, sizeof(obs->token));
+        obs->in_use = true;
+
+        retransmit_init(&obs->rt, coap_next_id());
+
+        /* Retransmitted from live if lost */
+        err = observation_send(obs, COAP_OBSERVE_REGISTER, COAP_TYPE_CON, obs->rt.mid);
+        if (err)
+        {
+            char path_str[sizeof(obs->path) + 1];
+
+            LOG_WRN("Unable to observe %s. Err: %d",
+                    log_strdup(str_terminate(path_str, sizeof(path_str), obs->path, len)), err);
+        }
+    }
+
+    return err;
+}
+
+int pyrinas_cloud_transport_unsubscribe(const struct pyrinas_cloud_transport_topic *topic, uint16_t message_id)
+{
+    size_t len = topic->topic_len;
+
+    ARG_UNUSED(message_id);
+
+    if (len >= 2 && memcmp(&topic->topic[len - 2], "/#", 2) == 0)
+        len -= 2;
+
+    for (int i = 0; i < ARRAY_SIZE(observations); i++)
+    {
+        struct coap_observation *obs = &observations[i];
+
+        if (!obs->in_use || obs->path_len != len || memcmp(obs->path, topic->topic, len) != 0)
+            continue;
+
+        obs->in_use = false;
+
+        /* Best effort. Later notifications get a reset either way. */
+        return observation_send(obs, COAP_OBSERVE_DEREGISTER, COAP_TYPE_NON_CON, coap_next_id());
+    }
+
+    return -ENOENT;
+}
+
+int pyrinas_cloud_transport_read(uint8_t *buf, size_t len)
+{
+    if (rx_payload == NULL)
+        return -EINVAL;
+
+    len = MIN(len, rx_payload_len - rx_offset);
+
+    memcpy(buf, &rx_payload[rx_offset], len);
+    rx_offset += len;
+
+    return len;
+}
+
+int pyrinas_cloud_transport_ack(uint16_t message_id)
+{
+    return empty_send(COAP_TYPE_ACK, message_id);
+}
+
+int pyrinas_cloud_transport_input(void)
+{
+    struct coap_packet pkt;
+    uint8_t token[COAP_TOKEN_MAX_LEN];
+    int err;
+
+    int len = recv(sock, rx_buf, sizeof(rx_buf), MSG_DONTWAIT);
+    if (len < 0)
+        return errno == EAGAIN ? 0 : -errno;
+
+    err = coap_packet_parse(&pkt, rx_buf, len, NULL, 0);
+    if (err < 0)
+    {
+        LOG_WRN("Dropping malformed datagram. Err: %d", err);
+        return 0;
+    }
+
+    uint8_t type = coap_header_get_type(&pkt);
+    uint8_t code = coap_header_get_code(&pkt);
+    uint16_t mid = coap_header_get_id(&pkt);
+    uint8_t token_len = coap_header_get_token(&pkt, token);
+
+    switch (type)
+    {
+    case COAP_TYPE_ACK:
+        ack_handle(&pkt, mid, code);
+        break;
+    case COAP_TYPE_RESET:
+        reset_handle(mid);
+        break;
+    default:
+        request_handle(&pkt, type, mid, code, token, token_len);
+        break;
+    }
+
+    return 0;
+}
+
+/* Returns -ETIMEDOUT once a CON runs out of retries. Publishes stay in
+ * flight with the core and go again after the reconnect. */
+static int retransmit_process(int64_t now)
+{
+    if (ping_pending && now >= ping_rt.next_tx)
+    {
+        if (!retransmit_next(&ping_rt))
+        {
+            LOG_WRN("Ping unanswered");
+            return -ETIMEDOUT;
+        }
+
+        empty_send(COAP_TYPE_CON, ping_rt.mid);
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(pending); i++)
+    {
+        struct coap_pending *pub = &pending[i];
+
+        if (!pub->in_use || now < pub->rt.next_tx)
+            continue;
+
+        if (!retransmit_next(&pub->rt))
+        {
+            LOG_WRN("Publish %u unanswered", pub->message_id);
+            return -ETIMEDOUT;
+        }
+
+        LOG_DBG("Retransmitting %u", pub->message_id);
+        datagram_send(pub->buf, pub->len);
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(observations); i++)
+    {
+        struct coap_observation *obs = &observations[i];
+
+        if (!obs->in_use || obs->state != observation_waiting || now < obs->rt.next_tx)
+            continue;
+
+        if (!retransmit_next(&obs->rt))
+        {
+            LOG_WRN("Observe %u unanswered", obs->rt.mid);
+            return -ETIMEDOUT;
+        }
+
+        observation_send(obs, COAP_OBSERVE_REGISTER, COAP_TYPE_CON, obs->rt.mid);
+    }
+
+    return 0;
+}
+
+int pyrinas_cloud_transport_live(void)
+{
+    int64_t now = k_uptime_get();
+
+    if (connect_pending)
+    {
+        struct pyrinas_cloud_transport_evt evt = {
+            .type = transport_evt_connected,
+            .session_present = false,
+        };
+
+        connect_pending = false;
+        evt_send(&evt);
+    }
+
+    int err = retransmit_process(now);
+    if (err)
+    {
+        /* Dead link. The disconnect tells the core. */
+        link_close(err);
+        return err;
+    }
+
+    if (ping_pending || now - last_tx < CONFIG_PYRINAS_CLOUD_COAP_KEEPALIVE * MSEC_PER_SEC)
+        return -EAGAIN;
+
+    /* Empty CON. The reset that comes back keeps the NAT binding and shows
+     * the server still knows us. */
+    retransmit_init(&ping_rt, coap_next_id());
+
+    err = empty_send(COAP_TYPE_CON, ping_rt.mid);
+    if (err)
+        return err;
+
+    ping_pending = true;
+
+    return 0;
+}
+
+int pyrinas_cloud_transport_time_left(void)
+{
+    int64_t now = k_uptime_get();
+    int64_t next = last_tx + CONFIG_PYRINAS_CLOUD_COAP_KEEPALIVE * MSEC_PER_SEC;
+
+    if (connect_pending)
+        return 0;
+
+    /* Next ping waits for this one */
+    if (ping_pending)
+        next = ping_rt.next_tx;
+
+    for (int i = 0; i < ARRAY_SIZE(pending); i++)
+    {
+        if (pending[i].in_use)
+            next = MIN(next, pending[i].rt.next_tx);
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(observations); i++)
+    {
+        if (observations[i].in_use && observations[i].state == observation_waiting)
+            next = MIN(next, observations[i].rt.next_tx);
+    }
+
+    return MAX(next - now, 0);
+}
+
+int pyrinas_cloud_transport_socket(void)
+{
+    return sock;
+}
@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <string.h>
+#include <net/mqtt.h>
+#include <net/socket.h>
+
+#include "pyrinas_cloud_transport.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(pyrinas_cloud_transport_mqtt);
+
+#if !defined(CONFIG_MQTT_LIB_TLS)
+#error CONFIG_MQTT_LIB_TLS must be defined!
+#endif /* defined(CONFIG_MQTT_LIB_TLS) */
+
+/* Security tag for fetching certs */
+static sec_tag_t sec_tag_list[] = {CONFIG_PYRINAS_CLOUD_SEC_TAG};
+
+/* Buffers for MQTT client. */
+static uint8_t rx_buffer[CONFIG_PYRINAS_CLOUD_MQTT_MESSAGE_BUFFER_SIZE];
+static uint8_t tx_buffer[CONFIG_PYRINAS_CLOUD_MQTT_MESSAGE_BUFFER_SIZE];
+
+/* The mqtt client struct */
+static struct mqtt_client client;
+
+static pyrinas_cloud_transport_evt_handler_t evt_handler;
+
+static enum mqtt_qos qos_get(enum pyrinas_cloud_qos qos)
+{
+    return qos == cloud_qos_at_most_once ? MQTT_QOS_0_AT_MOST_ONCE : MQTT_QOS_1_AT_LEAST_ONCE;
+}
+
+/**@brief MQTT client event handler
+ */
+static void mqtt_evt_handler(struct mqtt_client *const c, const struct mqtt_evt *evt)
+{
+    struct pyrinas_cloud_transport_evt out = {.result = evt->result};
+
+    switch (evt->type)
+    {
+    case MQTT_EVT_CONNACK:
+        out.type = transport_evt_connected;
+        out.session_present = evt->param.connack.session_present_flag;
+        break;
+
+    case MQTT_EVT_DISCONNECT:
+        out.type = transport_evt_disconnected;
+        break;
+
+    case MQTT_EVT_PUBLISH:
+    {
+        const struct mqtt_publish_param *p = &evt->param.publish;
+
+        out.type = transport_evt_message;
+        out.message.topic = p->message.topic.topic.utf8;
+        out.message.topic_len = p->message.topic.topic.size;
+        out.message.payload_len = p->message.payload.len;
+        out.message.message_id = p->message_id;
+        out.message.qos = p->message.topic.qos == MQTT_QOS_0_AT_MOST_ONCE ? cloud_qos_at_most_once : cloud_qos_at_least_once;
+        break;
+    }
+
+    case MQTT_EVT_PUBACK:
+        out.type = transport_evt_ack;
+        out.message_id = evt->param.puback.message_id;
+        break;
+
+    case MQTT_EVT_SUBACK:
+        out.type = transport_evt_suback;
+        out.message_id = evt->param.suback.message_id;
+
+        /* 0x80 is failure for that topic */
+        for (int i = 0; i < evt->param.suback.return_codes.len && out.result == 0; i++)
+        {
+            if (evt->param.suback.return_codes.data[i] == MQTT_SUBACK_FAILURE)
+                out.result = -EACCES;
+        }
+
+        break;
+
+    default:
+        LOG_DBG("[%s:%d] default: %d", __func__, __LINE__, evt->type);
+        return;
+    }
+
+    if (evt_handler)
+        evt_handler(&out);
+}
+
+/**@brief Initialize the MQTT client structure
+ */
+static void client_init(struct mqtt_client *client, const char *p_client_id, size_t client_id_sz,
+                        struct sockaddr_storage *broker)
+{
+    mqtt_client_init(client);
+
+    /* MQTT client configuration */
+    client->broker = broker;
+    client->evt_cb = mqtt_evt_handler;
+    client->client_id.utf8 = (const uint8_t *)p_client_id;
+    client->client_id.size = client_id_sz;
+    client->password = NULL;
+    client->user_name = NULL;
+    client->protocol_version = MQTT_VERSION_3_1_1;
+    client->clean_session = !IS_ENABLED(CONFIG_PYRINAS_CLOUD_PERSISTENT_SESSION);
+
+    /* MQTT buffers configuration */
+    client->rx_buf = rx_buffer;
+    client->rx_buf_size = sizeof(rx_buffer);
+    client->tx_buf = tx_buffer;
+    client->tx_buf_size = sizeof(tx_buffer);
+
+    /* MQTT transport configuration */
+    struct mqtt_sec_config *tls_config = &client->transport.tls.config;
+
+    client->transport.type = MQTT_TRANSPORT_SECURE;
+    tls_config->peer_verify = CONFIG_PYRINAS_CLOUD_PEER_VERIFY;
+    tls_config->cipher_count = 0;
+    tls_config->cipher_list = NULL;
+    tls_config->sec_tag_count = ARRAY_SIZE(sec_tag_list);
+    tls_config->sec_tag_list = sec_tag_list;
+    tls_config->hostname = CONFIG_PYRINAS_CLOUD_MQTT_BROKER_HOSTNAME;
+    tls_config->session_cache = IS_ENABLED(CONFIG_PYRINAS_CLOUD_TLS_SESSION_CACHE) ? TLS_SESSION_CACHE_ENABLED : TLS_SESSION_CACHE_DISABLED;
+}
+
+int pyrinas_cloud_transport_connect(const char *client_id, size_t client_id_len, struct sockaddr_storage *server,
+                                    pyrinas_cloud_transport_evt_handler_t handler)
+{
+    evt_handler = handler;
+
+    client_init(&client, client_id, client_id_len, server);
+
+    /* Returns once TCP and TLS are up. CONNACK comes through mqtt_input. */
+    return mqtt_connect(&client);
+}
+
+int pyrinas_cloud_transport_disconnect(void)
+{
+    return mqtt_disconnect(&client);
+}
+
+void pyrinas_cloud_transport_abort(void)
+{
+    mqtt_abort(&client);
+}
+
+int pyrinas_cloud_transport_publish(const struct pyrinas_cloud_transport_publish *p)
+{
+    struct mqtt_publish_param param;
+
+    param.message.topic.qos = qos_get(p->qos);
+    param.message.topic.topic.utf8 = p->topic;
+    param.message.topic.topic.size = p->topic_len;
+    param.message.payload.data = (uint8_t *)p->data;
+    param.message.payload.len = p->data_len;
+    param.message_id = p->message_id;
+    param.dup_flag = p->dup;
+    param.retain_flag = 0;
+
+    return mqtt_publish(&client, &param);
+}
+
+int pyrinas_cloud_transport_subscribe(const struct pyrinas_cloud_transport_topic *topics, size_t count,
+                                      uint16_t message_id)
+{
+    struct mqtt_topic subscribe_topics[PYRINAS_CLOUD_TRANSPORT_TOPICS_MAX];
+
+    if (count > ARRAY_SIZE(subscribe_topics))
+        return -EINVAL;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        subscribe_topics[i].topic.utf8 = topics[i].topic;
+        subscribe_topics[i].topic.size = topics[i].topic_len;
+        subscribe_topics[i].qos = MQTT_QOS_1_AT_LEAST_ONCE;
+    }
+
+    const struct mqtt_subscription_list subscription_list = {
+        .list = subscribe_topics, .list_count = count, .message_id = message_id};
+
+    return mqtt_subscribe(&client, &subscription_list);
+}
+
+int pyrinas_cloud_transport_unsubscribe(const struct pyrinas_cloud_transport_topic *topic, uint16_t message_id)
+{
+    struct mqtt_topic unsubscribe_topic = {
+        .topic = {.utf8 = topic->topic,
+                  .size = topic->topic_len},
+        .qos = MQTT_QOS_1_AT_LEAST_ONCE};
+
+    const struct mqtt_subscription_list subscription_list = {
+        .list = &unsubscribe_topic, .list_count = 1, .message_id = message_id};
+
+    return mqtt_unsubscribe(&client, &subscription_list);
+}
+
+int pyrinas_cloud_transport_read(uint8_t *buf, size_t len)
+{
+    return mqtt_read_publish_payload_blocking(&client, buf, len);
+}
+
+int pyrinas_cloud_transport_ack(uint16_t message_id)
+{
+    const struct mqtt_puback_param ack = {
+        .message_id = message_id};
+
+    return mqtt_publish_qos1_ack(&client, &ack);
+}
+
+int pyrinas_cloud_transport_input(void)
+{
+    return mqtt_input(&client);
+}
+
+int pyrinas_cloud_transport_live(void)
+{
+    return mqtt_live(&client);
+}
+
+int pyrinas_cloud_transport_time_left(void)
+{
+    return mqtt_keepalive_time_left(&client);
+}
+
+int pyrinas_cloud_transport_socket(void)
+{
+    return client.transport.tls.sock;
+}
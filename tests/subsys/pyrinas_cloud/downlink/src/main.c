@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2021 Circuit Dojo LLC
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <ztest.h>
+#include <string.h>
+
+#include "pyrinas_cloud_downlink.h"
+#include "pyrinas_cloud_peripheral.h"
+
+/* Two peripherals as the central's connections report them */
+static const uint8_t addr_a[PERIPHERAL_ADDR_LEN] = {0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
+static const uint8_t addr_b[PERIPHERAL_ADDR_LEN] = {0xa1, 0xb2, 0xc3, 0xd4, 0xe5, 0xf6};
+
+static uint8_t sent_addr[PERIPHERAL_ADDR_LEN];
+static int sent_count;
+static int send_err;
+
+/* Stands in for ble_publish_raw_to() */
+static int downlink_send(const uint8_t *peripheral_addr, pyrinas_event_t *evt)
+{
+    if (send_err)
+        return send_err;
+
+    memcpy(sent_addr, peripheral_addr, sizeof(sent_addr));
+    sent_count++;
+
+    return 0;
+}
+
+/* An uplink from addr. Returns the uid the backend sees in its topic. */
+static void uplink(const uint8_t *addr, char *uid)
+{
+    struct pyrinas_cloud_peripheral_topics topics;
+
+    pyrinas_cloud_peripheral_seen(addr, 0, &topics);
+
+    /* <uid>/tel/pub */
+    memcpy(uid, topics.telemetry, PERIPHERAL_UID_LEN);
+    uid[PERIPHERAL_UID_LEN] = '\0';
+}
+
+/* What the backend sends back to uid */
+static int downlink(const char *uid)
+{
+    char suffix[PERIPHERAL_UID_LEN + sizeof("/ping")];
+    const uint8_t data[] = "1";
+
+    snprintf(suffix, sizeof(suffix), "%s/ping", uid);
+
+    return pyrinas_cloud_downlink_route(suffix, strlen(suffix), data, sizeof(data));
+}
+
+/* Every test starts with an empty registry */
+static void setup(void)
+{
+    pyrinas_cloud_peripheral_lock();
+
+    for (size_t i = 0; i < CONFIG_PYRINAS_CLOUD_PERIPHERAL_COUNT; i++)
+    {
+        struct pyrinas_cloud_peripheral *peripheral = pyrinas_cloud_peripheral_at(i);
+
+        if (peripheral)
+            memset(peripheral, 0, sizeof(*peripheral));
+    }
+
+    pyrinas_cloud_peripheral_unlock();
+
+    memset(sent_addr, 0, sizeof(sent_addr));
+    sent_count = 0;
+    send_err = 0;
+}
+
+static void test_uplink_uid_routes_back(void)
+{
+    char uid_a[PERIPHERAL_UID_LEN + 1];
+    char uid_b[PERIPHERAL_UID_LEN + 1];
+
+    uplink(addr_a, uid_a);
+    uplink(addr_b, uid_b);
+
+    zassert_equal(downlink(uid_b), 0, "Route failed");
+    zassert_equal(sent_count, 1, "Not sent");
+    zassert_mem_equal(sent_addr, addr_b, sizeof(addr_b), "Sent to the wrong connection");
+
+    zassert_equal(downlink(uid_a), 0, "Route failed");
+    zassert_equal(sent_count, 2, "Not sent");
+    zassert_mem_equal(sent_addr, addr_a, sizeof(addr_a), "Sent to the wrong connection");
+}
+
+static void test_queued_until_connected(void)
+{
+    char uid[PERIPHERAL_UID_LEN + 1];
+
+    uplink(addr_a, uid);
+
+    /* Gone before the reply came */
+    pyrinas_cloud_peripheral_disconnected(addr_a);
+    send_err = -ENOTCONN;
+
+    zassert_equal(downlink(uid), 0, "Not queued");
+    zassert_equal(sent_count, 0, "Sent while disconnected");
+
+    /* Back on the same address */
+    send_err = 0;
+    pyrinas_cloud_peripheral_connected(addr_a);
+
+    zassert_equal(sent_count, 1, "Queue not flushed");
+    zassert_mem_equal(sent_addr, addr_a, sizeof(addr_a), "Sent to the wrong connection");
+}
+
+static void test_busy_retried_on_next_downlink(void)
+{
+    char uid[PERIPHERAL_UID_LEN + 1];
+
+    uplink(addr_b, uid);
+    pyrinas_cloud_peripheral_connected(addr_b);
+
+    /* Still connected, just couldn't take it */
+    send_err = -EAGAIN;
+    zassert_equal(downlink(uid), 0, "Not queued");
+    zassert_equal(sent_count, 0, "Sent while busy");
+
+    /* The next one goes out behind it */
+    send_err = 0;
+    zassert_equal(downlink(uid), 0, "Route failed");
+    zassert_equal(sent_count, 2, "Queue not retried");
+}
+
+void test_main(void)
+{
+    pyrinas_cloud_register_downlink(downlink_send);
+
+    ztest_test_suite(pyrinas_cloud_downlink,
+                     ztest_unit_test_setup_teardown(test_uplink_uid_routes_back, setup, unit_test_noop),
+                     ztest_unit_test_setup_teardown(test_queued_until_connected, setup, unit_test_noop),
+                     ztest_unit_test_setup_teardown(test_busy_retried_on_next_downlink, setup, unit_test_noop));
+
+    ztest_run_test_suite(pyrinas_cloud_downlink);
+}